@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+typedef struct Chunk
+{
+    struct Chunk *next;
+    size_t size; // usable bytes after the header
+} Chunk;
+
+struct Arena
+{
+    Chunk *chunks; // most recent chunk first
+    char *cur;     // next free byte in chunks
+    char *end;
+};
+
+#define CHUNK_HDR ALIGN_UP(sizeof(Chunk))
+#define ARENA_HDR ALIGN_UP(sizeof(Arena))
+
+static void add_chunk(Arena *A, Chunk *c, size_t size, size_t skip)
+{
+    c->next = A->chunks;
+    c->size = size;
+    A->chunks = c;
+    A->cur = (char *)c + CHUNK_HDR + skip;
+    A->end = (char *)c + CHUNK_HDR + size;
+}
+
+// creates an arena whose first chunk holds at least size_hint bytes
+Arena *arena_new(size_t size_hint)
+{
+    size_t size = ALIGN_UP(size_hint) + ARENA_HDR;
+    Chunk *c = malloc(CHUNK_HDR + size);
+    Arena *A = (Arena *)((char *)c + CHUNK_HDR);
+
+    A->chunks = NULL;
+    add_chunk(A, c, size, ARENA_HDR);
+    return A;
+}
+
+void *arena_alloc(Arena *A, size_t size)
+{
+    void *p;
+
+    size = ALIGN_UP(size);
+
+    if ((size_t)(A->end - A->cur) < size)
+    { // grow geometrically so a bad size hint still costs O(log n) mallocs
+        size_t chunk = A->chunks->size * 2;
+
+        if (chunk < size)
+            chunk = size;
+        add_chunk(A, malloc(CHUNK_HDR + chunk), chunk, 0);
+    }
+
+    p = A->cur;
+    A->cur += size;
+    return p;
+}
+
+char *arena_strndup(Arena *A, const char *s, size_t n)
+{
+    char *d = arena_alloc(A, n + 1);
+
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
+// frees every allocation, and the arena itself
+void arena_free(Arena *A)
+{
+    Chunk *c, *next;
+
+    if (!A)
+        return;
+
+    // the arena header lives in the oldest chunk, free it last
+    for (c = A->chunks; c; c = next)
+    {
+        next = c->next;
+        free(c);
+    }
+}
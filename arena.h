@@ -0,0 +1,20 @@
+#ifndef _arena_h_
+#define _arena_h_
+
+#include <stddef.h>
+
+/* Bump allocator.
+ *
+ * Everything allocated from an arena is released at once by
+ * arena_free(), individual allocations are never freed.  The arena
+ * header lives in its first chunk, so an arena that is sized well up
+ * front costs a single malloc() and a single free(). */
+
+typedef struct Arena Arena;
+
+Arena* arena_new (size_t size_hint);
+void* arena_alloc (Arena* A, size_t size);
+char* arena_strndup (Arena* A, const char* s, size_t n);
+void arena_free (Arena* A);
+
+#endif /* _arena_h_ */
@@ -0,0 +1,81 @@
+#ifndef _bench_h_
+#define _bench_h_
+
+/* Helpers shared by the benchmarks.
+ *
+ * A benchmark collects samples (ns per operation) with bench_add() and
+ * reports them with bench_report(), which prints one JSON object per
+ * line so results can be appended to a file and compared over time:
+ *
+ *   {"bench":"parse","case":"short","bytes":14,"samples":50,"unit":"ns/op",
+ *    "mean":212.4,"min":198.0,"p50":208.0,"p99":301.0}
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct
+{
+    double *ns; // per operation
+    int n;
+    int cap;
+} BenchSamples;
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// adds one sample: elapsed ns since start, spread over ops operations
+static inline void bench_add(BenchSamples *s, uint64_t start, long ops)
+{
+    if (s->n == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->ns = realloc(s->ns, s->cap * sizeof(*s->ns));
+    }
+    s->ns[s->n++] = (double)(bench_now_ns() - start) / ops;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Prints the samples as one JSON line and empties s.  params is a printf
+ * format for extra "key":value pairs describing the case (may be ""). */
+static inline void bench_report(const char *bench, const char *name, BenchSamples *s, const char *params, ...)
+{
+    double sum = 0;
+    va_list ap;
+    int i;
+
+    if (!s->n)
+        return;
+
+    qsort(s->ns, s->n, sizeof(*s->ns), bench_cmp);
+    for (i = 0; i < s->n; i++)
+    {
+        sum += s->ns[i];
+    }
+
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",", bench, name);
+    va_start(ap, params);
+    if (vprintf(params, ap) > 0)
+        printf(",");
+    va_end(ap);
+    printf("\"samples\":%d,\"unit\":\"ns/op\",\"mean\":%.1f,\"min\":%.1f,\"p50\":%.1f,\"p99\":%.1f}\n",
+           s->n, sum / s->n, s->ns[0], s->ns[s->n / 2], s->ns[(int)(s->n * 0.99)]);
+    fflush(stdout);
+
+    s->n = 0;
+}
+
+#endif /* _bench_h_ */
@@ -0,0 +1,152 @@
+/* Filename expansion benchmark.
+ *
+ * Fills a scratch directory with N files (one in ten a .log) and times
+ * expanding "echo *.log" there: with a cold listing cache (the directory
+ * is read with getdents64), with a warm one, and with glob(3) for
+ * comparison.  Then times "echo **" "/" "*.c" over a tree of 100
+ * directories of 100 files, next to a .git directory it must not
+ * descend into.
+ *
+ *     $ make bench/glob_expand && ./bench/glob_expand [files]
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+#include "parse.h"
+#include "expand.h"
+#include "bench.h"
+
+#define SAMPLES 20
+
+static BenchSamples samples;
+
+static void touch(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd == -1)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// parses and expands line, returns the number of words of its first task
+static int expand_line(const char *line)
+{
+    Parse *P = parse_cmdline((char *)line);
+    int n;
+
+    expand_task(&P->tasks[0], P->arena);
+    for (n = 0; P->tasks[0].argv[n]; n++)
+        ;
+    parse_destroy(&P);
+    return n;
+}
+
+static void bench_flat(int nfiles)
+{
+    char name[64];
+    uint64_t start;
+    glob_t g;
+    int i, n = 0;
+
+    for (i = 0; i < nfiles; i++)
+    {
+        snprintf(name, sizeof(name), i % 10 ? "file%07d.dat" : "file%07d.log", i);
+        touch(name);
+    }
+    sleep(1); // let the directory settle, so its listing may be cached
+
+    for (i = 0; i < SAMPLES; i++)
+    {
+        expand_flush();
+        start = bench_now_ns();
+        n = expand_line("echo *.log");
+        bench_add(&samples, start, 1);
+    }
+    bench_report("glob_expand", "cold", &samples, "\"files\":%d,\"matches\":%d", nfiles, n - 1);
+
+    for (i = 0; i < SAMPLES; i++)
+    {
+        start = bench_now_ns();
+        n = expand_line("echo *.log");
+        bench_add(&samples, start, 1);
+    }
+    bench_report("glob_expand", "warm", &samples, "\"files\":%d,\"matches\":%d", nfiles, n - 1);
+
+    for (i = 0; i < SAMPLES; i++)
+    {
+        start = bench_now_ns();
+        glob("*.log", 0, NULL, &g);
+        n = g.gl_pathc;
+        globfree(&g);
+        bench_add(&samples, start, 1);
+    }
+    bench_report("glob_expand", "glob(3)", &samples, "\"files\":%d,\"matches\":%d", nfiles, n);
+}
+
+static void bench_tree(void)
+{
+    char name[64];
+    uint64_t start;
+    int i, k, n = 0;
+
+    mkdir("tree", 0755);
+    mkdir("tree/.git", 0755);
+    for (i = 0; i < 100; i++)
+    {
+        snprintf(name, sizeof(name), "tree/.git/obj%03d", i);
+        mkdir(name, 0755);
+        for (k = 0; k < 100; k++)
+        {
+            snprintf(name, sizeof(name), "tree/.git/obj%03d/%03d.c", i, k);
+            touch(name);
+        }
+        snprintf(name, sizeof(name), "tree/dir%03d", i);
+        mkdir(name, 0755);
+        for (k = 0; k < 100; k++)
+        {
+            snprintf(name, sizeof(name), "tree/dir%03d/%03d.%s", i, k, k % 2 ? "c" : "h");
+            touch(name);
+        }
+    }
+    sleep(1);
+
+    for (i = 0; i < SAMPLES; i++)
+    {
+        expand_flush();
+        start = bench_now_ns();
+        n = expand_line("echo tree/**/*.c");
+        bench_add(&samples, start, 1);
+    }
+    bench_report("glob_expand", "globstar_cold", &samples, "\"files\":20000,\"matches\":%d", n - 1);
+}
+
+int main(int argc, char **argv)
+{
+    int nfiles = argc > 1 ? atoi(argv[1]) : 100000;
+    char dir[] = "/tmp/glob_expand.XXXXXX", cmd[64];
+
+    if (nfiles <= 0)
+        nfiles = 100000;
+
+    if (!mkdtemp(dir) || chdir(dir) == -1)
+    {
+        perror("glob_expand");
+        return EXIT_FAILURE;
+    }
+
+    bench_flat(nfiles);
+    bench_tree();
+
+    expand_flush();
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return system(cmd) ? EXIT_FAILURE : 0;
+}
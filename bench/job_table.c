@@ -0,0 +1,144 @@
+/* Job table benchmark.
+ *
+ * Fills the table with 10, 1k and 10k jobs of STAGES stages each (the
+ * pids are made up, nothing is started) and times the operations the
+ * shell does on it: lookups by pgid, pid and job id, reaping a stage
+ * (remove_child) and creating and deleting a job while the table is
+ * that full.
+ *
+ *     $ make bench/job_table && ./bench/job_table
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "bench.h"
+
+#define STAGES 3
+#define SAMPLES 30
+#define OPS 20000
+#define PID_BASE 100000
+
+static BenchSamples samples;
+
+static pid_t *make_pids(pid_t first)
+{
+    pid_t *pids = malloc(STAGES * sizeof(*pids));
+    int i;
+
+    for (i = 0; i < STAGES; i++)
+    {
+        pids[i] = first + i;
+    }
+    return pids;
+}
+
+static Job **fill(int njobs)
+{
+    Job **jobs = malloc(njobs * sizeof(*jobs));
+    int i;
+
+    for (i = 0; i < njobs; i++)
+    {
+        pid_t first = PID_BASE + i * STAGES;
+        jobs[i] = create_job(STAGES, first, make_pids(first), 1, "bench job");
+    }
+    return jobs;
+}
+
+static void bench(int njobs)
+{
+    Job **jobs = fill(njobs);
+    struct rusage ru;
+    uint64_t start;
+    volatile Job *sink;
+    pid_t spare = PID_BASE + njobs * STAGES;
+    long i;
+    int s;
+
+    memset(&ru, 0, sizeof(ru));
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < OPS; i++)
+        {
+            sink = find_job(PID_BASE + (i % njobs) * STAGES);
+        }
+        bench_add(&samples, start, OPS);
+    }
+    bench_report("job_table", "find_job", &samples, "\"jobs\":%d", njobs);
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < OPS; i++)
+        {
+            sink = find_job_by_pid(PID_BASE + (i * 7) % (njobs * STAGES));
+        }
+        bench_add(&samples, start, OPS);
+    }
+    bench_report("job_table", "find_job_by_pid", &samples, "\"jobs\":%d", njobs);
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < OPS; i++)
+        {
+            sink = find_job_by_id(1 + i % njobs);
+        }
+        bench_add(&samples, start, OPS);
+    }
+    bench_report("job_table", "find_job_by_id", &samples, "\"jobs\":%d", njobs);
+    (void)sink;
+
+    // a new job comes and goes while the table is full: create, reap every stage, delete
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < OPS / STAGES; i++)
+        {
+            Job *job = create_job(STAGES, spare, make_pids(spare), 1, "bench job");
+            int k;
+
+            for (k = 0; k < STAGES; k++)
+            {
+                remove_child(spare + k, 0, &ru);
+            }
+            delete_job(job);
+        }
+        bench_add(&samples, start, OPS / STAGES);
+    }
+    bench_report("job_table", "job_lifecycle", &samples, "\"jobs\":%d,\"stages\":%d", njobs, STAGES);
+
+    // reap every stage of the full table, one sample per job
+    for (i = 0; i < njobs; i++)
+    {
+        int k;
+
+        start = bench_now_ns();
+        for (k = 0; k < STAGES; k++)
+        {
+            remove_child(PID_BASE + i * STAGES + k, 0, &ru);
+        }
+        delete_job(jobs[i]);
+        bench_add(&samples, start, STAGES);
+    }
+    bench_report("job_table", "reap", &samples, "\"jobs\":%d", njobs);
+
+    if (job_count())
+    {
+        fprintf(stderr, "job_table: %d jobs left in the table\n", job_count());
+        exit(EXIT_FAILURE);
+    }
+    free(jobs);
+}
+
+int main()
+{
+    bench(10);
+    bench(1000);
+    bench(10000);
+    return 0;
+}
@@ -0,0 +1,113 @@
+/* Parser benchmark.
+ *
+ * Times parse_cmdline() on typical lines (short, long, heavily quoted,
+ * a list of pipelines) and on generated lines from 64 KiB up to 1 MiB.
+ * A linear time parser shows a flat ns/byte for the scaling cases.
+ *
+ *     $ make bench/parse_scaling && ./bench/parse_scaling
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse.h"
+#include "bench.h"
+
+#define MIN_LEN (64 * 1024)
+#define MAX_LEN (1024 * 1024)
+#define SAMPLES 50
+
+static BenchSamples samples;
+
+// fills buf with len bytes of repeated unit followed by a terminator
+static void make_line(char *buf, size_t len, const char *unit)
+{
+    size_t n = strlen(unit), i;
+
+    memcpy(buf, "cmd ", 4);
+    for (i = 4; i + n <= len; i += n)
+    {
+        memcpy(buf + i, unit, n);
+    }
+    buf[i] = '\0';
+}
+
+static void parse_once(const char *kind, char *line)
+{
+    Parse *P = parse_cmdline(line);
+
+    if (!P || P->invalid_syntax)
+    {
+        fprintf(stderr, "parse_scaling: %s line did not parse\n", kind);
+        exit(EXIT_FAILURE);
+    }
+    parse_destroy(&P);
+}
+
+// a typical command line, parsed over and over
+static void bench_line(const char *kind, const char *line)
+{
+    char *copy = strdup(line);
+    long ops = 200000 / (strlen(line) / 16 + 1);
+    uint64_t start;
+    long i;
+    int s;
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < ops; i++)
+        {
+            parse_once(kind, copy);
+        }
+        bench_add(&samples, start, ops);
+    }
+
+    bench_report("parse", kind, &samples, "\"bytes\":%zu", strlen(line));
+    free(copy);
+}
+
+static void bench_scaling(const char *kind, const char *unit)
+{
+    char *line = malloc(MAX_LEN + 1);
+    char name[32];
+    uint64_t start;
+    size_t len;
+    int rep;
+
+    snprintf(name, sizeof(name), "scaling_%s", kind);
+    for (len = MIN_LEN; len <= MAX_LEN; len *= 2)
+    {
+        make_line(line, len, unit);
+
+        for (rep = 0; rep < 5; rep++)
+        {
+            start = bench_now_ns();
+            parse_once(kind, line);
+            bench_add(&samples, start, len); // ns per byte
+        }
+        bench_report("parse", name, &samples, "\"bytes\":%zu,\"per\":\"byte\"", len);
+    }
+    free(line);
+}
+
+int main()
+{
+    char *long_line = malloc(4096 + 16);
+
+    make_line(long_line, 4096, "--option=value file.c | ");
+    strcat(long_line, "wc");
+
+    bench_line("short", "ls -l | wc -l");
+    bench_line("long", long_line);
+    bench_line("quoted", "grep \"a | b\" 'c < d' \"e f\"g'h i' \"\" '' > \"out file\" &");
+    bench_line("sequence", "make && ./test < in > out || echo failed; make clean &");
+
+    bench_scaling("plain", "argument ");
+    bench_scaling("quoted", "\"a | b < c\" 'x y' ");
+    bench_scaling("pipes", "a b | c d ");
+    bench_scaling("sequence", "a b && c d || e; ");
+
+    free(long_line);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/* PATH resolution benchmark.
+ *
+ * Times the command path cache (hash.c): a hit on a cached command, a
+ * miss (a command that is in no PATH directory, searched every time)
+ * and a cold lookup right after the table was flushed.
+ *
+ *     $ make bench/path_lookup && ./bench/path_lookup
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hash.h"
+#include "bench.h"
+
+#define SAMPLES 50
+
+static BenchSamples samples;
+
+static void bench(const char *name, const char *cmd, int flush, long ops)
+{
+    uint64_t start;
+    long i;
+    int s;
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < ops; i++)
+        {
+            if (flush)
+                hash_clear();
+            hash_lookup(cmd);
+        }
+        bench_add(&samples, start, ops);
+    }
+    bench_report("path_lookup", name, &samples, "\"cmd\":\"%s\"", cmd);
+}
+
+int main()
+{
+    const char *PATH = getenv("PATH");
+    int ndirs = 1;
+
+    for (; PATH && *PATH; PATH++)
+    {
+        ndirs += *PATH == ':';
+    }
+    fprintf(stderr, "path_lookup: %d PATH directories\n", ndirs);
+
+    if (!hash_lookup("sh"))
+    {
+        fprintf(stderr, "path_lookup: sh is not in PATH\n");
+        return 1;
+    }
+
+    bench("hit", "sh", 0, 100000);
+    bench("miss", "no-such-command-pssh", 0, 2000);
+    bench("cold", "sh", 1, 2000);
+    return 0;
+}
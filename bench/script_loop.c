@@ -0,0 +1,121 @@
+/* Loop overhead benchmark.
+ *
+ * Times one iteration of a for loop whose body is a pipeline, with the
+ * launch itself stubbed out: what is left is the shell's own work per
+ * iteration.  "compiled" runs the loop through script_run(), which
+ * parses the body once and resolves its commands ahead; "reparse" does
+ * what a shell reading the body again each time would: parse_cmdline(),
+ * expansion and a PATH lookup per command.
+ *
+ *     $ make bench/script_loop && ./bench/script_loop [iterations]
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "parse.h"
+#include "expand.h"
+#include "hash.h"
+#include "script.h"
+#include "pssh.h"
+#include "bench.h"
+
+#define SAMPLES 20
+#define BODY "cat -n --squeeze-blank notes.txt | grep -v \"%s\" | sort -r > out.txt"
+
+static BenchSamples samples;
+static long launched;
+
+// the parts of the shell a script drives, without the processes
+int interactive = 0;
+int last_status = 0;
+pid_t shell_pid = 0;
+
+const char *command_found(const char *cmd)
+{
+    return hash_lookup(cmd);
+}
+
+void shell_error(FILE *out, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(out, fmt, ap);
+    va_end(ap);
+}
+
+void execute_tasks(Parse *P, char *cmdline)
+{
+    int t;
+
+    (void)cmdline; // names a job, and the stub makes none
+    for (t = 0; t < P->ntasks; t++)
+    {
+        expand_task(&P->tasks[t], P->arena);
+        if (!P->tasks[t].path && !command_found(P->tasks[t].cmd))
+            abort();
+    }
+    launched++;
+}
+
+static void bench_compiled(long n)
+{
+    char *loop = malloc(sizeof(BODY) + 64);
+    uint64_t start;
+    int s;
+
+    snprintf(loop, sizeof(BODY) + 64, "for i in {1..%ld}; do " BODY "; done", n, "$i");
+    for (s = 0; s < SAMPLES; s++)
+    {
+        launched = 0;
+        start = bench_now_ns();
+        script_run(loop);
+        bench_add(&samples, start, n);
+        if (launched != n)
+            abort();
+    }
+    bench_report("script_loop", "compiled", &samples, "\"iterations\":%ld", n);
+    free(loop);
+}
+
+static void bench_reparse(long n)
+{
+    char line[sizeof(BODY) + 32], words[64];
+    uint64_t start;
+    Parse *W, *P;
+    char **w;
+    int s;
+
+    snprintf(words, sizeof(words), "for {1..%ld}", n);
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        W = parse_cmdline(words); // the loop words, expanded once as well
+        expand_task(&W->tasks[0], W->arena);
+        for (w = W->tasks[0].argv + 1; *w; w++)
+        {
+            snprintf(line, sizeof(line), BODY, *w);
+            P = parse_cmdline(line);
+            execute_tasks(P, P->text);
+            parse_destroy(&P);
+        }
+        parse_destroy(&W);
+        bench_add(&samples, start, n);
+    }
+    bench_report("script_loop", "reparse", &samples, "\"iterations\":%ld", n);
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 10000;
+
+    if (n <= 0)
+        n = 10000;
+    expand_var = script_var;
+
+    bench_compiled(n);
+    bench_reparse(n);
+    return 0;
+}
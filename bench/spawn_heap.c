@@ -0,0 +1,109 @@
+/* Spawn latency against the size of the shell.
+ *
+ * Grows the heap to 0, 64M, 256M and 1G of touched memory and times
+ * starting and reaping /bin/true through the fork server of pssh -S
+ * (started before the heap grew) and from the process itself: held
+ * launches (spawn_cmd_held, a real fork) and plain ones (posix_spawn,
+ * which vforks).  fork() copies page tables in proportion to the heap;
+ * the others should stay flat.
+ *
+ *     $ make bench/spawn_heap && ./bench/spawn_heap [iterations]
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+#include "forksrv.h"
+#include "bench.h"
+
+static char *true_argv[] = {"true", NULL};
+static const char *true_path = "/bin/true";
+
+static BenchSamples samples;
+
+// held launches as perfstat does them, released at once
+static pid_t launch_held(void)
+{
+    int release_fd;
+    pid_t pid = spawn_cmd_held(true_path, true_argv, STDIN_FILENO, STDOUT_FILENO, 0, &release_fd);
+
+    if (pid > 0)
+        close(release_fd);
+    return pid;
+}
+
+static pid_t launch_forksrv_held(void)
+{
+    int release_fd;
+    pid_t pid = forksrv_spawn(true_path, true_argv, STDIN_FILENO, STDOUT_FILENO, 0, &release_fd);
+
+    if (pid > 0)
+        close(release_fd);
+    return pid;
+}
+
+static pid_t launch_posix_spawn(void)
+{
+    return spawn_cmd(true_path, true_argv, STDIN_FILENO, STDOUT_FILENO, 0);
+}
+
+static pid_t launch_forksrv(void)
+{
+    return forksrv_spawn(true_path, true_argv, STDIN_FILENO, STDOUT_FILENO, 0, NULL);
+}
+
+static void bench(const char *name, pid_t (*launch)(void), int heap_mb, int iters)
+{
+    uint64_t start;
+    pid_t pid;
+    int i;
+
+    for (i = 0; i < iters; i++)
+    {
+        start = bench_now_ns();
+        pid = launch();
+        if (pid < 0)
+        {
+            perror(name);
+            exit(EXIT_FAILURE);
+        }
+        waitpid(pid, NULL, 0);
+        bench_add(&samples, start, 1);
+    }
+    bench_report("spawn_heap", name, &samples, "\"heap_mb\":%d", heap_mb);
+}
+
+int main(int argc, char **argv)
+{
+    static const int heap_mb[] = {0, 64, 256, 1024};
+    int iters = argc > 1 ? atoi(argv[1]) : 200;
+    int grown = 0, i;
+    char *heap;
+
+    if (iters <= 0)
+        iters = 200;
+
+    if (forksrv_start() == -1)
+    {
+        perror("forksrv_start");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        // every page touched, so that there is something to copy
+        heap = malloc((size_t)(heap_mb[i] - grown) << 20);
+        memset(heap, 1, (size_t)(heap_mb[i] - grown) << 20);
+        grown = heap_mb[i];
+
+        bench("fork_held", launch_held, grown, iters);
+        bench("forksrv_held", launch_forksrv_held, grown, iters);
+        bench("posix_spawn", launch_posix_spawn, grown, iters);
+        bench("forksrv", launch_forksrv, grown, iters);
+    }
+
+    return 0;
+}
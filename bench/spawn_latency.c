@@ -0,0 +1,155 @@
+/* Spawn latency benchmark.
+ *
+ * Compares the legacy vfork()-based launch that exec_cmd used to do
+ * (setpgid/dup2 in the child) with fork() and with the posix_spawn()
+ * engine in spawn.c, for a single command and for a pipeline, from
+ * the first spawn until every stage is reaped ("spawn_reap").  Also
+ * times how long setting up an N-stage pipeline keeps the shell busy,
+ * until the last stage has been started ("pipeline_setup").
+ *
+ *     $ make bench/spawn_latency && ./bench/spawn_latency [iterations]
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+#include "bench.h"
+
+#define STAGES 4
+
+typedef pid_t (*launch_fn)(const char *path, char **argv, int fd_in, int fd_out, pid_t pgid);
+
+static char *true_argv[] = {"true", NULL};
+static const char *true_path = "/bin/true";
+
+static pid_t launch_vfork(const char *path, char **argv, int fd_in, int fd_out, pid_t pgid)
+{
+    pid_t pid = vfork();
+
+    if (pid == 0)
+    {
+        setpgid(0, pgid);
+        if (fd_in != STDIN_FILENO)
+            dup2(fd_in, STDIN_FILENO);
+        if (fd_out != STDOUT_FILENO)
+            dup2(fd_out, STDOUT_FILENO);
+        execv(path, argv);
+        _exit(127);
+    }
+    setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+static pid_t launch_fork(const char *path, char **argv, int fd_in, int fd_out, pid_t pgid)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        setpgid(0, pgid);
+        if (fd_in != STDIN_FILENO)
+            dup2(fd_in, STDIN_FILENO);
+        if (fd_out != STDOUT_FILENO)
+            dup2(fd_out, STDOUT_FILENO);
+        execv(path, argv);
+        _exit(127);
+    }
+    setpgid(pid, pgid ? pgid : pid);
+    return pid;
+}
+
+static BenchSamples samples;
+
+/* launches an n-stage pipeline of true and waits for all of it,
+ * setup_start (if given) gets a sample once every stage is started */
+static void run_pipeline(launch_fn launch, int n, uint64_t *setup_start)
+{
+    int fd[2], in = STDIN_FILENO, out, i;
+    pid_t pgid = 0, pid;
+
+    for (i = 0; i < n; i++)
+    {
+        if (i < n - 1)
+        {
+            pipe2(fd, O_CLOEXEC);
+            out = fd[1];
+        }
+        else
+        {
+            out = STDOUT_FILENO;
+        }
+
+        pid = launch(true_path, true_argv, in, out, pgid);
+        if (!pgid)
+            pgid = pid;
+
+        if (in != STDIN_FILENO)
+            close(in);
+        if (out != STDOUT_FILENO)
+            close(out);
+        in = fd[0];
+    }
+
+    if (setup_start)
+        bench_add(&samples, *setup_start, 1);
+
+    for (i = 0; i < n; i++)
+    {
+        wait(NULL);
+    }
+}
+
+static void bench(const char *name, launch_fn launch, int stages, int iters)
+{
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < iters; i++)
+    {
+        start = bench_now_ns();
+        run_pipeline(launch, stages, NULL);
+        bench_add(&samples, start, 1);
+    }
+    bench_report("spawn_reap", name, &samples, "\"stages\":%d", stages);
+}
+
+static void bench_setup(int stages, int iters)
+{
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < iters; i++)
+    {
+        start = bench_now_ns();
+        run_pipeline(spawn_cmd, stages, &start);
+    }
+    bench_report("pipeline_setup", "posix_spawn", &samples, "\"stages\":%d", stages);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = argc > 1 ? atoi(argv[1]) : 500;
+    int i;
+
+    if (iters <= 0)
+        iters = 500;
+
+    bench("vfork", launch_vfork, 1, iters);
+    bench("fork", launch_fork, 1, iters);
+    bench("posix_spawn", spawn_cmd, 1, iters);
+
+    bench("vfork", launch_vfork, STAGES, iters);
+    bench("fork", launch_fork, STAGES, iters);
+    bench("posix_spawn", spawn_cmd, STAGES, iters);
+
+    for (i = 1; i <= 16; i *= 2)
+    {
+        bench_setup(i, iters);
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+/* Variable benchmark.
+ *
+ * Times expanding a line that uses a few variables, and getting the
+ * environment for a spawn: as it is on nearly every spawn (unchanged
+ * since the last one, so the same vector) and right after an exported
+ * variable changed (the vector is rebuilt).
+ *
+ *     $ make bench/var_expand && ./bench/var_expand
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse.h"
+#include "expand.h"
+#include "vars.h"
+#include "bench.h"
+
+#define SAMPLES 50
+#define OPS 10000
+
+static BenchSamples samples;
+
+static void bench_expand(void)
+{
+    char line[] = "cp -r $SRC/${NAME}.d \"$DEST/$NAME backup\" --suffix=$SUFFIX";
+    uint64_t start;
+    Parse *P;
+    int s, i;
+
+    var_set("SRC", 3, "/home/user/src", 0);
+    var_set("NAME", 4, "project", 0);
+    var_set("DEST", 4, "/mnt/backup", 0);
+    var_set("SUFFIX", 6, ".old", 0);
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < OPS; i++)
+        {
+            P = parse_cmdline(line);
+            expand_task(&P->tasks[0], P->arena);
+            parse_destroy(&P);
+        }
+        bench_add(&samples, start, OPS);
+    }
+    bench_report("var_expand", "parse+expand", &samples, "\"vars\":5");
+}
+
+static void bench_environ(int changed)
+{
+    uint64_t start;
+    char value[32];
+    int s, i, n;
+
+    for (n = 0; var_environ()[n]; n++)
+        ;
+
+    for (s = 0; s < SAMPLES; s++)
+    {
+        start = bench_now_ns();
+        for (i = 0; i < OPS; i++)
+        {
+            if (changed)
+            {
+                snprintf(value, sizeof(value), "%d", i);
+                var_set("BENCH_COUNTER", 13, value, 1);
+            }
+            if (!var_environ()[0])
+                abort();
+        }
+        bench_add(&samples, start, OPS);
+    }
+    bench_report("var_expand", changed ? "environ_rebuilt" : "environ_unchanged", &samples, "\"exported\":%d", n);
+}
+
+int main(void)
+{
+    char name[32];
+    int i;
+
+    for (i = 0; i < 50; i++)
+    { // an environment of a typical size
+        snprintf(name, sizeof(name), "BENCH_VAR_%d", i);
+        var_set(name, strlen(name), "some value of a typical length", 1);
+    }
+
+    bench_expand();
+    bench_environ(0);
+    bench_environ(1);
+    return 0;
+}
@@ -2,28 +2,918 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "builtin.h"
 #include "parse.h"
+#include "phash.h"
+#include "builtin_hash.h"
+#include "pssh.h"
+#include "jobs.h"
+#include "hash.h"
+#include "parallel.h"
+#include "pipestat.h"
+#include "stats.h"
+#include "vars.h"
 
-static char *builtin[] = {
-    "exit",  /* exits the shell */
-    "which", /* displays full path to command */
-    "jobs",  // Display all current jobs
-    "kill",  //
-    "fg",    // bring a process to fg
-    "bg",    // bring a process to bg
-    NULL};
+#define BUILTIN(name, fn, flags) static int fn(char **argv, FILE *out);
+#include "builtins.def"
+#undef BUILTIN
+
+static const Builtin builtins[] = {
+#define BUILTIN(name, fn, flags) {name, fn, flags},
+#include "builtins.def"
+#undef BUILTIN
+};
+
+// one hash and one strcmp: builtin_slot is a perfect hash of every name in builtins.def
+const Builtin *builtin_lookup(const char *cmd)
+{
+    unsigned int slot = builtin_slot[phash(cmd, BUILTIN_HASH_SEED) & (BUILTIN_HASH_SIZE - 1)];
+
+    if (slot && !strcmp(cmd, builtins[slot - 1].name))
+        return &builtins[slot - 1];
+
+    return NULL;
+}
 
 int is_builtin(char *cmd)
 {
-    int i;
+    return builtin_lookup(cmd) != NULL;
+}
+
+typedef struct
+{
+    char *buf;
+    size_t len;
+    int fd;
+} Output;
+
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writers_done = PTHREAD_COND_INITIALIZER;
+static int writers = 0;       // writer threads still running
+static int writers_drain = 0; // drain_writers is registered with atexit
+
+// drains a builtin's output into fd_out, then closes it
+static void *write_output(void *arg)
+{
+    Output *o = arg;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < o->len)
+    {
+        n = write(o->fd, o->buf + done, o->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // reader went away (EPIPE), like any other pipeline stage
+        done += n;
+    }
+
+    close(o->fd);
+    free(o->buf);
+    free(o);
+    return NULL;
+}
+
+// writer thread: write_output for a pipe whose reader may not have started yet
+static void *writer(void *arg)
+{
+    write_output(arg);
+
+    pthread_mutex_lock(&writers_lock);
+    if (!--writers)
+        pthread_cond_broadcast(&writers_done);
+    pthread_mutex_unlock(&writers_lock);
+    return NULL;
+}
+
+// atexit: output still on its way into a pipe gets there before the shell is gone
+static void drain_writers(void)
+{
+    pthread_mutex_lock(&writers_lock);
+    while (writers)
+    {
+        pthread_cond_wait(&writers_done, &writers_lock);
+    }
+    pthread_mutex_unlock(&writers_lock);
+}
+
+static int stage_in = STDIN_FILENO; // input of the running builtin, for those that read one
+
+/* Runs a builtin inside the shell reading from fd_in with its output going to
+ * fd_out and returns its exit status.  Output for a pipe or a file is rendered
+ * into memory.  A file gets it right away; for a pipe it is handed to a
+ * detached writer thread, so the shell never blocks on a full pipe whose
+ * reader has not been started yet, and the shell waits for those threads
+ * when it exits. */
+int builtin_run(const Builtin *b, char **argv, int fd_in, int fd_out)
+{
+    pthread_t thread;
+    struct stat st;
+    Output *o;
+    FILE *out;
+    int status;
+
+    stage_in = fd_in;
+
+    if (fd_out == STDOUT_FILENO)
+    {
+        status = b->fn(argv, stdout);
+        fflush(stdout);
+        return status;
+    }
+
+    o = malloc(sizeof(*o));
+    out = open_memstream(&o->buf, &o->len);
+    status = b->fn(argv, out);
+    fclose(out);
+
+    o->fd = fcntl(fd_out, F_DUPFD_CLOEXEC, 0); // the caller keeps (and closes) fd_out
+    if (o->fd < 0 || fstat(o->fd, &st) < 0 || !(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+    { // a file (or a terminal) takes it without waiting on anyone
+        write_output(o);
+        return status;
+    }
+
+    pthread_mutex_lock(&writers_lock);
+    if (!writers_drain)
+        writers_drain = !atexit(drain_writers);
+    writers++;
+    pthread_mutex_unlock(&writers_lock);
+
+    if (pthread_create(&thread, NULL, writer, o))
+    {
+        writer(o);
+        return status;
+    }
+    pthread_detach(thread);
+
+    return status;
+}
+
+//========================================================BUILT IN FUNCTIONS==========================================================
+
+// Prints job info for "jobs" command
+static void print_job(Job *job, FILE *out)
+{
+
+    if (job->status == TERM)
+    { // do not print terminated jobs
+        return;
+    }
+    const char *job_status = "running"; // BG or FG
+    if (job->status == STOPPED)
+    {
+        job_status = "stopped";
+    }
+    // fprintf(out, "\n");
+    fprintf(out, "[%d] + %s    %s \n", job->job_id, job_status, job->name);
+    // fprintf(out, "\n");
+}
+
+
+// exit [n]: exits the shell with n, or the status of the last job
+static int builtin_exit(char **argv, FILE *out)
+{
+    if (interactive)
+        fprintf(out, "Exiting pssh...\n");
+    exit(argv[1] ? atoi(argv[1]) : last_status);
+}
+
+// which command function: displays the full path to a command
+static int builtin_which(char **argv, FILE *out)
+{
+    const char *path = NULL;
+    char *full_path;
+
+    if (!argv[1])
+    {
+        fprintf(out, "File not found!\n");
+        return 1;
+    }
+
+    if (!access(argv[1], F_OK) || (path = command_found(argv[1])))
+    { // check if input file exists
+        full_path = realpath(argv[1], NULL);
+        // if NULL then use the path found in PATH
+        fprintf(out, "%s\n", full_path ? full_path : path ? path : argv[1]);
+        free(full_path);
+        return 0;
+    }
+
+    if (is_builtin(argv[1]))
+    { // check if builtin
+        fprintf(out, "%s: shell built-in command\n", argv[1]);
+        return 0;
+    }
+
+    fprintf(out, "File not found!\n");
+    return 1;
+}
 
-    for (i = 0; builtin[i]; i++)
+// jobs command function: lists the jobs in id order, -l adds the pgid and the resource usage so far
+// (and the pipe throughput of pipestat jobs)
+static int builtin_jobs(char **argv, FILE *out)
+{
+    int long_fmt = argv[1] && !strcmp(argv[1], "-l");
+    struct rusage total;
+
+    for (int i = 1; i <= max_job_id(); i++)
     {
-        if (!strcmp(cmd, builtin[i]))
+        Job *job = find_job_by_id(i);
+        if (!job)
+            continue;
+
+        print_job(job, out);
+        if (long_fmt)
+        { // only reaped stages have usage to report
+            sum_usage(job->usage, job->npids, &total);
+            fprintf(out, "    pgid %d, %u/%u running: ", job->pgid, job->nlive, job->npids);
+            print_usage(out, &total, job_wall_time(job));
+            fprintf(out, "\n");
+            if (job->pipes)
+                pipestat_print(job->pipes, out, "    ");
+        }
+    }
+    return 0;
+}
+
+// checks if a signal can be sent to the pid
+static int check_pid(int pid, FILE *out)
+{
+    errno = 0;
+    // will only return 0 if pid exists and you would be able to send it a signal.
+    // If pid isn't running as you (and you aren't root), it fails with -EPERM. (errno != 0)
+    kill(pid, 0);
+    if (errno != 0)
+    { // custom print statement for the three cases
+        fprintf(out, "pssh: invalid pid: %d \n", pid);
+        return 0;
+    }
+    return 1;
+}
+
+// returns the pgid of the supplied job number
+static int get_job_pgid(char *job_id, FILE *out)
+{
+
+    char *job_id_chopped = job_id + 1; // removes % from char
+
+    int job_indx = atoi(job_id_chopped);
+    Job *job = find_job_by_id(job_indx);
+
+    if (job)
+    {
+        return job->pgid;
+    }
+
+    fprintf(out, "pssh: invalid job number: %d\n", job_indx);
+    return 0; // error
+}
+
+// Kill command function
+static int builtin_kill(char **argv, FILE *out)
+{
+    int status;
+    int argc = 0;
+    while (argv[argc] != NULL)
+    {
+        argc++;
+    }
+
+    if (argc == 1)
+    {
+        fprintf(out, "Usage: kill [-s <signal>] <pid> | %%<job> ... \n");
+        fprintf(out, "\n");
+    }
+    else if (argc == 2)
+    { // ./signal 1289 format
+
+        pid_t pid;
+
+        // this does not work
+        if (argv[1][0] == '%')
+        { // Job id was supplied
+            status = get_job_pgid(argv[1], out);
+            if (!status)
+            {
+                return 1;
+            }
+            // fprintf(out, "builtin kill before status: %d\n", status); // remove
+            pid = status - 2 * status; // make it negative to kill all in pgid
+        }
+        else
+        {
+            pid = atoi(argv[1]);
+        }
+
+        if (!pid)
+        {
+            fprintf(out, "pssh: invalid pid number: %d \n", pid);
             return 1;
+        }
+        if (!check_pid(pid, out))
+            return 1; // pid cannot be sent a signal
+
+        // this works for pids but not jobs (pgids)
+        // fprintf(out, "builtin kill negative group pid: %d\n", pid); // remove
+        status = kill(pid, SIGTERM);
+        // fprintf(out, "builtin kill status after kill: %d\n", status); // remove
+        if (status == -1)
+        {
+            fprintf(out, "Sending signal to process %d was unsuccessful! \n", pid);
+            return 1;
+        }
     }
+    else if (argc >= 4 && !strcmp(argv[1], "-s"))
+    { // -->kill [-s <signal>] <pid> | %%<job>
+        pid_t pid;
+
+        int i = 3;
+        while (argv[i] != NULL)
+        {
+            if (argv[i][0] == '%')
+            { // Job id was supplied
+                status = get_job_pgid(argv[3], out);
+                if (!status)
+                {
+                    return 1;
+                }
+                pid = status - 2 * status;
+            }
+            else
+            {
+                pid = atoi(argv[3]);
+            }
 
+            int signal = atoi(argv[2]);
+
+            if (!pid)
+            {
+                fprintf(out, "pssh: invalid pid number: %d \n", pid);
+                return 1;
+            }
+            if (!check_pid(pid, out))
+            {
+                return 1;
+            }
+
+            status = kill(pid, signal);
+            if (status == -1)
+            {
+                fprintf(out, "Sending signal %d to process %d was unsuccessful! \n", signal, pid);
+                return 1;
+            }
+            ++i;
+        }
+    }
+    else
+    {
+        fprintf(out, "Invalid arguments. \n");
+        fprintf(out, "Usage: kill [-s <signal>] <pid> | %%<job> ... \n");
+    }
+    return 0;
+}
+
+// bring background job to FG
+static int builtin_fg(char **argv, FILE *out)
+{
+    int status;
+    int argc = 0;
+    pid_t pgid;
+
+    while (argv[argc] != NULL)
+    {
+        argc++;
+    }
+
+    if (argc == 1)
+    {
+        fprintf(out, "Usage: fg %%<job number> \n");
+        fprintf(out, "\n");
+        return 1;
+    }
+    else
+    {
+        if (argv[1][0] == '%')
+        { // Job id was supplied
+            status = get_job_pgid(argv[1], out);
+            if (!status)
+            {
+                return 1;
+            }
+            pgid = status;
+        }
+        else
+        {
+            fprintf(out, "Usage: fg %%<job number> \n");
+            fprintf(out, "\n");
+            return 1;
+        }
+        Job *job = find_job(pgid);
+        fprintf(out, "\n[%i] + continued	%s\n", job->job_id, job->name);
+        fflush(out);
+
+        job->status = FG;
+        set_fg_pgrp(pgid);
+        kill(-pgid, SIGCONT); // wake up the whole group if it was stopped
+        wait_fg_job(pgid);
+    }
+    return 0;
+}
+
+// continue a bg job
+static int builtin_bg(char **argv, FILE *out)
+{
+    int status;
+    int argc = 0;
+    pid_t pgid;
+
+    while (argv[argc] != NULL)
+    {
+        argc++;
+    }
+
+    if (argc == 1)
+    {
+        fprintf(out, "Usage: fg %%<job number> \n");
+        fprintf(out, "\n");
+        return 1;
+    }
+    else
+    {
+        if (argv[1][0] == '%')
+        { // Job id was supplied
+            status = get_job_pgid(argv[1], out);
+            if (!status)
+            {
+                return 1;
+            }
+            pgid = status;
+        }
+        else
+        {
+            fprintf(out, "Usage: fg %%<job number> \n");
+            fprintf(out, "\n");
+            return 1;
+        }
+        fprintf(out, "pgid for bg %d\n", pgid);
+        kill(-pgid, SIGCONT);
+        // int i = 0;
+        // while (jobs[i]->pgid != pgid)
+        // {
+        //     ++i;
+        // }
+        // fprintf(out, "\n[%i] + continued	%s\n", jobs[i]->job_id, jobs[i]->name);
+    }
+    return 0;
+}
+
+// hash command function: lists, clears (-r) or primes the command path cache
+static int builtin_hash(char **argv, FILE *out)
+{
+    int i, ret = 0;
+
+    if (argv[1] == NULL)
+    {
+        hash_print(out);
+        return 0;
+    }
+
+    if (!strcmp(argv[1], "-r"))
+    {
+        hash_clear();
+        return 0;
+    }
+
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        if (strchr(argv[i], '/'))
+            continue; // paths are never hashed
+
+        if (!hash_add(argv[i]))
+        {
+            fprintf(out, "pssh: hash: %s: not found\n", argv[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// parallel [-j N] [-k] [-v] cmd [args] [::: items]: runs cmd once per item, N at a time
+static int builtin_parallel(char **argv, FILE *out)
+{
+    int i = 1, slots = 0, flags = 0, ncmd, nitems = -1;
+    char **items = NULL;
+
+    for (; argv[i] && argv[i][0] == '-'; i++)
+    {
+        if (!strcmp(argv[i], "--"))
+        {
+            i++;
+            break;
+        }
+        else if (!strcmp(argv[i], "-k"))
+        {
+            flags |= PARALLEL_KEEP_ORDER;
+        }
+        else if (!strcmp(argv[i], "-v"))
+        {
+            flags |= PARALLEL_VERBOSE;
+        }
+        else if (!strncmp(argv[i], "-j", 2) && (argv[i][2] || argv[i + 1]))
+        {
+            slots = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+            if (slots <= 0)
+                slots = -1; // -j 0: no limit
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    for (ncmd = 0; argv[i + ncmd] && strcmp(argv[i + ncmd], ":::"); ncmd++)
+        ;
+
+    if (!ncmd)
+    {
+        fprintf(out, "Usage: parallel [-j N] [-k] [-v] <cmd> [args, {} is the item] [::: items] \n");
+        return 1;
+    }
+
+    if (argv[i + ncmd])
+    { // items given on the command line, otherwise they are read one per line
+        items = &argv[i + ncmd + 1];
+        for (nitems = 0; items[nitems]; nitems++)
+            ;
+    }
+
+    if (!slots)
+        slots = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return parallel_run(&argv[i], ncmd, items, nitems, slots, flags, stage_in, out);
+}
+
+// parses on/off style option values, returns -1 for anything else
+static int parse_bool(const char *value)
+{
+    if (!strcmp(value, "on") || !strcmp(value, "1") || !strcmp(value, "yes"))
+        return 1;
+    if (!strcmp(value, "off") || !strcmp(value, "0") || !strcmp(value, "no"))
+        return 0;
+    return -1;
+}
+
+static int set_rusage(const char *value)
+{
+    int on = parse_bool(value);
+
+    if (on < 0)
+        return -1;
+    report_usage = on;
+    return 0;
+}
+
+static void show_rusage(FILE *out)
+{
+    fprintf(out, "%s", report_usage ? "on" : "off");
+}
+
+static int set_statslog(const char *value)
+{
+    free(stats_log);
+    stats_log = strcmp(value, "off") ? strdup(value) : NULL;
+    return 0;
+}
+
+static void show_statslog(FILE *out)
+{
+    fprintf(out, "%s", stats_log ? stats_log : "off");
+}
+
+// pipesize=N[K|M], or default: capacity of the pipes between stages
+static int set_pipesize(const char *value)
+{
+    unsigned long size;
+    char *end;
+    int fds[2], got;
+
+    if (!strcmp(value, "default") || !strcmp(value, "0"))
+    {
+        pipe_size = 0;
+        return 0;
+    }
+
+    size = strtoul(value, &end, 10);
+    if (*end == 'k' || *end == 'K')
+        size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20, end++;
+    if (end == value || *end || !size || size > 1UL << 30)
+        return -1;
+
+    // try it on a real pipe: unprivileged users are capped at /proc/sys/fs/pipe-max-size,
+    // and the kernel rounds the size up, so keep what it actually gave
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    got = fcntl(fds[1], F_SETPIPE_SZ, (int)size);
+    close(fds[0]);
+    close(fds[1]);
+    if (got < 0)
+        return -1;
+
+    pipe_size = got;
+    return 0;
+}
+
+static void show_pipesize(FILE *out)
+{
+    if (!pipe_size)
+        fprintf(out, "default");
+    else if (pipe_size % (1 << 20) == 0)
+        fprintf(out, "%dM", pipe_size >> 20);
+    else
+        fprintf(out, "%dK", pipe_size >> 10);
+}
+
+// affinity=spread|off: pin the stages of a pipeline to different CPUs
+static int set_affinity(const char *value)
+{
+    if (!strcmp(value, "spread"))
+        spread_stages = 1;
+    else if (!strcmp(value, "off"))
+        spread_stages = 0;
+    else
+        return -1;
+    return 0;
+}
+
+static void show_affinity(FILE *out)
+{
+    fprintf(out, "%s", spread_stages ? "spread" : "off");
+}
+
+typedef struct
+{
+    const char *name;
+    int (*set)(const char *value); // returns -1 if value is not valid
+    void (*show)(FILE *out);
+} ShellOption;
+
+static const ShellOption options[] = {
+    {"rusage", set_rusage, show_rusage},       // print the resource usage of every finished job
+    {"statslog", set_statslog, show_statslog}, // append the stats as JSON to this file on exit
+    {"pipesize", set_pipesize, show_pipesize}, // capacity of the pipes between stages
+    {"affinity", set_affinity, show_affinity}, // spread: each stage on its own CPU
+};
+
+// set [option=value ...]: changes shell options, lists them (and the variables) without arguments
+static int builtin_set(char **argv, FILE *out)
+{
+    unsigned int i, j;
+    char *eq;
+    int ret = 0;
+
+    if (!argv[1])
+    {
+        for (j = 0; j < sizeof(options) / sizeof(options[0]); j++)
+        {
+            fprintf(out, "%s=", options[j].name);
+            options[j].show(out);
+            fprintf(out, "\n");
+        }
+        vars_print(out, 0);
+        return 0;
+    }
+
+    for (i = 1; argv[i]; i++)
+    {
+        eq = strchr(argv[i], '=');
+        for (j = 0; j < sizeof(options) / sizeof(options[0]); j++)
+        {
+            if (eq && strlen(options[j].name) == (size_t)(eq - argv[i]) &&
+                !strncmp(argv[i], options[j].name, eq - argv[i]))
+                break;
+        }
+
+        if (j == sizeof(options) / sizeof(options[0]))
+        {
+            fprintf(out, "pssh: set: unknown option: %s\n", argv[i]);
+            ret = 1;
+        }
+        else if (options[j].set(eq + 1) < 0)
+        {
+            fprintf(out, "pssh: set: invalid value for %s: %s\n", options[j].name, eq + 1);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// export [name[=value] ...]: puts variables in the environment of the commands, lists it without arguments
+static int builtin_export(char **argv, FILE *out)
+{
+    const char *value;
+    size_t len;
+    int i, ret = 0;
+
+    if (!argv[1])
+    {
+        vars_print(out, 1);
+        return 0;
+    }
+
+    for (i = 1; argv[i]; i++)
+    {
+        len = strchr(argv[i], '=') ? (size_t)(strchr(argv[i], '=') - argv[i]) : strlen(argv[i]);
+        value = argv[i][len] ? argv[i] + len + 1 : var_get(argv[i], len);
+        if (var_set(argv[i], len, value ? value : "", 1) < 0)
+        {
+            fprintf(out, "pssh: export: not a valid name: %s\n", argv[i]);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// unset name ...: removes variables
+static int builtin_unset(char **argv, FILE *out)
+{
+    int i;
+
+    (void)out; // nothing to print
+    for (i = 1; argv[i]; i++)
+    {
+        var_unset(argv[i]);
+    }
+    return 0;
+}
+
+typedef struct
+{
+    int job_id;
+    pid_t pgid;      // 0 once the job is gone
+    int exit_status; // -1 until then
+} WaitTarget;
+
+// resolves %job or pid (of any stage) to a job that runs or finished recently, 0 if there is none
+static int wait_target(const char *arg, WaitTarget *t)
+{
+    char *end;
+    long n = strtol(arg + (arg[0] == '%'), &end, 10);
+    Job *job;
+
+    if (end == arg + (arg[0] == '%') || *end || n <= 0)
+        return 0;
+
+    if (arg[0] == '%')
+        job = find_job_by_id(n);
+    else if (!(job = find_job_by_pid(n)))
+        job = find_job(n); // the leader may be reaped already
+    if (job)
+    {
+        t->job_id = job->job_id;
+        t->pgid = job->pgid;
+        t->exit_status = -1;
+        return 1;
+    }
+
+    t->job_id = 0;
+    t->pgid = 0;
+    t->exit_status = arg[0] == '%' ? finished_status(n, 0) : finished_status(0, n);
+    return t->exit_status >= 0;
+}
+
+/* wait [-t secs] [%job|pid ...]: blocks until the jobs (every background job
+ * if none is given) have finished, by polling the pidfds of their stages.
+ * Returns the exit status of the last one, 127 if it is no job of ours and
+ * 124 if the timeout expires first. */
+static int builtin_wait(char **argv, FILE *out)
+{
+    WaitTarget *t;
+    struct pollfd *pfd = NULL;
+    int npfd, cap = 0, ntargets = 0, pending, ret = 0, i, nargs = 0;
+    uint64_t deadline = 0, now;
+    double secs;
+    char *end;
+    unsigned int k;
+    Job *job;
+
+    for (i = 1; argv[i]; i++)
+    {
+        nargs++;
+    }
+    t = malloc((nargs + max_job_id() + 1) * sizeof(*t));
+
+    for (i = 1; argv[i]; i++)
+    {
+        if (!strcmp(argv[i], "-t"))
+        {
+            if (!argv[i + 1] || (secs = strtod(argv[i + 1], &end)) < 0 || *end || end == argv[i + 1])
+            {
+                fprintf(out, "usage: wait [-t seconds] [%%job|pid ...]\n");
+                free(t);
+                return 2;
+            }
+            deadline = stats_now() + (uint64_t)(secs * 1e9);
+            i++;
+        }
+        else if (!wait_target(argv[i], &t[ntargets++]))
+        {
+            fprintf(out, "pssh: wait: %s: no such job\n", argv[i]);
+            t[ntargets - 1].exit_status = 127;
+        }
+    }
+
+    if (!ntargets)
+    { // every job running in the background
+        for (i = 1; i <= max_job_id(); i++)
+        {
+            if ((job = find_job_by_id(i)) && job->status == BG)
+            {
+                t[ntargets].job_id = job->job_id;
+                t[ntargets].pgid = job->pgid;
+                t[ntargets++].exit_status = -1;
+            }
+        }
+    }
+
+    for (;;)
+    {
+        npfd = 0;
+        pending = 0;
+        for (i = 0; i < ntargets; i++)
+        {
+            if (!t[i].pgid)
+                continue;
+            job = find_job(t[i].pgid);
+            if (!job || job->job_id != t[i].job_id)
+            { // finished (and reported) since the last round
+                t[i].exit_status = finished_status(t[i].job_id, 0);
+                t[i].pgid = 0;
+                continue;
+            }
+
+            pending++;
+            job_watch(job, 1);
+            for (k = 0; k < job->npids; k++)
+            {
+                if (job->pidfds[k] < 0)
+                    continue;
+                if (npfd == cap)
+                {
+                    cap = cap ? cap * 2 : 16;
+                    pfd = realloc(pfd, cap * sizeof(*pfd));
+                }
+                pfd[npfd].fd = job->pidfds[k];
+                pfd[npfd++].events = POLLIN;
+            }
+        }
+        if (!pending)
+            break;
+
+        if (!deadline)
+        {
+            poll_events(pfd, npfd, -1); // the children are reaped through sig_fd as usual
+            continue;
+        }
+        if ((now = stats_now()) >= deadline)
+        {
+            ret = 124;
+            break;
+        }
+        poll_events(pfd, npfd, (deadline - now + 999999) / 1000000);
+    }
+
+    for (i = 0; i < ntargets; i++)
+    { // the ones still running (timeout) give their pidfds back
+        if (t[i].pgid && (job = find_job(t[i].pgid)) && job->job_id == t[i].job_id)
+            job_watch(job, 0);
+    }
+
+    if (!ret && ntargets) // a job that fell out of the finished ring is unknown too
+        ret = t[ntargets - 1].exit_status < 0 ? 127 : t[ntargets - 1].exit_status;
+    free(pfd);
+    free(t);
+    return ret;
+}
+
+// stats [-j] [-r]: latency of the shell's own work, as a table or JSON (-j); -r starts over
+static int builtin_stats(char **argv, FILE *out)
+{
+    if (argv[1] && !strcmp(argv[1], "-r"))
+        stats_reset();
+    else if (argv[1] && !strcmp(argv[1], "-j"))
+        stats_print_json(out);
+    else
+        stats_print(out);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,10 +1,26 @@
 #ifndef _builtin_h_
 #define _builtin_h_
 
+#include <stdio.h>
+
 #include "parse.h"
 
+#define BUILTIN_PARENT 0x1  /* takes over the shell itself (exit, fg), never part of a pipeline */
+#define BUILTIN_PIPE   0x2  /* can be a stage of a pipeline, still runs inside the shell */
+#define BUILTIN_BLOCKS 0x4  /* may keep the shell busy for long (pssh -d runs it aside) */
+#define BUILTIN_STATE  0x8  /* a BUILTIN_PARENT that only changes settings, at once (pssh -d allows it) */
+
+/* A builtin writes its output to out and returns its exit status */
+typedef int (*builtin_fn) (char** argv, FILE* out);
+
+typedef struct {
+    const char* name;
+    builtin_fn fn;
+    int flags;
+} Builtin;
+
+const Builtin* builtin_lookup (const char* cmd);
 int is_builtin (char* cmd);
-void builtin_execute (Parse *T);
-int builtin_which (Task T);
+int builtin_run (const Builtin* b, char** argv, int fd_in, int fd_out);
 
 #endif /* _builtin_h_ */
@@ -0,0 +1,968 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "daemon.h"
+#include "builtin.h"
+#include "expand.h"
+#include "parse.h"
+#include "jobs.h"
+#include "pssh.h"
+#include "script.h"
+#include "stats.h"
+
+#define MAX_PENDING (1 << 20) // replies held for a client that does not read them before it is dropped
+
+typedef struct Client
+{
+    int fd;
+    int dead;  // to be closed by the main loop (hooks run while it walks the list)
+    int watch; // gets the events of every client's jobs
+    int runs;  // run requests so far, numbers the next one
+    char *in;  // request bytes not making a whole line yet
+    size_t in_len;
+    size_t in_cap;
+    char *out; // replies not written yet
+    size_t out_len;
+    size_t out_cap;
+    struct Client *next;
+} Client;
+
+// a run request whose line is still being worked through
+typedef struct Chain
+{
+    Client *client; // NULL once it disconnected, the jobs run on regardless
+    int run;        // the request's number for the client
+    Parse *head;    // the whole line, freed once it is done
+    Parse *p;       // next pipeline to run
+    int wait_job;   // id of the job the line waits for, 0 if none
+    int status;     // exit status of the last pipeline
+    int ready;      // wait_job is done, go on with p
+    int *waits;     // wait: ids of the jobs it is still waiting for, 0 once done
+    int nwaits;
+    int wait_last;  // ...the one whose status is the line's (the last argument), 0 if none
+    uint64_t deadline; // wait -t: when it stops waiting, 0 if never
+    struct Chain *next;
+} Chain;
+
+typedef struct
+{
+    Client *client; // NULL if it disconnected
+    int run;
+    int known;      // started from a run request (parallel's items are not)
+    int err_fd;     // run in a copy of the daemon (run_aside): its errors, -1 if not
+} Owner;
+
+static Client *clients = NULL;
+static Chain *chains = NULL;
+static int listen_fd = -1;
+static Owner *owners = NULL; // owners[job_id]
+static int owners_cap = 0;
+
+static Chain *launching = NULL; // the chain execute_tasks is starting a pipeline for
+static int launched_job;        // the job it started, 0 if none (builtins only, not found)
+static int launched_done;       // that job finished before execute_tasks returned...
+static int launched_status;     // ...with this status
+
+//=============================================================REPLIES===============================================================
+
+static void flush_client(Client *c)
+{
+    ssize_t n;
+
+    while (c->out_len && !c->dead)
+    {
+        n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return; // the rest goes out once the socket polls writable
+        if (n < 0)
+        {
+            c->dead = 1;
+            return;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+}
+
+static void send_text(Client *c, const char *text)
+{
+    size_t len = strlen(text);
+
+    if (c->dead)
+        return;
+    if (c->out_len + len > MAX_PENDING)
+    { // not reading its replies: drop it rather than hold them forever
+        c->dead = 1;
+        return;
+    }
+    if (c->out_len + len > c->out_cap)
+    {
+        c->out_cap = (c->out_len + len) * 2;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, text, len);
+    c->out_len += len;
+    flush_client(c);
+}
+
+static void send_fmt(Client *c, const char *fmt, ...)
+{
+    char *text;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (vasprintf(&text, fmt, ap) >= 0)
+    {
+        send_text(c, text);
+        free(text);
+    }
+    va_end(ap);
+}
+
+// to the client that owns the job and to every watcher
+static void broadcast(Client *owner, const char *text)
+{
+    Client *c;
+
+    if (owner)
+        send_text(owner, text);
+    for (c = clients; c; c = c->next)
+    {
+        if (c->watch && c != owner)
+            send_text(c, text);
+    }
+}
+
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static const char *job_state(Job *job)
+{
+    switch (job->status)
+    {
+    case STOPPED:
+        return "stopped";
+    case TERM:
+        return "terminated";
+    default:
+        return "running";
+    }
+}
+
+static void send_jobs(Client *c)
+{
+    char *text;
+    size_t len;
+    FILE *f = open_memstream(&text, &len);
+    unsigned int k;
+    int i, first = 1;
+    Job *job;
+
+    fprintf(f, "{\"jobs\":[");
+    for (i = 1; i <= max_job_id(); i++)
+    {
+        if (!(job = find_job_by_id(i)))
+            continue;
+
+        fprintf(f, "%s{\"job\":%d,\"pgid\":%d,\"state\":\"%s\",\"stages\":%u,\"running\":%u,\"real\":%.6f,\"pids\":[",
+                first ? "" : ",", job->job_id, job->pgid, job_state(job), job->npids, job->nlive, job_wall_time(job));
+        for (k = 0; k < job->npids; k++)
+        {
+            fprintf(f, "%s%d", k ? "," : "", job->pids[k]); // 0 once reaped
+        }
+        fprintf(f, "],\"name\":");
+        json_string(f, job->name);
+        fprintf(f, "}");
+        first = 0;
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+
+    send_text(c, text);
+    free(text);
+}
+
+// {"event":"error",...}: what the shell would have printed about the client's line
+static void send_error(Client *c, int run, const char *msg)
+{
+    size_t n = strcspn(msg, "\n"), len;
+    char *text;
+    FILE *f;
+
+    if (!c || !n)
+        return;
+    f = open_memstream(&text, &len);
+    fprintf(f, "{\"event\":\"error\",\"run\":%d,\"error\":", run);
+    json_string(f, strndupa(msg, n));
+    fprintf(f, "}\n");
+    fclose(f);
+    send_text(c, text);
+    free(text);
+}
+
+//=============================================================RUNNING===============================================================
+
+// error_hook: errors of the line being launched go to its client, others to the log
+static void launch_error(const char *msg)
+{
+    if (launching)
+        send_error(launching->client, launching->run, msg);
+    else
+        fputs(msg, stdout);
+}
+
+// the errors a copy of the daemon wrote to err_fd, one per line, once its job is done
+static void relay_errors(Client *c, int run, int fd)
+{
+    char buf[4096], *line, *nl;
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < sizeof(buf) - 1) // the first ones tell what went wrong
+    {
+        n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    buf[len] = '\0';
+    close(fd);
+
+    for (line = buf; *line; line = nl + (*nl == '\n'))
+    {
+        nl = strchrnul(line, '\n');
+        send_error(c, run, line);
+    }
+}
+
+// ch is no longer waiting for any job
+static void wait_clear(Chain *ch)
+{
+    free(ch->waits);
+    ch->waits = NULL;
+    ch->nwaits = ch->wait_last = 0;
+    ch->deadline = 0;
+}
+
+// the job id finished with status: returns 1 once the wait of ch has no more to wait for
+static int chain_waited(Chain *ch, int id, int status)
+{
+    int i, pending = 0;
+
+    for (i = 0; i < ch->nwaits; i++)
+    {
+        if (ch->waits[i] == id)
+            ch->waits[i] = 0;
+        pending |= ch->waits[i];
+    }
+    if (id == ch->wait_last)
+    {
+        ch->status = status;
+        ch->wait_last = 0;
+    }
+    if (pending)
+        return 0;
+
+    wait_clear(ch);
+    return 1;
+}
+
+// wait -t: wakes the lines whose time is up, returns the ms until the next one's is, -1 if none
+static int chain_timeouts(void)
+{
+    uint64_t now = stats_now(), next = 0;
+    Chain *ch;
+
+    for (ch = chains; ch; ch = ch->next)
+    {
+        if (!ch->deadline)
+            continue;
+        if (ch->deadline <= now)
+        {
+            wait_clear(ch);
+            ch->status = 124;
+            ch->ready = 1;
+        }
+        else if (!next || ch->deadline < next)
+        {
+            next = ch->deadline;
+        }
+    }
+    return next ? (int)((next - now + 999999) / 1000000) : -1;
+}
+
+// job_hook: reports every job started from a run request, and wakes the line waiting for it
+static void job_event(Job *job, int done)
+{
+    int id = job->job_id;
+    char *text;
+    size_t len;
+    FILE *f;
+    Chain *ch;
+
+    if (!done && launching)
+    {
+        if (id >= owners_cap)
+        {
+            owners = realloc(owners, (id + 64) * sizeof(*owners));
+            memset(owners + owners_cap, 0, (id + 64 - owners_cap) * sizeof(*owners));
+            owners_cap = id + 64;
+        }
+        owners[id].client = launching->client;
+        owners[id].run = launching->run;
+        owners[id].known = 1;
+        owners[id].err_fd = -1;
+        launched_job = id;
+    }
+    if (id >= owners_cap || !owners[id].known)
+        return;
+
+    if (done && owners[id].err_fd >= 0)
+    { // before done, which is its last word on the job
+        relay_errors(owners[id].client, owners[id].run, owners[id].err_fd);
+        owners[id].err_fd = -1;
+    }
+
+    f = open_memstream(&text, &len);
+    fprintf(f, "{\"event\":\"%s\",\"run\":%d,\"job\":%d,\"pgid\":%d,",
+            done ? "done" : "start", owners[id].run, id, job->pgid);
+    if (done)
+        fprintf(f, "\"status\":%d,\"real\":%.6f,", job->exit_status, job_wall_time(job));
+    fprintf(f, "\"name\":");
+    json_string(f, job->name);
+    fprintf(f, "}\n");
+    fclose(f);
+    broadcast(owners[id].client, text);
+    free(text);
+
+    if (!done)
+        return;
+
+    owners[id].known = 0; // the id is free for the next job
+    owners[id].client = NULL;
+
+    if (launching && id == launched_job)
+    {
+        launched_done = 1;
+        launched_status = job->exit_status;
+        return;
+    }
+    for (ch = chains; ch; ch = ch->next)
+    {
+        if (ch->wait_job == id)
+        { // picked up by the main loop: this may run in the middle of a builtin
+            ch->wait_job = 0;
+            ch->status = job->exit_status;
+            ch->ready = 1;
+        }
+        if (ch->nwaits && chain_waited(ch, id, job->exit_status))
+            ch->ready = 1;
+    }
+}
+
+// skips what the status of the pipeline just run short-circuits, as run_line does
+static void chain_advance(Chain *ch, int status)
+{
+    Parse *p = ch->p;
+
+    ch->status = status;
+    if (!p)
+        return; // a script, run as a whole
+    while (p->next && ((p->then == SEQ_AND && status) || (p->then == SEQ_OR && !status)))
+    {
+        p = p->next;
+    }
+    ch->p = p->next;
+}
+
+static void chain_end(Chain *ch)
+{
+    Chain **pp;
+
+    if (ch->client)
+        send_fmt(ch->client, "{\"event\":\"end\",\"run\":%d,\"status\":%d}\n", ch->run, ch->status);
+
+    for (pp = &chains; *pp != ch; pp = &(*pp)->next)
+        ;
+    *pp = ch->next;
+    parse_destroy(&ch->head);
+    free(ch);
+}
+
+// one argument of wait: adds its job to those ch waits for, returns its status if it has one already
+static int wait_arg(Chain *ch, const char *arg)
+{
+    int job_arg = arg[0] == '%', status = -1;
+    char *end;
+    long n = strtol(arg + job_arg, &end, 10);
+    Job *job;
+
+    ch->wait_last = 0;
+    if (end != arg + job_arg && !*end && n > 0)
+    {
+        if (job_arg)
+            job = find_job_by_id(n);
+        else if (!(job = find_job_by_pid(n)))
+            job = find_job(n); // the leader may be reaped already
+
+        if (job && job->job_id < owners_cap && owners[job->job_id].known)
+        {
+            ch->waits[ch->nwaits++] = ch->wait_last = job->job_id;
+            return -1;
+        }
+        if (!job)
+            status = job_arg ? finished_status(n, 0) : finished_status(0, n);
+        if (status >= 0)
+            return status;
+    }
+
+    char msg[strlen(arg) + 32];
+    snprintf(msg, sizeof(msg), "pssh: wait: %s: no such job", arg);
+    send_error(ch->client, ch->run, msg);
+    return 127;
+}
+
+/* wait [-t secs] [%job|pid ...] of a run request.  The builtin would block
+ * the daemon until the jobs are done; here only the line waits, for the
+ * jobs given or else every background job of its client, and job_event
+ * wakes it like it does for a pipeline.  Returns the status of wait, or -1
+ * if the line is waiting. */
+static int chain_wait(Chain *ch, char **argv)
+{
+    int i, status = 0, nargs = 0;
+    double secs;
+    char *end;
+    Job *job;
+
+    for (i = 1; argv[i]; i++)
+        ;
+    ch->waits = malloc((i + max_job_id()) * sizeof(*ch->waits));
+
+    for (i = 1; argv[i]; i++)
+    {
+        if (!strcmp(argv[i], "-t"))
+        {
+            if (!argv[i + 1] || (secs = strtod(argv[i + 1], &end)) < 0 || *end || end == argv[i + 1])
+            {
+                send_error(ch->client, ch->run, "usage: wait [-t seconds] [%job|pid ...]");
+                wait_clear(ch);
+                return 2;
+            }
+            ch->deadline = stats_now() + (uint64_t)(secs * 1e9);
+            i++;
+        }
+        else
+        {
+            status = wait_arg(ch, argv[i]);
+            nargs++;
+        }
+    }
+
+    if (!nargs && ch->client)
+    { // no job given: those of the client still running in the background
+        for (i = 1; i <= max_job_id(); i++)
+        {
+            if ((job = find_job_by_id(i)) && job->status == BG && i < owners_cap && owners[i].known && owners[i].client == ch->client)
+                ch->waits[ch->nwaits++] = i;
+        }
+    }
+
+    if (!ch->nwaits)
+    {
+        wait_clear(ch);
+        return status;
+    }
+    ch->status = status < 0 ? 0 : status; // unless the last argument is a job still running
+    return -1;
+}
+
+// error_hook of a copy of the daemon: its errors wait in a pipe for its job to be done
+static int error_fd = -1;
+
+static void fork_error(const char *msg)
+{
+    if (write(error_fd, msg, strlen(msg)) < 0)
+        return; // the pipe is full: the first ones tell what went wrong
+}
+
+/* Runs what may keep the shell busy for long, the pipeline p (parallel, a
+ * function) or else the script text (loops), in a copy of the daemon,
+ * which the daemon runs as a job of one stage, so the other clients are
+ * served meanwhile. */
+static void run_aside(Parse *p, const char *script)
+{
+    int err[2];
+    pid_t pid, *pids;
+    Client *c;
+    Job *job;
+
+    if (pipe2(err, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        shell_error(stdout, "pssh: cannot create a pipe: %s\n", strerror(errno));
+        last_status = 1;
+        return;
+    }
+
+    fflush(stdout); // or the copy writes it again
+    if ((pid = fork()) == 0)
+    { // the pipeline's own process group, as any job has
+        setpgid(0, 0);
+        close(err[0]);
+        close(listen_fd);
+        for (c = clients; c; c = c->next)
+        {
+            close(c->fd);
+        }
+        job_hook = NULL;
+        error_hook = fork_error;
+        error_fd = err[1];
+        forget_jobs(); // the daemon's, which wait in the copy would never see end
+
+        if (p)
+        {
+            p->background = 0;
+            execute_tasks(p, p->text);
+        }
+        else
+        {
+            script_run(script);
+        }
+        fflush(NULL);
+        _exit(last_status);
+    }
+    close(err[1]);
+    if (pid < 0)
+    {
+        shell_error(stdout, "pssh: fork: %s\n", strerror(errno));
+        close(err[0]);
+        last_status = 1;
+        return;
+    }
+
+    setpgid(pid, pid);
+    pids = malloc(sizeof(*pids));
+    pids[0] = pid;
+    job = create_job(1, pid, pids, 1, p ? p->text : script);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job_event(job, 0);
+    owners[job->job_id].err_fd = err[0];
+}
+
+// does p call a function, which runs inside the shell for as long as it takes?
+static int calls_function(Parse *p)
+{
+    int t;
+
+    for (t = 0; t < p->ntasks; t++)
+    {
+        if (script_is_function(p->tasks[t].cmd))
+            return 1;
+    }
+    return 0;
+}
+
+// the builtin of p that may keep the shell busy for long, NULL if there is none
+static const Builtin *blocking(Parse *p)
+{
+    const Builtin *b;
+    int t;
+
+    for (t = 0; t < p->ntasks; t++)
+    {
+        if ((b = builtin_lookup(p->tasks[t].cmd)) && (b->flags & BUILTIN_BLOCKS))
+            return b;
+    }
+    return NULL;
+}
+
+// the builtin of p that would act on the daemon itself (exit, fg), NULL if there is none
+static const Builtin *refused(Parse *p)
+{
+    const Builtin *b;
+    int t;
+
+    for (t = 0; t < p->ntasks; t++)
+    {
+        b = builtin_lookup(p->tasks[t].cmd);
+        if (b && (b->flags & BUILTIN_PARENT) && !(b->flags & (BUILTIN_BLOCKS | BUILTIN_STATE))
+            && !script_is_function(p->tasks[t].cmd))
+            return b;
+    }
+    return NULL;
+}
+
+/* Starts the pipelines of the line in turn, every one in the background so
+ * the shell never blocks.  A pipeline that was not followed by & is waited
+ * for by returning: job_event marks the chain ready once it is done. */
+static void chain_run(Chain *ch)
+{
+    const Builtin *b;
+    Parse *p;
+    int bg, status;
+
+    while ((p = ch->p))
+    {
+        bg = p->background;
+        p->background = 1;
+
+        if ((b = refused(p)))
+        {
+            char msg[128];
+
+            snprintf(msg, sizeof msg, "pssh: %s: not available to daemon clients", b->name);
+            send_error(ch->client, ch->run, msg);
+            chain_advance(ch, 2);
+            continue;
+        }
+        b = blocking(p);
+        if (b && p->ntasks == 1 && (b->flags & BUILTIN_PARENT))
+        { // wait: only this line waits, not the daemon
+            expand_task(&p->tasks[0], p->arena);
+            status = p->tasks[0].argv[0] ? chain_wait(ch, p->tasks[0].argv) : 0;
+            if (status < 0)
+                return;
+            chain_advance(ch, status);
+            continue;
+        }
+
+        launching = ch;
+        launched_job = launched_done = 0;
+        if ((b && !(b->flags & BUILTIN_PARENT)) || calls_function(p))
+            run_aside(p, NULL);
+        else
+            execute_tasks(p, p->text);
+        launching = NULL;
+
+        if (!bg && launched_job && !launched_done)
+        {
+            ch->wait_job = launched_job;
+            return;
+        }
+        chain_advance(ch, bg ? 0 : launched_job ? launched_status : last_status);
+    }
+    chain_end(ch);
+}
+
+/* A line with loops or functions goes through the script compiler.  One
+ * that only defines functions runs in the daemon, so that later lines can
+ * call them; anything else runs as a whole, as one job, in a copy. */
+static void request_script(Client *c, int run, char *line)
+{
+    Chain *ch;
+
+    if (script_incomplete(line))
+    {
+        send_fmt(c, "{\"event\":\"end\",\"run\":%d,\"status\":2,\"error\":\"invalid syntax\"}\n", run);
+        return;
+    }
+
+    ch = calloc(1, sizeof(*ch));
+    ch->client = c;
+    ch->run = run;
+    ch->next = chains;
+    chains = ch;
+
+    launching = ch;
+    launched_job = launched_done = 0;
+    if (script_defines_only(line))
+        script_run(line);
+    else
+        run_aside(NULL, line);
+    launching = NULL;
+
+    if (launched_job && !launched_done)
+    {
+        ch->wait_job = launched_job;
+        return;
+    }
+    ch->status = launched_job ? launched_status : last_status;
+    chain_end(ch);
+}
+
+static void request_run(Client *c, char *line)
+{
+    Chain *ch;
+    Parse *P;
+    int run = ++c->runs;
+
+    send_fmt(c, "{\"event\":\"run\",\"run\":%d}\n", run);
+    if (script_wants(line))
+    {
+        request_script(c, run, line);
+        return;
+    }
+
+    uint64_t start = stats_now();
+    P = parse_cmdline(line);
+    stats_record(STAT_PARSE, start);
+    if (!P || P->invalid_syntax)
+    {
+        send_fmt(c, "{\"event\":\"end\",\"run\":%d,\"status\":%d%s}\n", run, P ? 2 : 0,
+                 P ? ",\"error\":\"invalid syntax\"" : "");
+        parse_destroy(&P);
+        return;
+    }
+
+    ch = calloc(1, sizeof(*ch));
+    ch->client = c;
+    ch->run = run;
+    ch->head = ch->p = P;
+    ch->next = chains;
+    chains = ch;
+    chain_run(ch);
+}
+
+static void handle_request(Client *c, char *line)
+{
+    size_t len = strlen(line);
+
+    if (len && line[len - 1] == '\r')
+        line[len - 1] = '\0';
+
+    if (!strncmp(line, "run ", 4))
+    {
+        request_run(c, line + 4);
+    }
+    else if (!strcmp(line, "jobs"))
+    {
+        send_jobs(c);
+    }
+    else if (!strcmp(line, "watch"))
+    {
+        c->watch = 1;
+        send_text(c, "{\"event\":\"watch\"}\n");
+    }
+    else if (!strcmp(line, "stats"))
+    {
+        char *text;
+        size_t n;
+        FILE *f = open_memstream(&text, &n);
+
+        stats_print_json(f);
+        fclose(f);
+        send_text(c, text);
+        free(text);
+    }
+    else if (*line)
+    {
+        send_text(c, "{\"error\":\"unknown request\"}\n");
+    }
+}
+
+//=============================================================CLIENTS===============================================================
+
+// reads what the client sent and runs every whole line of it
+static void read_client(Client *c)
+{
+    char *line, *nl;
+    size_t done = 0;
+    ssize_t n;
+
+    if (c->in_len + 4096 > c->in_cap)
+    {
+        c->in_cap = (c->in_len + 4096) * 2;
+        c->in = realloc(c->in, c->in_cap);
+    }
+    n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        c->dead = 1;
+        return;
+    }
+    c->in_len += n;
+
+    while (!c->dead && (nl = memchr(c->in + done, '\n', c->in_len - done)))
+    {
+        line = c->in + done;
+        *nl = '\0';
+        done = nl + 1 - c->in;
+        handle_request(c, line);
+    }
+    memmove(c->in, c->in + done, c->in_len - done);
+    c->in_len -= done;
+}
+
+static void close_client(Client *c)
+{
+    Chain *ch;
+    int i;
+
+    for (ch = chains; ch; ch = ch->next)
+    {
+        if (ch->client == c)
+            ch->client = NULL;
+    }
+    for (i = 0; i < owners_cap; i++)
+    {
+        if (owners[i].client == c)
+            owners[i].client = NULL;
+    }
+
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "pssh: %s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (!lstat(path, &st))
+    { // a socket left behind is reused, unless a daemon still answers on it
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (!S_ISSOCK(st.st_mode) || !connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        {
+            fprintf(stderr, "pssh: %s: %s\n", path, S_ISSOCK(st.st_mode) ? "a daemon is already listening" : "not a socket");
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0); // accepted until EAGAIN
+    mask = umask(077); // only our user may submit commands
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0)
+    {
+        fprintf(stderr, "pssh: %s: %s\n", path, strerror(errno));
+        umask(mask);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    umask(mask);
+    return fd;
+}
+
+int daemon_run(const char *path)
+{
+    int lfd = listen_on(path), nclients, n, fd, i, ready, timeout;
+    Client *c, **pp;
+    Chain *ch, *next;
+
+    if (lfd < 0)
+        return 1;
+    listen_fd = lfd;
+    job_hook = job_event;
+    error_hook = launch_error;
+
+    if ((fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) >= 0)
+    { // jobs must not read the terminal (or whatever) the daemon was started from
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+
+    for (;;)
+    {
+        for (ch = chains; ch; ch = next)
+        {
+            next = ch->next; // chain_run may free ch, never another chain
+            if (ch->ready)
+            {
+                ch->ready = 0;
+                chain_advance(ch, ch->status);
+                chain_run(ch);
+            }
+        }
+        timeout = chain_timeouts();
+        for (ready = 0, ch = chains; ch; ch = ch->next)
+        { // woken while a builtin of another line ran (parallel reaps its items)
+            ready |= ch->ready;
+        }
+
+        nclients = 0;
+        for (c = clients; c; c = c->next)
+        {
+            nclients++;
+        }
+
+        struct pollfd pfd[nclients + 1];
+        Client *polled[nclients + 1];
+
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        n = 1;
+        for (c = clients; c; c = c->next)
+        {
+            pfd[n].fd = c->fd;
+            pfd[n].events = POLLIN | (c->out_len ? POLLOUT : 0);
+            polled[n++] = c;
+        }
+
+        poll_events(pfd, n, ready ? 0 : timeout); // reaps children, which fires job_event
+        flush_notices();         // the usual job notices are the daemon's log
+
+        if (pfd[0].revents & POLLIN)
+        {
+            while ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+            {
+                c = calloc(1, sizeof(*c));
+                c->fd = fd;
+                c->next = clients;
+                clients = c;
+            }
+        }
+
+        for (i = 1; i < n; i++)
+        {
+            if (pfd[i].revents & POLLOUT)
+                flush_client(polled[i]);
+            if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                read_client(polled[i]);
+        }
+
+        for (pp = &clients; (c = *pp);)
+        {
+            if (c->dead)
+            {
+                *pp = c->next;
+                close_client(c);
+            }
+            else
+            {
+                pp = &c->next;
+            }
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef _daemon_h_
+#define _daemon_h_
+
+/* Daemon mode (pssh -d socket).
+ *
+ * Listens on a Unix socket for any number of clients.  Each sends
+ * requests, one per line, and gets one JSON object per line back:
+ *
+ *   run <command line>  runs it like a typed line, without blocking the
+ *                       shell: every pipeline is started in the background,
+ *                       and ; && || follow each pipeline's exit status.
+ *                       Replies {"event":"run","run":N}, then start and
+ *                       done events for its jobs, then {"event":"end",...}
+ *                       with the status of the line.
+ *   jobs                the job table: {"jobs":[...]}
+ *   watch               also receive the start and done events of every
+ *                       client's jobs
+ *   stats               the shell's latency stats, as stats -j prints them
+ *
+ * What the shell has to say about a line (command not found, a file that
+ * cannot be opened) goes to its client as {"event":"error","run":N,...}.
+ * wait only holds up its own line, waiting for the jobs given or else the
+ * client's background jobs, and a pipeline using parallel or calling a
+ * function runs in a copy of the daemon, as one job, so neither keeps
+ * other requests waiting.  So does a line with loops (see script.h), as a
+ * whole; one that only defines functions runs in the daemon itself, and
+ * the functions are there for every later line.  exit and fg would act
+ * on the daemon itself, so a line using them ends with an error event and
+ * status 2; set, export and unset do change the daemon, for every client.
+ *
+ * Commands inherit the daemon's stdout and stderr; use > to send output
+ * elsewhere. */
+
+int daemon_run (const char* path);
+
+#endif /* _daemon_h_ */
@@ -0,0 +1,1041 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "expand.h"
+#include "arena.h"
+#include "vars.h"
+
+#define DENTS_BATCH (1 << 20)          // bytes of dirents per getdents64 call
+#define CACHE_DIRS 8                   // listings kept...
+#define CACHE_TTL_NS 2000000000ull     // ...for this long
+#define MTIME_SLACK_NS 20000000ull     // and only if the directory was not changed just before
+
+typedef struct
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} Dirent64;
+
+//========================================================= LISTINGS ===========================================================
+
+/* The names of a directory but . and .., each stored as its d_type, its
+ * length (NAME_MAX fits in a byte), the name and a '\0'. */
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t read_at; // CLOCK_REALTIME, like mtime
+    int users;        // walks going through it right now
+    int cached;
+    char *ents;
+    size_t size;
+} Listing;
+
+#define ENT_TYPE(e) ((unsigned char)(e)[0])
+#define ENT_LEN(e) ((unsigned char)(e)[1])
+#define ENT_NAME(e) ((e) + 2)
+#define ENT_NEXT(e) ((e) + ENT_LEN(e) + 3)
+
+static Listing *cache[CACHE_DIRS];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void listing_release(Listing *L)
+{
+    if (--L->users == 0 && !L->cached)
+    {
+        free(L->ents);
+        free(L);
+    }
+}
+
+// takes slot i out of the cache, freeing its listing unless a walk still uses it
+static void uncache(int i)
+{
+    cache[i]->cached = 0;
+    cache[i]->users++;
+    listing_release(cache[i]);
+    cache[i] = NULL;
+}
+
+static Listing *listing_read(int fd, const struct stat *st)
+{
+    static char *batch = NULL;
+    Listing *L = calloc(1, sizeof(*L));
+    size_t cap = 0, len;
+    Dirent64 *d;
+    long n, off;
+    char *e;
+
+    if (!batch)
+        batch = malloc(DENTS_BATCH);
+
+    L->dev = st->st_dev;
+    L->ino = st->st_ino;
+    L->mtime = st->st_mtim;
+
+    while ((n = syscall(SYS_getdents64, fd, batch, DENTS_BATCH)) > 0)
+    {
+        for (off = 0; off < n; off += d->d_reclen)
+        {
+            d = (Dirent64 *)(batch + off);
+            if (d->d_name[0] == '.' && (!d->d_name[1] || (d->d_name[1] == '.' && !d->d_name[2])))
+                continue;
+
+            len = strlen(d->d_name);
+            if (L->size + len + 3 > cap)
+            {
+                while (L->size + len + 3 > cap)
+                {
+                    cap = cap ? cap * 2 : 16384;
+                }
+                L->ents = realloc(L->ents, cap);
+            }
+            e = L->ents + L->size;
+            e[0] = d->d_type;
+            e[1] = len;
+            memcpy(ENT_NAME(e), d->d_name, len + 1);
+            L->size += len + 3;
+        }
+    }
+    return L;
+}
+
+/* Returns the listing of the directory at path, from the cache if it has
+ * not changed since, or NULL if it cannot be read.  Pair with listing_release. */
+static Listing *listing_open(const char *path)
+{
+    uint64_t now = now_ns(), mtime;
+    struct stat st;
+    Listing *L;
+    int fd, i, slot = -1;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    for (i = 0; i < CACHE_DIRS; i++)
+    {
+        if ((L = cache[i]) && L->dev == st.st_dev && L->ino == st.st_ino)
+        {
+            if (now - L->read_at < CACHE_TTL_NS && L->mtime.tv_sec == st.st_mtim.tv_sec && L->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            {
+                close(fd);
+                L->users++;
+                return L;
+            }
+            uncache(i); // changed since, or too old
+        }
+        else if (L && now - L->read_at >= CACHE_TTL_NS)
+        {
+            uncache(i);
+        }
+    }
+
+    L = listing_read(fd, &st);
+    L->users = 1;
+    close(fd);
+
+    // a change in the same timestamp tick as st_mtim would go unnoticed: keep only settled directories
+    mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000u + st.st_mtim.tv_nsec;
+    if (mtime + MTIME_SLACK_NS > now)
+        return L;
+
+    for (i = 0; i < CACHE_DIRS; i++)
+    { // a free slot, or else the oldest listing no walk is using
+        if (!cache[i])
+        {
+            slot = i;
+            break;
+        }
+        if (!cache[i]->users && (slot < 0 || cache[i]->read_at < cache[slot]->read_at))
+            slot = i;
+    }
+    if (slot >= 0)
+    {
+        if (cache[slot])
+            uncache(slot);
+        L->cached = 1;
+        L->read_at = now;
+        cache[slot] = L;
+    }
+    return L;
+}
+
+void expand_flush(void)
+{
+    int i;
+
+    for (i = 0; i < CACHE_DIRS; i++)
+    {
+        if (cache[i])
+            uncache(i);
+    }
+}
+
+//========================================================= PATTERNS ===========================================================
+
+enum
+{
+    M_CHAR,
+    M_ANY,  // ?
+    M_STAR, // *
+    M_SET   // [...]
+};
+
+typedef struct
+{
+    unsigned char op;
+    unsigned char c;       // M_CHAR
+    unsigned char set[32]; // M_SET: bitmap of the bytes it matches
+} Op;
+
+// one path component of a pattern, compiled
+typedef struct
+{
+    Op *ops;
+    int nops;
+    int meta;      // has * ? or [...], else text is the name to look for
+    int globstar;  // is **
+    int dot;       // starts with a literal '.', so may match hidden names
+    size_t minlen; // shortest name that can match
+    char *text;    // the component without escapes
+    char *suffix;  // literal tail after the last * ? or [...], checked first
+    size_t nsuffix;
+} Component;
+
+// reads the set after a '[' at s, returns where it ends or NULL if it does not ('[' is literal)
+static const char *compile_set(const char *s, const char *end, Op *op)
+{
+    int negate = 0, first = 1, i;
+    unsigned char lo, hi, c;
+
+    memset(op->set, 0, sizeof(op->set));
+    op->op = M_SET;
+
+    if (s < end && (*s == '!' || *s == '^'))
+    {
+        negate = 1;
+        s++;
+    }
+
+    for (; s < end; first = 0)
+    {
+        if (*s == ']' && !first)
+        {
+            if (negate)
+            {
+                for (i = 0; i < 32; i++)
+                {
+                    op->set[i] = ~op->set[i];
+                }
+            }
+            op->set[0] &= ~1; // never '\0'
+            return s + 1;
+        }
+
+        if (*s == '\\' && s + 1 < end)
+            s++;
+        lo = hi = *s++;
+
+        if (s + 1 < end && *s == '-' && s[1] != ']')
+        {
+            s++;
+            if (*s == '\\' && s + 1 < end)
+                s++;
+            hi = *s++;
+        }
+        for (c = lo; c >= lo && c <= hi; c++)
+        {
+            op->set[c >> 3] |= 1 << (c & 7);
+            if (c == 255)
+                break;
+        }
+    }
+    return NULL;
+}
+
+// compiles the n characters of the escaped pattern component at s
+static void compile(Component *C, const char *s, size_t n)
+{
+    const char *end = s + n, *q;
+    char *t;
+    Op op;
+    int i;
+
+    memset(C, 0, sizeof(*C));
+    C->ops = malloc((n + 1) * sizeof(Op));
+    C->text = t = malloc(n + 1);
+    C->globstar = n == 2 && s[0] == '*' && s[1] == '*';
+
+    while (s < end)
+    {
+        op.op = M_CHAR;
+        op.c = *s++;
+
+        if (op.c == '\\' && s < end)
+        {
+            op.c = *s++;
+        }
+        else if (op.c == '*')
+        {
+            C->meta = 1;
+            if (C->nops && C->ops[C->nops - 1].op == M_STAR)
+                continue; // ** within a name is just *
+            op.op = M_STAR;
+        }
+        else if (op.c == '?')
+        {
+            C->meta = 1;
+            op.op = M_ANY;
+        }
+        else if (op.c == '[' && (q = compile_set(s, end, &op)))
+        {
+            C->meta = 1;
+            s = q;
+        }
+
+        if (op.op == M_CHAR)
+            *t++ = op.c;
+        if (op.op != M_STAR)
+            C->minlen++;
+        C->ops[C->nops++] = op;
+    }
+    *t = '\0';
+
+    C->dot = C->nops && C->ops[0].op == M_CHAR && C->ops[0].c == '.';
+
+    for (i = C->nops; i > 0 && C->ops[i - 1].op == M_CHAR; i--)
+        ;
+    C->nsuffix = C->nops - i;
+    C->suffix = malloc(C->nsuffix + 1);
+    for (n = 0; i < C->nops; i++)
+    {
+        C->suffix[n++] = C->ops[i].c;
+    }
+}
+
+static void component_free(Component *C)
+{
+    free(C->ops);
+    free(C->text);
+    free(C->suffix);
+}
+
+static int op_matches(const Op *op, unsigned char c)
+{
+    switch (op->op)
+    {
+    case M_CHAR:
+        return op->c == c;
+    case M_ANY:
+        return 1;
+    default:
+        return op->set[c >> 3] & (1 << (c & 7));
+    }
+}
+
+// does the name of len bytes match?  Linear but for backtracking to the last *
+static int match(const Component *C, const char *name, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)name, *mark = NULL;
+    int i = 0, star = -1;
+
+    if (len < C->minlen || memcmp(name + len - C->nsuffix, C->suffix, C->nsuffix))
+        return 0;
+    if (name[0] == '.' && !C->dot)
+        return 0;
+
+    while (*s)
+    {
+        if (i < C->nops && C->ops[i].op == M_STAR)
+        {
+            star = ++i;
+            mark = s;
+        }
+        else if (i < C->nops && op_matches(&C->ops[i], *s))
+        {
+            i++;
+            s++;
+        }
+        else if (star >= 0)
+        {
+            i = star;
+            s = ++mark;
+        }
+        else
+        {
+            return 0;
+        }
+    }
+    while (i < C->nops && C->ops[i].op == M_STAR)
+    {
+        i++;
+    }
+    return i == C->nops;
+}
+
+//=========================================================== GLOB =============================================================
+
+typedef struct
+{
+    char **v;
+    size_t n;
+    size_t cap;
+} Words;
+
+static void push(Words *W, char *s)
+{
+    if (W->n == W->cap)
+    {
+        W->cap = W->cap ? W->cap * 2 : 64;
+        W->v = realloc(W->v, W->cap * sizeof(*W->v));
+    }
+    W->v[W->n++] = s;
+}
+
+typedef struct
+{
+    Component *comps;
+    int ncomps;
+    int dirs_only;       // the pattern ends in '/'
+    char path[PATH_MAX]; // the directory being walked, with a trailing '/'
+    Words *out;
+    struct Arena *arena; // matches are allocated here
+} Glob;
+
+static void walk(Glob *G, size_t plen, int c);
+
+static void emit(Glob *G, size_t len)
+{
+    if (G->dirs_only)
+        G->path[len++] = '/';
+    push(G->out, arena_strndup(G->arena, G->path, len));
+}
+
+// appends a name to the path at plen, returns the new length or 0 if too long
+static size_t append(Glob *G, size_t plen, const char *name, size_t len)
+{
+    if (plen + len + 2 >= sizeof(G->path))
+        return 0;
+    memcpy(G->path + plen, name, len + 1);
+    return plen + len;
+}
+
+// is the entry just appended to the path a directory?  symlinks count unless ** is walking
+static int is_dir(Glob *G, const char *e, int follow)
+{
+    struct stat st;
+
+    if (ENT_TYPE(e) == DT_DIR)
+        return 1;
+    if (ENT_TYPE(e) == DT_UNKNOWN || (follow && ENT_TYPE(e) == DT_LNK))
+        return (follow ? stat(G->path, &st) : lstat(G->path, &st)) == 0 && S_ISDIR(st.st_mode);
+    return 0;
+}
+
+// matches entry e of the directory at path[0, plen) against component c
+static void visit(Glob *G, const char *e, size_t plen, int c)
+{
+    Component *C = &G->comps[c];
+    const char *name = ENT_NAME(e);
+    int last = c == G->ncomps - 1;
+    size_t n;
+
+    if (C->globstar)
+    { // as no directory at all, then as this one and maybe more
+        if (!last)
+            visit(G, e, plen, c + 1);
+        if (name[0] == '.' || !(n = append(G, plen, name, ENT_LEN(e))))
+            return;
+        if (last && (!G->dirs_only || is_dir(G, e, 0)))
+            emit(G, n);
+        if (is_dir(G, e, 0))
+        {
+            G->path[n] = '/';
+            walk(G, n + 1, c);
+        }
+        return;
+    }
+
+    if (C->meta ? !match(C, name, ENT_LEN(e)) : strcmp(C->text, name))
+        return;
+    if (!(n = append(G, plen, name, ENT_LEN(e))))
+        return;
+
+    if (last)
+    {
+        if (!G->dirs_only || is_dir(G, e, 1))
+            emit(G, n);
+    }
+    else if (is_dir(G, e, 1))
+    {
+        G->path[n] = '/';
+        walk(G, n + 1, c + 1);
+    }
+}
+
+// matches the directory at path[0, plen) against the pattern from component c on
+static void walk(Glob *G, size_t plen, int c)
+{
+    Component *C = &G->comps[c];
+    struct stat st;
+    Listing *L;
+    char *e;
+    size_t n;
+
+    if (!C->meta && !C->globstar)
+    { // a plain name: look it up rather than list the directory
+        if (!(n = append(G, plen, C->text, strlen(C->text))))
+            return;
+        if (c < G->ncomps - 1)
+        {
+            G->path[n] = '/';
+            walk(G, n + 1, c + 1);
+        }
+        else if ((G->dirs_only ? stat(G->path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(G->path, &st) == 0))
+        {
+            emit(G, n);
+        }
+        return;
+    }
+
+    G->path[plen] = '\0';
+    if (!(L = listing_open(plen ? G->path : ".")))
+        return;
+
+    for (e = L->ents; e < L->ents + L->size; e = ENT_NEXT(e))
+    {
+        visit(G, e, plen, c);
+    }
+    listing_release(L);
+}
+
+static int cmp_words(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// removes the escapes of a pattern, in place
+static char *unescape(char *s)
+{
+    char *p = s, *out = s;
+
+    for (; *p; p++)
+    {
+        if (*p == '\\' && p[1])
+            p++;
+        *out++ = *p;
+    }
+    *out = '\0';
+    return s;
+}
+
+// adds the sorted matches of pattern pat to out, or pat itself if there are none
+static void glob_word(Words *out, char *pat, struct Arena *A)
+{
+    static Glob G;
+    const char *s = pat, *end;
+    size_t first = out->n;
+    int meta = 0, i;
+
+    for (; *s && !strchr("*?[", *s); s++)
+    {
+        if (*s == '\\' && s[1])
+            s++;
+    }
+    if (!*s)
+    { // no wildcard (a quoted or substituted word): nothing to compile or read
+        push(out, arena_strndup(A, unescape(pat), strlen(pat)));
+        return;
+    }
+    s = pat;
+
+    G.comps = malloc((strlen(pat) / 2 + 2) * sizeof(*G.comps));
+    G.ncomps = 0;
+    G.dirs_only = 0;
+    G.out = out;
+    G.arena = A;
+
+    while (*s)
+    { // split at the unescaped '/'s, skipping empty components
+        for (end = s; *end && *end != '/'; end++)
+        {
+            if (*end == '\\' && end[1])
+                end++;
+        }
+        if (end > s)
+        {
+            Component *C = &G.comps[G.ncomps];
+
+            compile(C, s, end - s);
+            if (G.ncomps && C->globstar && C[-1].globstar)
+            {
+                component_free(C); // **/** is **
+            }
+            else
+            {
+                meta |= C->meta | C->globstar;
+                G.ncomps++;
+            }
+        }
+        G.dirs_only = *end == '/';
+        s = *end ? end + 1 : end;
+    }
+
+    if (meta)
+    {
+        G.path[0] = '/';
+        walk(&G, pat[0] == '/', 0);
+        qsort(out->v + first, out->n - first, sizeof(*out->v), cmp_words);
+    }
+    if (out->n == first) // nothing to match, or nothing matched
+        push(out, arena_strndup(A, unescape(pat), strlen(pat)));
+
+    for (i = 0; i < G.ncomps; i++)
+    {
+        component_free(&G.comps[i]);
+    }
+    free(G.comps);
+}
+
+//========================================================== BRACES ============================================================
+
+// reads one end of a {x..y} range: an integer or a single character
+static int range_end(const char *s, const char *end, long *v, int *width, int *is_char)
+{
+    char *stop;
+
+    *v = strtol(s, &stop, 10);
+    if (stop == end && stop > s)
+    {
+        *is_char = 0;
+        *width = (s[0] == '0' || (s[0] == '-' && s[1] == '0')) && end - s > 1 ? end - s : 0;
+        return 1;
+    }
+    if (end - s == 1 && *s != '\\')
+    {
+        *v = (unsigned char)*s;
+        *is_char = 1;
+        *width = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// expands the range between the braces at open and close, 0 if it is not one
+static int brace_range(Words *out, const char *pat, const char *open, const char *close)
+{
+    const char *dots = strstr(open + 1, "..");
+    size_t pre = open - pat, suf = strlen(close + 1);
+    long a, b, v;
+    int wa, wb, ca, cb, step, n;
+    char *s;
+
+    if (!dots || dots >= close || !range_end(open + 1, dots, &a, &wa, &ca) ||
+        !range_end(dots + 2, close, &b, &wb, &cb) || ca != cb)
+        return 0;
+
+    step = a <= b ? 1 : -1;
+    for (v = a;; v += step)
+    { // prefix, value, suffix: built by hand, a range may be long
+        s = malloc(pre + (wa > wb ? wa : wb) + 24 + suf);
+        memcpy(s, pat, pre);
+        if (ca)
+        {
+            s[pre] = (char)v;
+            n = 1;
+        }
+        else
+        {
+            n = sprintf(s + pre, "%0*ld", wa > wb ? wa : wb, v);
+        }
+        memcpy(s + pre + n, close + 1, suf + 1);
+        push(out, s);
+        if (v == b)
+            break;
+    }
+    return 1;
+}
+
+// adds the brace expansions of the pattern pat to out, which owns them
+static void brace(Words *out, const char *pat)
+{
+    const char *open, *close, *alt, *sep;
+    Words alts = {0};
+    size_t i;
+    int depth, commas;
+    char *s;
+
+    for (open = pat; *open; open++)
+    {
+        if (*open == '\\' && open[1])
+        {
+            open++;
+            continue;
+        }
+        if (*open != '{')
+            continue;
+
+        for (close = open + 1, depth = 0, commas = 0; *close; close++)
+        {
+            if (*close == '\\' && close[1])
+                close++;
+            else if (*close == '{')
+                depth++;
+            else if (*close == '}' && depth-- == 0)
+                break;
+            else if (*close == ',' && !depth)
+                commas++;
+        }
+        if (!*close)
+            continue; // no matching '}': the '{' is literal
+
+        if (!commas)
+        {
+            if (!brace_range(&alts, pat, open, close))
+                continue; // {x} is literal, but braces inside it may not be
+        }
+        else
+        {
+            for (alt = open + 1, depth = 0;; alt = sep + 1)
+            { // one word per top-level alternative
+                for (sep = alt; sep < close; sep++)
+                {
+                    if (*sep == '\\' && sep + 1 < close)
+                        sep++;
+                    else if (*sep == '{')
+                        depth++;
+                    else if (*sep == '}')
+                        depth--;
+                    else if (*sep == ',' && !depth)
+                        break;
+                }
+                if (asprintf(&s, "%.*s%.*s%s", (int)(open - pat), pat, (int)(sep - alt), alt, close + 1) < 0)
+                    break;
+                push(&alts, s);
+                if (sep == close)
+                    break;
+            }
+        }
+
+        // later braces, and braces within the alternatives, expand in turn
+        for (i = 0; i < alts.n; i++)
+        {
+            if (!commas && !strchr(close + 1, '{'))
+            { // a range, and none follow: {1..100000} is 100000 words already
+                push(out, alts.v[i]);
+                continue;
+            }
+            brace(out, alts.v[i]);
+            free(alts.v[i]);
+        }
+        free(alts.v);
+        return;
+    }
+
+    push(out, strdup(pat));
+}
+
+//========================================================= VARIABLES ==========================================================
+
+const char *(*expand_var)(const char *name, size_t len) = NULL;
+char *(*expand_cmd)(const char *text) = NULL;
+const char *(*expand_proc)(const char *text, int output) = NULL;
+
+typedef struct
+{
+    char *s;
+    size_t n;
+    size_t cap;
+} Buf;
+
+static void put(Buf *b, const char *s, size_t n)
+{
+    if (b->n + n + 1 > b->cap)
+    {
+        b->cap = (b->n + n + 1) * 2;
+        b->s = realloc(b->s, b->cap);
+    }
+    memcpy(b->s + b->n, s, n);
+    b->n += n;
+    b->s[b->n] = '\0';
+}
+
+// appends a value, with its pattern characters escaped so that it stays as it is;
+// if split is set, each run of blanks in it ends the word and starts the next one
+static void put_value(Buf *b, Words *out, const char *v, int split)
+{
+    size_t n;
+
+    for (; *v; v++)
+    {
+        if ((n = strcspn(v, split ? "*?[]{},\\$ \t\n" : "*?[]{},\\$")))
+        { // a run of plain characters at once
+            put(b, v, n);
+            if (!*(v += n))
+                break;
+        }
+        if (split && (*v == ' ' || *v == '\t' || *v == '\n'))
+        {
+            if (b->n)
+            {
+                push(out, b->s);
+                memset(b, 0, sizeof(*b));
+                put(b, "", 0);
+            }
+            continue;
+        }
+        if (strchr("*?[]{},\\$", *v))
+            put(b, "\\", 1);
+        put(b, v, 1);
+    }
+}
+
+static const char *lookup(const char *name, size_t len)
+{
+    if (expand_var)
+        return expand_var(name, len);
+    return var_get(name, len);
+}
+
+// runs the command of the substitution $(...) at p, returns its output without the trailing newlines
+static char *capture(const char *p, const char *end)
+{
+    char *text, *output;
+    size_t n;
+
+    if (!expand_cmd)
+        return NULL;
+
+    text = strndup(p + 2, end - p - 3);
+    output = expand_cmd(text);
+    free(text);
+
+    for (n = output ? strlen(output) : 0; n && output[n - 1] == '\n'; n--)
+    {
+        output[n - 1] = '\0';
+    }
+    return output;
+}
+
+/* Replaces every $name, ${name}, $(...), $1 and $? (or # $ @ *) of pat by
+ * its value, and adds the resulting patterns to out.  With split set, the
+ * values of the expansions that were not in double quotes (not marked by
+ * a '"') are split into words at blanks.  A word that comes to nothing is
+ * only added if keep is set. */
+static void subst(Words *out, const char *pat, int split, int keep)
+{
+    const char *p = pat, *name, *end, *v;
+    char *output = NULL;
+    Buf b = {0};
+    size_t len;
+    int quoted;
+
+    put(&b, "", 0);
+    while (*p)
+    {
+        if ((len = strcspn(p, "\\\"$")))
+        { // up to the next escape or expansion at once
+            put(&b, p, len);
+            p += len;
+            continue;
+        }
+        if (*p == '\\' && p[1])
+        {
+            put(&b, p, 2);
+            p += 2;
+            continue;
+        }
+        if ((quoted = *p == '"' && p[1] == '$'))
+            p++;
+        if (*p++ != '$')
+        {
+            put(&b, p - 1, 1);
+            continue;
+        }
+
+        if (*p == '(' && (end = parse_subst_end(p - 1)))
+        {
+            v = output = capture(p - 1, end);
+            p = end;
+        }
+        else if (*p == '{' && (end = strchr(p, '}')))
+        {
+            v = lookup(p + 1, end - p - 1);
+            p = end + 1;
+        }
+        else if (*p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))
+        {
+            for (name = p; *p == '_' || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'); p++)
+                ;
+            len = p - name;
+            v = lookup(name, len);
+        }
+        else if (*p && strchr("0123456789?#$@*", *p))
+        {
+            v = lookup(p++, 1);
+        }
+        else
+        { // a lone $ is just a $
+            put(&b, "$", 1);
+            continue;
+        }
+
+        if (v)
+            put_value(&b, out, v, split && !quoted);
+        free(output);
+        output = NULL;
+    }
+
+    if (b.n || keep)
+        push(out, b.s);
+    else
+        free(b.s);
+}
+
+// "$@" is one word per argument
+static void push_args(Words *words, struct Arena *A)
+{
+    const char *v = lookup("#", 1);
+    char n[16];
+    int i, argc = v ? atoi(v) : 0;
+
+    for (i = 1; i <= argc; i++)
+    {
+        snprintf(n, sizeof(n), "%d", i);
+        if ((v = lookup(n, strlen(n))))
+            push(words, arena_strndup(A, v, strlen(v)));
+    }
+}
+
+// the path of the process substitution at pat, or NULL
+static char *proc(const char *pat, struct Arena *A)
+{
+    const char *path;
+    char *text;
+
+    if (!expand_proc)
+        return NULL;
+
+    text = strndup(pat + 2, strlen(pat) - 3);
+    path = expand_proc(text, *pat == '>');
+    free(text);
+    return path ? arena_strndup(A, path, strlen(path)) : NULL;
+}
+
+//========================================================== EXPAND ============================================================
+
+// the value of an assignment word: expanded, but neither split nor matched
+static char *assignment(const char *pat, struct Arena *A)
+{
+    Words value = {0};
+    char *v;
+
+    if (strchr(pat, '$'))
+        subst(&value, pat, 0, 1);
+    else
+        push(&value, strdup(pat));
+
+    v = arena_strndup(A, unescape(value.v[0]), strlen(value.v[0]));
+    free(value.v[0]);
+    free(value.v);
+    return v;
+}
+
+void expand_task(Task *T, struct Arena *A)
+{
+    Words words = {0}, fields, pats;
+    size_t i, k, f, nassigns = 0;
+    char *pat, *path;
+
+    if (!T->patterns && !var_assignment(T->argv[0]))
+        return;
+
+    for (i = 0; T->argv[i]; i++)
+    {
+        pat = T->patterns && T->patterns[i] ? T->patterns[i] + 1 : NULL; // past the quoted flag
+
+        if (nassigns == i && var_assignment(T->argv[i]))
+        { // name=value words before the command
+            push(&words, pat ? assignment(pat, A) : T->argv[i]);
+            nassigns++;
+            continue;
+        }
+        if (!pat)
+        {
+            push(&words, T->argv[i]);
+            continue;
+        }
+
+        if (!strcmp(pat, "\"$@"))
+        {
+            push_args(&words, A);
+            continue;
+        }
+        if ((*pat == '<' || *pat == '>') && parse_subst_end(pat) == pat + strlen(pat))
+        { // <(...) or >(...): its /dev/fd path, nothing else to expand
+            path = proc(pat, A);
+            push(&words, path ? path : T->argv[i]);
+            continue;
+        }
+        memset(&fields, 0, sizeof(fields));
+        if (strchr(pat, '$'))
+            subst(&fields, pat, 1, T->patterns[i][0] == '"'); // an unquoted word that expands to nothing is no word
+        else
+            push(&fields, strdup(pat));
+
+        for (f = 0; f < fields.n; f++)
+        {
+            memset(&pats, 0, sizeof(pats));
+            brace(&pats, fields.v[f]);
+            for (k = 0; k < pats.n; k++)
+            {
+                glob_word(&words, pats.v[k], A);
+                free(pats.v[k]);
+            }
+            free(pats.v);
+            free(fields.v[f]);
+        }
+        free(fields.v);
+    }
+    push(&words, NULL);
+
+    T->argv = arena_alloc(A, words.n * sizeof(*T->argv));
+    memcpy(T->argv, words.v, words.n * sizeof(*T->argv));
+    T->assigns = NULL;
+    if (nassigns)
+    { // split them off, the command (resolved ahead or not) comes after them
+        T->assigns = T->argv;
+        T->argv = arena_alloc(A, (words.n - nassigns) * sizeof(*T->argv));
+        memcpy(T->argv, T->assigns + nassigns, (words.n - nassigns) * sizeof(*T->argv));
+        T->assigns[nassigns] = NULL;
+        T->path = NULL;
+    }
+    T->cmd = T->argv[0];
+    T->patterns = NULL;
+    free(words.v);
+}
@@ -0,0 +1,52 @@
+#ifndef _expand_h_
+#define _expand_h_
+
+#include <stddef.h>
+
+#include "parse.h"
+
+struct Arena;
+
+/* Variable, command, brace and filename expansion.
+ *
+ * Runs between parse_cmdline() and the launch.  Each word of a task that
+ * has a pattern (see Task) first has its $name, ${name}, $1 and $? (and
+ * $# $$ $@ $*) replaced by their values and its $(...) by the output of
+ * the command, less its trailing newlines.  A word that is a <(...) or
+ * >(...) as a whole is replaced by the path that expand_proc gives for it
+ * and left at that.  Values are taken literally;
+ * those not in double quotes are split into words at blanks, "$@" alone
+ * is one word per argument, and an unquoted word that comes to nothing
+ * is dropped.  It is then brace expanded ({a,b}, {1..10}, {a..e}).  Each
+ * result is then matched against the filesystem, using * ? and [...]
+ * within a path component and ** as a whole component for any number of
+ * directories.  The matches, sorted, replace the word; a pattern that
+ * matches nothing stays as typed.  Names starting with '.' are only
+ * matched by a pattern component that starts with a '.', and ** never
+ * descends into them or through symlinks.
+ *
+ * The name=value words before the command are only expanded, never split
+ * or matched, and move from argv to assigns.
+ *
+ * Directories are read in large getdents64() batches.  Their listings are
+ * kept for a couple of seconds, keyed by device, inode and mtime, so a
+ * line (or a few typed in quick succession) reads each directory once.
+ * expand_flush() drops them. */
+
+/* Looks up the variable of len bytes at name, NULL if it is unset.
+ * Unhooked, variables are taken from the shell's (see var_get). */
+extern const char* (*expand_var) (const char* name, size_t len);
+
+/* Runs the command line text and returns its output (malloc'ed), or NULL.
+ * Unhooked, a $(...) comes to nothing. */
+extern char* (*expand_cmd) (const char* text);
+
+/* Sets up the process substitution <(text), or >(text) if output is set,
+ * and returns the path the command is to be given for it (/dev/fd/N).
+ * Unhooked, or if it returns NULL, the word stays as typed. */
+extern const char* (*expand_proc) (const char* text, int output);
+
+void expand_task (Task* T, struct Arena* A);
+void expand_flush (void);
+
+#endif /* _expand_h_ */
@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "forksrv.h"
+#include "spawn.h"
+#include "vars.h"
+
+#define MAX_REQUEST 65536 // larger argv+environment are left to the shell
+#define MAX_STRINGS 4096
+
+/* A request is this header followed by path, argv and the environment
+ * as NUL-terminated strings; the fds come along with SCM_RIGHTS: stdin,
+ * stdout and, for a held child, the read end of its go pipe. */
+typedef struct
+{
+    pid_t pgid;
+    int held;
+    int argc;
+    int envc;
+} Request;
+
+typedef struct
+{
+    pid_t pid; // also set on failure if the child was started (and must be reaped)
+    int err;
+} Reply;
+
+static int srv_fd = -1; // the shell's end of the socket
+
+// signals the shell changes, that the children get back to their default
+static const int child_default_sigs[] = {
+    SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE, 0};
+
+//=========================================================== SERVER ===========================================================
+
+// in the clone: only async-signal-safe calls from here to exec
+static void run_child(const char *path, char **argv, char **envp, pid_t pgid, int *fds, int held, int err_fd)
+{
+    sigset_t mask;
+    int err, i;
+    char c;
+
+    if (setpgid(0, pgid) < 0 && !held)
+        goto failed;
+
+    for (i = 0; child_default_sigs[i]; i++)
+    {
+        signal(child_default_sigs[i], SIG_DFL);
+    }
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    dup2(fds[0], STDIN_FILENO);
+    dup2(fds[1], STDOUT_FILENO);
+
+    if (held)
+    {
+        while (read(fds[2], &c, 1) < 0 && errno == EINTR)
+            ; // EOF: released
+    }
+
+    spawn_exec(path, argv, envp);
+    if (held)
+    { // nobody waits for the exec any more, say it like spawn_cmd_held
+        write(STDERR_FILENO, "pssh: failed to exec ", 21);
+        write(STDERR_FILENO, path, strlen(path));
+        write(STDERR_FILENO, "\n", 1);
+    }
+
+failed:
+    err = errno;
+    write(err_fd, &err, sizeof(err));
+    _exit(127);
+}
+
+// unpacks a request of len bytes and starts its child
+static Reply start_child(char *request, size_t len, int *fds, int nfds)
+{
+    static char *strings[MAX_STRINGS + 2];
+    Reply reply = {-1, EINVAL};
+    char *p = request + sizeof(Request), *end = request + len, *path;
+    Request req;
+    int err_pipe[2], err, i, n;
+
+    if (len <= sizeof(Request) || end[-1] != '\0')
+        return reply;
+    memcpy(&req, request, sizeof(req));
+    if (req.argc < 0 || req.envc < 0 || req.argc + req.envc > MAX_STRINGS || nfds != 2 + !!req.held)
+        return reply;
+
+    // path, then argv and envp laid out one after the other in strings
+    path = p;
+    for (i = 0, n = 0; i < req.argc + req.envc; i++)
+    {
+        p += strlen(p) + 1;
+        if (p >= end)
+            return reply;
+        if (i == req.argc)
+            strings[n++] = NULL;
+        strings[n++] = p;
+    }
+    if (req.envc == 0)
+        strings[n++] = NULL;
+    strings[n] = NULL;
+
+    if (pipe2(err_pipe, O_CLOEXEC) == -1)
+    {
+        reply.err = errno;
+        return reply;
+    }
+
+    // the child is the shell's, not ours: the shell gets its SIGCHLD and reaps it
+    reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+    if (reply.pid == 0)
+    {
+        close(err_pipe[0]);
+        run_child(path, strings, strings + req.argc + 1, req.pgid, fds, req.held, err_pipe[1]);
+    }
+    reply.err = reply.pid < 0 ? errno : 0;
+    close(err_pipe[1]);
+
+    // a child that is not held has exec'd (EOF) or failed by the time this returns
+    if (reply.pid > 0 && !req.held && read(err_pipe[0], &err, sizeof(err)) == sizeof(err))
+        reply.err = err;
+    close(err_pipe[0]);
+    return reply;
+}
+
+static void serve(int sock)
+{
+    static char request[MAX_REQUEST];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct iovec iov = {request, sizeof(request)};
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int fds[3], nfds, i;
+    Reply reply;
+    ssize_t n;
+
+    // Ctrl-C and friends at the terminal reach the shell's group, and so us
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    while (1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            _exit(0); // the shell is gone
+
+        nfds = 0;
+        for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && !nfds)
+            {
+                nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+            }
+        }
+
+        reply = start_child(request, n, fds, nfds);
+        for (i = 0; i < nfds; i++)
+        {
+            close(fds[i]);
+        }
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+//=========================================================== CLIENT ===========================================================
+
+/* Forks the server; to be called first thing, while the shell is small
+ * and has no other children.  Returns 0, or -1 if it could not be started. */
+int forksrv_start(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(sv[0]);
+        serve(sv[1]);
+    }
+
+    close(sv[1]);
+    srv_fd = sv[0];
+    return 0;
+}
+
+int forksrv_running(void)
+{
+    return srv_fd != -1;
+}
+
+// appends s to the request, 0 if it does not fit
+static int pack(char *request, size_t *len, const char *s)
+{
+    size_t n = strlen(s) + 1;
+
+    if (*len + n > MAX_REQUEST)
+        return 0;
+    memcpy(request + *len, s, n);
+    *len += n;
+    return 1;
+}
+
+// the server is gone: from now on the shell starts its children itself
+static void forksrv_lost(void)
+{
+    close(srv_fd);
+    srv_fd = -1;
+    errno = EPIPE;
+}
+
+pid_t forksrv_spawn(const char *path, char **argv, int fd_in, int fd_out, pid_t pgid, int *release_fd)
+{
+    static char request[MAX_REQUEST];
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    Request req = {pgid, release_fd != NULL, 0, 0};
+    struct iovec iov = {request, 0};
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int fds[3] = {fd_in, fd_out, -1}, go[2], ok;
+    size_t len = sizeof(req);
+    char **envp = var_environ();
+    Reply reply;
+    ssize_t n;
+
+    if (srv_fd == -1)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    ok = pack(request, &len, path);
+    for (; ok && argv[req.argc]; req.argc++)
+    {
+        ok = pack(request, &len, argv[req.argc]);
+    }
+    for (; ok && envp[req.envc]; req.envc++)
+    {
+        ok = pack(request, &len, envp[req.envc]);
+    }
+    if (!ok || req.argc + req.envc > MAX_STRINGS)
+    {
+        errno = E2BIG;
+        return -1;
+    }
+    memcpy(request, &req, sizeof(req));
+
+    if (req.held)
+    {
+        if (pgid && kill(-pgid, 0) < 0 && errno == ESRCH)
+        { // same failure as spawn_cmd when the group to join is gone
+            errno = EPERM;
+            return -1;
+        }
+        if (pipe2(go, O_CLOEXEC) == -1)
+            return -1;
+        fds[2] = go[0];
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE((2 + req.held) * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN((2 + req.held) * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, (2 + req.held) * sizeof(int));
+
+    while ((n = sendmsg(srv_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    if (n == (ssize_t)len)
+    {
+        while ((n = recv(srv_fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR)
+            ;
+    }
+
+    if (req.held)
+        close(go[0]);
+    if (n != sizeof(reply))
+    {
+        if (req.held)
+            close(go[1]);
+        forksrv_lost();
+        return -1;
+    }
+
+    if (reply.err)
+    {
+        if (reply.pid > 0)
+            waitpid(reply.pid, NULL, 0); // ours since CLONE_PARENT
+        if (req.held)
+            close(go[1]);
+        errno = reply.err;
+        return -1;
+    }
+
+    if (req.held)
+    {
+        setpgid(reply.pid, pgid ? pgid : reply.pid); // the group must exist once we return
+        *release_fd = go[1];
+    }
+    return reply.pid;
+}
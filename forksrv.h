@@ -0,0 +1,23 @@
+#ifndef _forksrv_h_
+#define _forksrv_h_
+
+#include <sys/types.h>
+
+/* Fork server (pssh -S).
+ *
+ * A helper process forked at startup, while the shell is still small,
+ * that starts children on the shell's behalf: the request (path, argv,
+ * environment, pgid) goes over a socket with the stdin/stdout fds
+ * attached, and the server clone()s itself with CLONE_PARENT, so the
+ * child costs a copy of the server's few pages whatever the size of the
+ * shell, and is still the shell's own child to wait for and reap.
+ *
+ * forksrv_spawn takes the arguments of spawn_cmd (spawn_cmd_held when
+ * release_fd is not NULL) and returns the same.  Requests too large for
+ * one message fail with E2BIG, for the caller to start the child itself. */
+
+int forksrv_start (void);
+int forksrv_running (void);
+pid_t forksrv_spawn (const char* path, char** argv, int fd_in, int fd_out, pid_t pgid, int* release_fd);
+
+#endif /* _forksrv_h_ */
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+#include "vars.h"
+
+#define HASH_BUCKETS 64
+
+typedef struct HashEntry
+{
+    char *name;
+    char *path;
+    unsigned int hits;
+    struct HashEntry *next;
+} HashEntry;
+
+typedef struct
+{
+    char *dir;
+    struct timespec mtime;
+} PathDir;
+
+static HashEntry *table[HASH_BUCKETS];
+static unsigned int nentries = 0;
+
+static char *cached_path = NULL; // copy of $PATH the table was built against
+static PathDir *dirs = NULL;     // directories of cached_path, in search order
+static int ndirs = 0;
+static time_t last_check = 0; // last time the directory mtimes were checked
+static char *cached_cwd = NULL; // working directory the table was built in, if PATH has a relative directory
+static unsigned int generation = 0; // bumped every time the table is flushed
+
+// FNV-1a
+static unsigned int hash_str(const char *s)
+{
+    unsigned int h = 2166136261u;
+
+    while (*s)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h % HASH_BUCKETS;
+}
+
+static void stat_mtime(const char *dir, struct timespec *mtime)
+{
+    struct stat st;
+
+    if (stat(dir, &st) == 0)
+    {
+        *mtime = st.st_mtim;
+    }
+    else
+    {
+        mtime->tv_sec = 0;
+        mtime->tv_nsec = 0;
+    }
+}
+
+// splits PATH into its directories and records their mtimes; an empty one is the current directory
+static void load_path(const char *PATH)
+{
+    const char *dir, *end;
+    int i;
+
+    for (i = 0; i < ndirs; i++)
+    {
+        free(dirs[i].dir);
+    }
+    free(dirs);
+    free(cached_path);
+
+    cached_path = strdup(PATH);
+    dirs = NULL;
+    ndirs = 0;
+
+    free(cached_cwd);
+    cached_cwd = NULL;
+
+    for (dir = PATH; *PATH; dir = end + 1)
+    { // "a::b", ":a" and "a:" all search the current directory too, as sh does
+        end = strchrnul(dir, ':');
+        dirs = realloc(dirs, (ndirs + 1) * sizeof(*dirs));
+        dirs[ndirs].dir = end > dir ? strndup(dir, end - dir) : strdup(".");
+        stat_mtime(dirs[ndirs].dir, &dirs[ndirs].mtime);
+        if (dirs[ndirs].dir[0] != '/' && !cached_cwd)
+            cached_cwd = get_current_dir_name(); // its entries only hold in this directory
+        ndirs++;
+        if (!*end)
+            break;
+    }
+}
+
+// returns 1 if PATH has a relative directory and the shell has changed directory since the table was built
+static int cwd_changed()
+{
+    char *cwd;
+    int changed;
+
+    if (!cached_cwd)
+        return 0;
+
+    cwd = get_current_dir_name();
+    changed = !cwd || strcmp(cwd, cached_cwd);
+    if (changed && cwd)
+    {
+        free(cached_cwd);
+        cached_cwd = cwd;
+    }
+    else
+    {
+        free(cwd);
+    }
+    return changed;
+}
+
+/* Returns 1 if any PATH directory has been modified since it was last seen.
+ * The directories are stat()ed at most once per second so that a hit in the
+ * table stays close to free. */
+static int dirs_changed()
+{
+    struct timespec now, mtime;
+    int i, changed = 0;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec == last_check)
+        return 0;
+    last_check = now.tv_sec;
+
+    for (i = 0; i < ndirs; i++)
+    {
+        stat_mtime(dirs[i].dir, &mtime);
+        if (mtime.tv_sec != dirs[i].mtime.tv_sec || mtime.tv_nsec != dirs[i].mtime.tv_nsec)
+        {
+            dirs[i].mtime = mtime;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// flushes the table if it no longer reflects $PATH
+static void hash_validate()
+{
+    const char *PATH = var_get("PATH", 4);
+
+    if (!PATH)
+        PATH = "";
+
+    if (!cached_path || strcmp(cached_path, PATH))
+    {
+        hash_clear();
+        load_path(PATH);
+    }
+    else if (cwd_changed() || dirs_changed())
+    {
+        hash_clear();
+    }
+}
+
+static HashEntry *hash_find(const char *cmd, unsigned int h)
+{
+    HashEntry *e;
+
+    for (e = table[h]; e; e = e->next)
+    {
+        if (!strcmp(e->name, cmd))
+            return e;
+    }
+    return NULL;
+}
+
+// searches the PATH directories for cmd and adds it to the table
+static HashEntry *hash_insert(const char *cmd, unsigned int h)
+{
+    char probe[PATH_MAX];
+    struct stat st;
+    HashEntry *e;
+    int i;
+
+    for (i = 0; i < ndirs; i++)
+    {
+        if (snprintf(probe, PATH_MAX, "%s/%s", dirs[i].dir, cmd) >= PATH_MAX)
+            continue;
+
+        if (stat(probe, &st) == 0 && S_ISREG(st.st_mode) && access(probe, X_OK) == 0)
+        { // a directory named like the command does not hide the program later in PATH
+            e = malloc(sizeof(*e));
+            e->name = strdup(cmd);
+            e->path = strdup(probe);
+            e->hits = 0;
+            e->next = table[h];
+            table[h] = e;
+            nentries++;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// returns the full path of cmd, or NULL if it is not in PATH
+const char *hash_lookup(const char *cmd)
+{
+    unsigned int h = hash_str(cmd);
+    HashEntry *e;
+
+    hash_validate();
+
+    e = hash_find(cmd, h);
+    if (!e)
+        e = hash_insert(cmd, h);
+    if (!e)
+        return NULL;
+
+    e->hits++;
+    return e->path;
+}
+
+// like hash_lookup, but does not count as a use of the command
+const char *hash_add(const char *cmd)
+{
+    unsigned int h = hash_str(cmd);
+    HashEntry *e;
+
+    hash_validate();
+
+    e = hash_find(cmd, h);
+    if (!e)
+        e = hash_insert(cmd, h);
+
+    return e ? e->path : NULL;
+}
+
+void hash_clear()
+{
+    HashEntry *e, *next;
+    int i;
+
+    for (i = 0; i < HASH_BUCKETS; i++)
+    {
+        for (e = table[i]; e; e = next)
+        {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        table[i] = NULL;
+    }
+    nentries = 0;
+    generation++;
+}
+
+/* Returns a number that changes whenever the table is flushed, so a caller
+ * holding on to paths it returned knows when to look them up again. */
+unsigned int hash_generation()
+{
+    hash_validate();
+    return generation;
+}
+
+// Prints the table in the same format as bash
+void hash_print(FILE *out)
+{
+    HashEntry *e;
+    int i;
+
+    hash_validate();
+
+    if (!nentries)
+    {
+        fprintf(out, "hash: hash table empty\n");
+        return;
+    }
+
+    fprintf(out, "hits\tcommand\n");
+    for (i = 0; i < HASH_BUCKETS; i++)
+    {
+        for (e = table[i]; e; e = e->next)
+        {
+            fprintf(out, "%4u\t%s\n", e->hits, e->path);
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef _hash_h_
+#define _hash_h_
+
+#include <stdio.h>
+
+/* Command path cache (the "hash" table).
+ *
+ * Maps a bare command name to the path of the regular executable file
+ * found by searching $PATH, where an empty entry is the current
+ * directory.  The table is flushed whenever $PATH changes or when the
+ * mtime of any directory in $PATH changes, and if $PATH has a relative
+ * directory, when the working directory does.  Paths it returns stay
+ * valid until then, which hash_generation() tells. */
+
+const char* hash_lookup (const char* cmd);
+const char* hash_add (const char* cmd);
+void hash_clear (void);
+unsigned int hash_generation (void);
+void hash_print (FILE* out);
+
+#endif /* _hash_h_ */
@@ -0,0 +1,520 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "jobs.h"
+
+// open addressing (linear probing) map from a pid or pgid to a job
+typedef struct
+{
+    pid_t key; // 0 marks an empty slot
+    Job *job;
+    unsigned int idx; // index of key in job->pids
+} Slot;
+
+typedef struct
+{
+    Slot *slots;
+    unsigned int cap; // power of 2
+    unsigned int count;
+} PidMap;
+
+static PidMap pid_index;  // pid of every live stage -> job
+static PidMap pgid_index; // pgid -> job
+
+static Job **table = NULL; // table[job_id - 1]
+static int table_cap = 0;
+static int next_id = 1; // lowest id never handed out
+static int njobs = 0;
+
+static int *free_ids = NULL; // min-heap of released job ids below next_id
+static int nfree = 0;
+static int free_cap = 0;
+
+typedef struct
+{
+    pid_t pid;
+    int status;
+    struct rusage ru;
+} Unclaimed;
+
+static Unclaimed *unclaimed = NULL; // children reaped before their job was created
+static int nunclaimed = 0;
+static int unclaimed_cap = 0;
+static int launching = 0; // pipelines being launched, those reaped meanwhile may be theirs
+
+#define NFINISHED 64
+
+typedef struct
+{
+    int job_id; // 0 marks an empty entry
+    pid_t pgid;
+    int exit_status;
+} Finished;
+
+static Finished finished[NFINISHED]; // ring of the last jobs deleted, for wait
+static unsigned int nfinished = 0;   // entries ever written, the next one goes at nfinished % NFINISHED
+
+//=============================================================PID MAP===============================================================
+
+static unsigned int map_hash(pid_t key, unsigned int cap)
+{
+    return ((unsigned int)key * 2654435761u) & (cap - 1);
+}
+
+static Slot *map_find(PidMap *m, pid_t key)
+{
+    unsigned int i;
+
+    if (!m->cap)
+        return NULL;
+
+    for (i = map_hash(key, m->cap); m->slots[i].key; i = (i + 1) & (m->cap - 1))
+    {
+        if (m->slots[i].key == key)
+            return &m->slots[i];
+    }
+    return NULL;
+}
+
+static void map_put(PidMap *m, pid_t key, Job *job, unsigned int idx);
+
+static void map_grow(PidMap *m)
+{
+    Slot *old = m->slots;
+    unsigned int old_cap = m->cap, i;
+
+    m->cap = old_cap ? old_cap * 2 : 64;
+    m->slots = calloc(m->cap, sizeof(*m->slots));
+    m->count = 0;
+
+    for (i = 0; i < old_cap; i++)
+    {
+        if (old[i].key)
+            map_put(m, old[i].key, old[i].job, old[i].idx);
+    }
+    free(old);
+}
+
+static void map_put(PidMap *m, pid_t key, Job *job, unsigned int idx)
+{
+    unsigned int i;
+
+    if ((m->count + 1) * 2 > m->cap)
+        map_grow(m);
+
+    for (i = map_hash(key, m->cap); m->slots[i].key && m->slots[i].key != key; i = (i + 1) & (m->cap - 1))
+        ;
+
+    if (!m->slots[i].key)
+        m->count++;
+
+    m->slots[i].key = key;
+    m->slots[i].job = job;
+    m->slots[i].idx = idx;
+}
+
+// removes key, shifting back the rest of its probe run so lookups never need tombstones
+static void map_del(PidMap *m, pid_t key)
+{
+    Slot *s = map_find(m, key);
+    unsigned int i, j, home;
+
+    if (!s)
+        return;
+
+    i = s - m->slots;
+    m->slots[i].key = 0;
+    m->count--;
+
+    for (j = (i + 1) & (m->cap - 1); m->slots[j].key; j = (j + 1) & (m->cap - 1))
+    {
+        home = map_hash(m->slots[j].key, m->cap);
+
+        // move j into the hole at i unless its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j)))
+        {
+            m->slots[i] = m->slots[j];
+            m->slots[j].key = 0;
+            i = j;
+        }
+    }
+}
+
+//============================================================JOB IDS================================================================
+
+static void push_free_id(int id)
+{
+    int i = nfree++, parent;
+
+    if (nfree > free_cap)
+    {
+        free_cap = free_cap ? free_cap * 2 : 16;
+        free_ids = realloc(free_ids, free_cap * sizeof(*free_ids));
+    }
+
+    for (; i > 0 && free_ids[(parent = (i - 1) / 2)] > id; i = parent)
+    {
+        free_ids[i] = free_ids[parent];
+    }
+    free_ids[i] = id;
+}
+
+static int pop_free_id()
+{
+    int id = free_ids[0], last = free_ids[--nfree];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < nfree)
+    {
+        if (child + 1 < nfree && free_ids[child + 1] < free_ids[child])
+            child++;
+        if (last <= free_ids[child])
+            break;
+        free_ids[i] = free_ids[child];
+        i = child;
+    }
+    if (nfree)
+        free_ids[i] = last;
+
+    return id;
+}
+
+// returns the lowest job id not in use
+static int alloc_job_id()
+{
+    if (nfree)
+        return pop_free_id();
+
+    if (next_id > table_cap)
+    {
+        table_cap = table_cap ? table_cap * 2 : 16;
+        table = realloc(table, table_cap * sizeof(*table));
+        memset(table + next_id - 1, 0, (table_cap - next_id + 1) * sizeof(*table));
+    }
+    return next_id++;
+}
+
+//============================================================JOB TABLE==============================================================
+
+static int exit_code(int status)
+{
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/* A child is only kept for create_job while a pipeline is being launched:
+ * once the outermost launch has its job, what is left on the list belongs
+ * to no job (the fork server, a copy that ran a $(...)) and is dropped,
+ * before its pid can be handed out again to a stage of a later job. */
+void launch_begin(void)
+{
+    launching++;
+}
+
+void launch_end(void)
+{
+    if (!--launching)
+        nunclaimed = 0;
+}
+
+// takes pid off the unclaimed list, returns 0 if it has not been reaped yet
+static int claim_child(pid_t pid, int *status, struct rusage *ru)
+{
+    int i;
+
+    for (i = 0; i < nunclaimed; i++)
+    {
+        if (unclaimed[i].pid == pid)
+        {
+            *status = unclaimed[i].status;
+            *ru = unclaimed[i].ru;
+            unclaimed[i] = unclaimed[--nunclaimed];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0); // close on exec by default
+#else
+    return -1;
+#endif
+}
+
+static void close_pidfd(Job *job, unsigned int i)
+{
+    if (job->pidfds[i] >= 0)
+        close(job->pidfds[i]);
+    job->pidfds[i] = -1;
+}
+
+// add a new job to the job table - return a pointer to the structure
+// the table takes ownership of pids
+Job *create_job(int npids, pid_t pgid, pid_t *pids, int is_bg, const char *name)
+{
+    Job *job = malloc(sizeof(*job));
+    int i, status;
+
+    job->name = strdup(name);
+    job->npids = npids;
+    job->nlive = 0;
+    job->pgid = pgid;
+    job->pids = pids;
+    job->exit_status = 0;
+    job->status = is_bg ? BG : FG;
+    job->job_id = alloc_job_id();
+    job->on_done = NULL;
+    job->data = NULL;
+    job->pipes = NULL;
+    job->usage = calloc(npids, sizeof(*job->usage));
+    job->pidfds = malloc(npids * sizeof(*job->pidfds));
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->end = job->start;
+
+    table[job->job_id - 1] = job;
+    njobs++;
+
+    map_put(&pgid_index, pgid, job, 0);
+    for (i = 0; i < npids; i++)
+    {
+        job->pidfds[i] = -1;
+        if (pids[i] && nunclaimed && claim_child(pids[i], &status, &job->usage[i]))
+        { // already reaped
+            if (i == npids - 1)
+                job->exit_status = exit_code(status);
+            pids[i] = 0;
+        }
+        else if (pids[i])
+        {
+            map_put(&pid_index, pids[i], job, i);
+            job->nlive++;
+        }
+    }
+
+    return job;
+}
+
+/* Gives every live stage of job a pidfd (on), or closes them again.  They
+ * are only open while wait is blocked on the job, so the shell holds no
+ * descriptor per background child; one that cannot be opened (out of
+ * descriptors) is left out, and its exit is still seen through SIGCHLD. */
+void job_watch(Job *job, int on)
+{
+    unsigned int i;
+
+    for (i = 0; i < job->npids; i++)
+    {
+        if (!on)
+            close_pidfd(job, i);
+        else if (job->pids[i] && job->pidfds[i] < 0)
+            job->pidfds[i] = open_pidfd(job->pids[i]); // not reaped yet, so still a child of ours
+    }
+}
+
+// removes a job from the table and frees it
+void delete_job(Job *job)
+{
+    unsigned int i;
+
+    for (i = 0; i < job->npids; i++)
+    {
+        if (job->pids[i])
+            map_del(&pid_index, job->pids[i]);
+        close_pidfd(job, i);
+    }
+
+    if (!job->nlive)
+    { // done: remember how it ended
+        Finished *f = &finished[nfinished++ % NFINISHED];
+        f->job_id = job->job_id;
+        f->pgid = job->pgid;
+        f->exit_status = job->exit_status;
+    }
+
+    if (find_job(job->pgid) == job)
+        map_del(&pgid_index, job->pgid);
+
+    table[job->job_id - 1] = NULL;
+    njobs--;
+
+    if (job->job_id == next_id - 1)
+    { // top id: shrink the range instead of remembering it
+        next_id--;
+    }
+    else
+    {
+        push_free_id(job->job_id);
+    }
+
+    free(job->name);
+    free(job->pids);
+    free(job->usage);
+    free(job->pidfds);
+    free(job);
+}
+
+// returns the live job with the given process group id, or NULL
+Job *find_job(pid_t pgid)
+{
+    Slot *s = map_find(&pgid_index, pgid);
+
+    return s ? s->job : NULL;
+}
+
+// returns the job a (not yet reaped) child belongs to, or NULL
+Job *find_job_by_pid(pid_t pid)
+{
+    Slot *s = map_find(&pid_index, pid);
+
+    return s ? s->job : NULL;
+}
+
+Job *find_job_by_id(int job_id)
+{
+    if (job_id < 1 || job_id >= next_id)
+        return NULL;
+
+    return table[job_id - 1];
+}
+
+// highest job id that may be in use, for walking the table in id order
+/* Empties the table of a copy of the shell: its jobs are the shell's
+ * children, not the copy's, which would never see them finish. */
+void forget_jobs(void)
+{
+    int i;
+
+    for (i = max_job_id(); i > 0; i--)
+    {
+        if (table[i - 1])
+            delete_job(table[i - 1]);
+    }
+}
+
+int max_job_id()
+{
+    return next_id - 1;
+}
+
+int job_count()
+{
+    return njobs;
+}
+
+/* Exit status of a job that is no longer in the table, looked up by job id
+ * or, with job_id 0, by pgid; the most recent match wins.  -1 if it is not
+ * one of the last NFINISHED jobs. */
+int finished_status(int job_id, pid_t pgid)
+{
+    unsigned int i;
+    Finished *f;
+
+    for (i = nfinished; i > 0 && nfinished - i < NFINISHED; i--)
+    {
+        f = &finished[(i - 1) % NFINISHED];
+        if (job_id ? f->job_id == job_id : f->pgid == pgid)
+            return f->exit_status;
+    }
+    return -1;
+}
+
+/* Sets a terminated child pid to 0 in its job structure, records the exit status
+ * of the last command in the pipeline and returns the job.  A child with no job
+ * yet is kept for create_job and NULL is returned.
+ * Once job->nlive drops to 0 every child of the job has been reaped. */
+Job *remove_child(pid_t chld_pid, int status, const struct rusage *ru)
+{
+    Slot *s = map_find(&pid_index, chld_pid);
+    Job *job;
+
+    if (!s && !launching)
+        return NULL; // no job is on its way that could claim it
+
+    if (!s)
+    {
+        if (nunclaimed == unclaimed_cap)
+        {
+            unclaimed_cap = unclaimed_cap ? unclaimed_cap * 2 : 8;
+            unclaimed = realloc(unclaimed, unclaimed_cap * sizeof(*unclaimed));
+        }
+        unclaimed[nunclaimed].pid = chld_pid;
+        unclaimed[nunclaimed].status = status;
+        unclaimed[nunclaimed].ru = *ru;
+        nunclaimed++;
+        return NULL;
+    }
+
+    job = s->job;
+    job->pids[s->idx] = 0;
+    close_pidfd(job, s->idx);
+    job->usage[s->idx] = *ru;
+    if (!--job->nlive)
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+
+    if (s->idx == job->npids - 1)
+    {
+        job->exit_status = exit_code(status);
+    }
+
+    map_del(&pid_index, chld_pid);
+    return job;
+}
+
+//=============================================================RUSAGE================================================================
+
+static void add_time(struct timeval *sum, const struct timeval *t)
+{
+    sum->tv_sec += t->tv_sec;
+    sum->tv_usec += t->tv_usec;
+    if (sum->tv_usec >= 1000000)
+    {
+        sum->tv_sec++;
+        sum->tv_usec -= 1000000;
+    }
+}
+
+// totals over n stages: times and context switches add up, maxrss is the largest stage
+void sum_usage(const struct rusage *ru, int n, struct rusage *total)
+{
+    int i;
+
+    memset(total, 0, sizeof(*total));
+    for (i = 0; i < n; i++)
+    {
+        add_time(&total->ru_utime, &ru[i].ru_utime);
+        add_time(&total->ru_stime, &ru[i].ru_stime);
+        total->ru_nvcsw += ru[i].ru_nvcsw;
+        total->ru_nivcsw += ru[i].ru_nivcsw;
+        if (ru[i].ru_maxrss > total->ru_maxrss)
+            total->ru_maxrss = ru[i].ru_maxrss;
+    }
+}
+
+// seconds from launch until the last stage was reaped (or until now, while it runs)
+double job_wall_time(Job *job)
+{
+    struct timespec end = job->end;
+
+    if (job->nlive)
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - job->start.tv_sec) + (end.tv_nsec - job->start.tv_nsec) / 1e9;
+}
+
+// one line summary: real 0.52s user 0.31s sys 0.04s maxrss 3412k csw 12/3 (no real if wall < 0)
+void print_usage(FILE *out, const struct rusage *ru, double wall)
+{
+    if (wall >= 0)
+        fprintf(out, "real %.3fs ", wall);
+
+    fprintf(out, "user %ld.%03lds sys %ld.%03lds maxrss %ldk csw %ld/%ld",
+            (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000,
+            (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000,
+            ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+}
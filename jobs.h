@@ -0,0 +1,74 @@
+#ifndef _jobs_h_
+#define _jobs_h_
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <time.h>
+
+typedef enum
+{
+    STOPPED,
+    TERM,
+    BG,
+    FG,
+} JobStatus;
+
+typedef struct Job
+{
+    char* name;            /* command line that started the job */
+    int job_id;
+    pid_t* pids;           /* pid of each stage, 0 once reaped */
+    int* pidfds;           /* pidfd of each stage while wait watches the job, else -1 */
+    unsigned int npids;
+    unsigned int nlive;    /* # of pids not reaped yet */
+    pid_t pgid;
+    JobStatus status;
+    int exit_status;       /* exit status of the last command in the pipeline */
+    struct rusage* usage;  /* resource usage of each stage, filled in as it is reaped */
+    struct timespec start; /* when the job was launched (CLOCK_MONOTONIC) */
+    struct timespec end;   /* when its last stage was reaped */
+    void (*on_done) (struct Job* job, void* data);  /* called instead of the usual
+                                                       report once every stage is reaped */
+    void* data;
+    struct PipeStat* pipes; /* pipestat: relays between the stages, or NULL */
+} Job;
+
+/* The job table.
+ *
+ * Jobs are indexed by job id, by process group id and by the pid of
+ * every stage, so every lookup (and reaping a child) is O(1).  Job ids
+ * are reused lowest first, like the ids bash hands out.
+ *
+ * A child reaped before its job exists (a builtin stage ran the event
+ * loop while the pipeline was still being launched) is remembered and
+ * counted as already finished by create_job.  That only happens between
+ * launch_begin and launch_end; children reaped outside a launch, or left
+ * unclaimed at its end, never get a job and are forgotten.
+ *
+ * While wait is blocked on a job, each of its live stages has a pidfd
+ * (job_watch), which becomes readable when the stage exits and, unlike
+ * its pid, can never name another process.  The exit status of the last
+ * few jobs deleted is remembered for wait. */
+
+Job* create_job (int npids, pid_t pgid, pid_t* pids, int is_bg, const char* name);
+void delete_job (Job* job);
+void forget_jobs (void);
+void job_watch (Job* job, int on);
+void launch_begin (void);
+void launch_end (void);
+
+Job* find_job (pid_t pgid);
+Job* find_job_by_pid (pid_t pid);
+Job* find_job_by_id (int job_id);
+int max_job_id (void);
+int job_count (void);
+int finished_status (int job_id, pid_t pgid);
+
+Job* remove_child (pid_t chld_pid, int status, const struct rusage* ru);
+
+void sum_usage (const struct rusage* ru, int n, struct rusage* total);
+double job_wall_time (Job* job);
+void print_usage (FILE* out, const struct rusage* ru, double wall);
+
+#endif /* _jobs_h_ */
@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "parallel.h"
+#include "jobs.h"
+#include "spawn.h"
+#include "pssh.h"
+
+#define CHUNK 65536
+
+typedef struct
+{
+    char *arg;   // the input item
+    int status;  // exit status, -1 until it has exited
+    int fd;      // -k: read end of its output pipe, -1 once drained
+    char *buf;   // -k: output held back until every earlier item is written
+    size_t len;
+    size_t cap;
+} Item;
+
+// state of the running parallel (it blocks the shell, so there is only ever one)
+static struct
+{
+    Item *items;
+    int nitems;
+    int cap;
+    int started; // items[0..started) have been launched
+    int running;
+    int emitted; // -k: items[0..emitted) have been written out
+    int failed;
+    int flags;
+    FILE *out;
+} run;
+
+static void add_item(const char *arg, size_t len)
+{
+    Item *it;
+
+    if (run.nitems == run.cap)
+    {
+        run.cap = run.cap ? run.cap * 2 : 64;
+        run.items = realloc(run.items, run.cap * sizeof(*run.items));
+    }
+
+    it = &run.items[run.nitems++];
+    it->arg = strndup(arg, len);
+    it->status = -1;
+    it->fd = -1;
+    it->buf = NULL;
+    it->len = it->cap = 0;
+}
+
+static void report(Item *it)
+{
+    if (it->status || (run.flags & PARALLEL_VERBOSE))
+    {
+        fprintf(run.out, "parallel: %s: exit %d\n", it->arg, it->status);
+        fflush(run.out);
+    }
+}
+
+// job completion hook, called by the event loop once the item is reaped
+static void item_done(Job *job, void *data)
+{
+    Item *it = &run.items[(intptr_t)data];
+
+    it->status = job->exit_status;
+    run.running--;
+    if (it->status)
+        run.failed++;
+
+    if (!(run.flags & PARALLEL_KEEP_ORDER))
+        report(it);
+}
+
+// cmd with every "{}" replaced by arg, or arg appended if there is none
+static char **expand_cmd(char **cmd, int ncmd, const char *arg)
+{
+    char **argv = malloc((ncmd + 2) * sizeof(*argv));
+    size_t arglen = strlen(arg);
+    int i, substituted = 0;
+    char *p, *q, *w;
+
+    for (i = 0; i < ncmd; i++)
+    {
+        int n = 0;
+
+        for (p = cmd[i]; (p = strstr(p, "{}")); p += 2)
+        {
+            n++;
+        }
+        argv[i] = w = malloc(strlen(cmd[i]) + n * arglen + 1);
+        for (p = cmd[i]; (q = strstr(p, "{}")); p = q + 2)
+        {
+            memcpy(w, p, q - p);
+            w += q - p;
+            memcpy(w, arg, arglen);
+            w += arglen;
+        }
+        strcpy(w, p);
+        substituted += n;
+    }
+
+    if (!substituted)
+        argv[i++] = strdup(arg);
+    argv[i] = NULL;
+    return argv;
+}
+
+// -k: whether a pipe is still open, which gives its descriptors back once drained
+static int pipes_held(void)
+{
+    int i;
+
+    for (i = run.emitted; i < run.started; i++)
+    {
+        if (run.items[i].fd >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+// the item could not be started, it counts as a command that failed to run
+static void fail_item(Item *it)
+{
+    it->status = 127;
+    run.failed++;
+    if (!(run.flags & PARALLEL_KEEP_ORDER))
+        report(it);
+}
+
+/* Starts item idx.  Returns -1, without starting it, if -k cannot get a
+ * pipe for it while other items hold some: it is tried again once one of
+ * them is done.  With none held it never will be, and it fails instead. */
+static int start_item(int idx, const char *path, char **cmd, int ncmd, int null_fd)
+{
+    Item *it = &run.items[idx];
+    char **argv = expand_cmd(cmd, ncmd, it->arg);
+    int out_fd = fileno(run.out), fd_pip[2];
+    char *name;
+    size_t name_len;
+    FILE *nf;
+    pid_t pid = -1;
+    int i, ret = 0;
+
+    if ((run.flags & PARALLEL_KEEP_ORDER) && pipe2(fd_pip, O_CLOEXEC) == -1)
+    { // out of descriptors: the item waits or fails, the shell goes on
+        if (run.running || pipes_held())
+        {
+            ret = -1;
+        }
+        else
+        {
+            shell_error(run.out, "pssh: %s: cannot create a pipe: %s\n", it->arg, strerror(errno));
+            fail_item(it);
+        }
+    }
+    else
+    {
+        if (run.flags & PARALLEL_KEEP_ORDER)
+        {
+            it->fd = fd_pip[0];
+            out_fd = fd_pip[1];
+        }
+
+        pid = spawn_cmd(path, argv, null_fd, out_fd, 0);
+
+        if (run.flags & PARALLEL_KEEP_ORDER)
+            close(fd_pip[1]);
+
+        if (pid < 0)
+        {
+            shell_error(run.out, "pssh: failed to exec %s: %s\n", cmd[0], strerror(errno));
+            if (it->fd >= 0)
+            {
+                close(it->fd);
+                it->fd = -1;
+            }
+            fail_item(it);
+        }
+    }
+
+    if (pid > 0)
+    { // each item is a job of its own, so it shows up in jobs and can be killed
+        pid_t *pids = malloc(sizeof(*pids));
+        Job *job;
+
+        nf = open_memstream(&name, &name_len);
+        for (i = 0; argv[i]; i++)
+        {
+            fprintf(nf, i ? " %s" : "%s", argv[i]);
+        }
+        fclose(nf);
+
+        pids[0] = pid;
+        job = create_job(1, pid, pids, 1, name);
+        job->on_done = item_done;
+        job->data = (void *)(intptr_t)idx;
+        run.running++;
+        free(name);
+    }
+
+    for (i = 0; argv[i]; i++)
+    {
+        free(argv[i]);
+    }
+    free(argv);
+    return ret;
+}
+
+// -k: reads what is available from an item; the oldest unwritten item streams straight out
+static void drain_item(int idx)
+{
+    Item *it = &run.items[idx];
+    char chunk[CHUNK];
+    ssize_t n = read(it->fd, chunk, sizeof(chunk));
+
+    if (n < 0 && errno == EINTR)
+        return;
+
+    if (n <= 0)
+    {
+        close(it->fd);
+        it->fd = -1;
+        return;
+    }
+
+    if (idx == run.emitted)
+    {
+        fwrite(chunk, 1, n, run.out);
+        fflush(run.out);
+        return;
+    }
+
+    if (it->len + n > it->cap)
+    {
+        it->cap = (it->len + n) * 2;
+        it->buf = realloc(it->buf, it->cap);
+    }
+    memcpy(it->buf + it->len, chunk, n);
+    it->len += n;
+}
+
+// -k: writes out every finished item that has no unwritten item before it
+static void emit_items()
+{
+    Item *it;
+
+    while (run.emitted < run.started)
+    {
+        it = &run.items[run.emitted];
+
+        if (it->len)
+        { // held back while an earlier item was still running
+            fwrite(it->buf, 1, it->len, run.out);
+            free(it->buf);
+            it->buf = NULL;
+            it->len = it->cap = 0;
+        }
+        fflush(run.out);
+
+        if (it->status < 0 || it->fd >= 0)
+            break; // still running, its output is streamed from now on
+
+        report(it);
+        run.emitted++;
+    }
+}
+
+// reads what is available on fd_in, every complete line becomes an item; returns 0 at EOF
+static int read_items(int fd, char **pending, size_t *len)
+{
+    char chunk[CHUNK];
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    char *line, *nl;
+
+    if (n < 0 && errno == EINTR)
+        return 1;
+
+    if (n <= 0)
+    {
+        if (*len)
+            add_item(*pending, *len); // last line without a newline
+        *len = 0;
+        return 0;
+    }
+
+    *pending = realloc(*pending, *len + n);
+    memcpy(*pending + *len, chunk, n);
+    *len += n;
+
+    for (line = *pending; (nl = memchr(line, '\n', *pending + *len - line)); line = nl + 1)
+    {
+        if (nl > line)
+            add_item(line, nl - line);
+    }
+
+    *len -= line - *pending;
+    memmove(*pending, line, *len);
+    return 1;
+}
+
+int parallel_run(char **cmd, int ncmd, char **items, int nitems, int slots, int flags, int fd_in, FILE *out)
+{
+    const char *path = command_found(cmd[0]);
+    struct pollfd *pfd = NULL;
+    int *pfd_item = NULL; // item index behind each pfd, -1 for fd_in
+    int npfd, pfd_cap = 0, null_fd, reading, i;
+    char *pending = NULL;
+    size_t pending_len = 0;
+
+    if (!path)
+    {
+        shell_error(out, "pssh: command not found: %s\n", cmd[0]);
+        return 127;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.flags = flags;
+    run.out = out;
+    if (fileno(out) < 0)
+        run.flags |= PARALLEL_KEEP_ORDER; // output is collected by the shell, items need pipes
+
+    reading = !items;
+    for (i = 0; i < nitems; i++)
+    {
+        add_item(items[i], strlen(items[i]));
+    }
+
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // items never compete for our input
+    fflush(out);
+
+    while (1)
+    {
+        while ((slots < 0 || run.running < slots) && run.started < run.nitems)
+        {
+            if (start_item(run.started, path, cmd, ncmd, null_fd) < 0)
+                break; // until a running item gives back its descriptors
+            run.started++;
+        }
+
+        if (run.flags & PARALLEL_KEEP_ORDER)
+            emit_items();
+
+        if (!reading && !run.running && run.started == run.nitems &&
+            (!(run.flags & PARALLEL_KEEP_ORDER) || run.emitted == run.nitems))
+            break;
+
+        if (pfd_cap < run.started - run.emitted + 1)
+        {
+            pfd_cap = (run.started - run.emitted + 1) * 2;
+            pfd = realloc(pfd, pfd_cap * sizeof(*pfd));
+            pfd_item = realloc(pfd_item, pfd_cap * sizeof(*pfd_item));
+        }
+
+        npfd = 0;
+        if (reading && run.started == run.nitems)
+        { // only read ahead when every item so far has been started
+            pfd[npfd].fd = fd_in;
+            pfd[npfd].events = POLLIN;
+            pfd_item[npfd++] = -1;
+        }
+        for (i = run.emitted; i < run.started; i++)
+        {
+            if (run.items[i].fd >= 0)
+            {
+                pfd[npfd].fd = run.items[i].fd;
+                pfd[npfd].events = POLLIN;
+                pfd_item[npfd++] = i;
+            }
+        }
+
+        poll_events(pfd, npfd, -1);
+
+        for (i = 0; i < npfd; i++)
+        {
+            if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            if (pfd_item[i] < 0)
+                reading = read_items(fd_in, &pending, &pending_len);
+            else
+                drain_item(pfd_item[i]);
+        }
+    }
+
+    close(null_fd);
+    for (i = 0; i < run.nitems; i++)
+    {
+        free(run.items[i].arg);
+        free(run.items[i].buf);
+    }
+    free(run.items);
+    free(pending);
+    free(pfd);
+    free(pfd_item);
+
+    return run.failed > 101 ? 101 : run.failed;
+}
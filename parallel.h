@@ -0,0 +1,19 @@
+#ifndef _parallel_h_
+#define _parallel_h_
+
+#include <stdio.h>
+
+#define PARALLEL_KEEP_ORDER 0x1  /* write each item's output in input order */
+#define PARALLEL_VERBOSE    0x2  /* report the exit status of every item, not just failures */
+
+/* Runs the command cmd[0..ncmd) once per item with every "{}" in it
+ * replaced by the item (or the item appended if there is no "{}"),
+ * keeping up to slots (-1 = no limit) of them running at once.  Items
+ * come from items[0..nitems) or, when items is NULL, one per line from
+ * fd_in as they arrive.  Every item is a background job of its own and
+ * is reaped by the shell's event loop.  Returns the number of items
+ * that failed (at most 101, like GNU parallel). */
+
+int parallel_run (char** cmd, int ncmd, char** items, int nitems, int slots, int flags, int fd_in, FILE* out);
+
+#endif /* _parallel_h_ */
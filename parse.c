@@ -6,9 +6,28 @@
  *
  * Parses the following syntax:
  *
- *  ~$ command_1 [< infile] [| command_n]* [> outfile] [&]
+ *  ~$ pipeline [; | & | && | || pipeline]* [; | &]
  *
- * and produces a correspondingly populated Parse structure on the heap
+ * where a pipeline is
+ *
+ *     command_1 [< infile] [|[placement] command_n]* [> outfile]
+ *
+ * and produces a list of correspondingly populated Parse structures, one
+ * per pipeline, each saying how the one after it is run (see Sequence).
+ *
+ * All of a line's Parses (the structures themselves, their tasks, argv
+ * arrays and the strings they point to) live in one per-line arena: the command line
+ * is copied into the arena once and the argv strings point into that
+ * copy, so parse_destroy() is a single free.  The caller's cmdline is
+ * never modified.
+ *
+ * The line is read exactly once by a table driven lexer, so parsing is
+ * linear in the length of the line.  Quotes may appear anywhere in a
+ * word and are removed in place; operators inside quotes are literal.
+ * A word with an unquoted * ? [ or {, or a $ outside single quotes,
+ * also gets a pattern form, where whatever was quoted is escaped, for
+ * expand_task() to expand.  A command substitution $(...) is read as
+ * part of its word, spaces, operators and all.
  *
  * Note:
  *  - Items in brackets [ ] are optional
@@ -21,441 +40,542 @@
  *     ~$ wc -l < somefile.txt > numlines.txt
  *     ~$ ls -lh | grep 8.*K | wc -l
  *     ~$ gvim &
+ *     ~$ make && ./test || echo failed; make clean
+ *     ~$ gzip -dc big.gz |[cpu=1,nice=5] sort
+ *
+ * A placement, written right after a '|' with no space, sets the CPU
+ * and nice value of the stage that follows it (see lex_placement).
  **********************************************************************/
-#include <ctype.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
 
 #include "parse.h"
+#include "arena.h"
 
 
-typedef struct {
-    char* cmd;
-    char** argv;
-    char* input_fn;
-    char* output_fn;
-} Unit;
-
-static char ops[] = {'>', '<', '|', '\0'};
-
-
-static void trim (char* s)
-{
-    size_t start, end;
-
-    if (!s)
-        return;
-
-    end = strlen (s);
-
-    for (start=0; isspace (s[start]); ++start);
-
-    if (s[start]) {
-        while (end > 0 && isspace(s[end-1]))
-            --end;
-
-        memmove(s, &s[start], end-start);
-    }
-    s[end-start] = '\0';
-}
-
-
-static int is_background (char* cmdline)
-{
-    size_t last;
-    int ret = 0;
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,     /* |  */
+    TOK_IN,       /* <  */
+    TOK_OUT,      /* >  */
+    TOK_AMP,      /* &  */
+    TOK_SEMI,     /* ;  */
+    TOK_AND,      /* && */
+    TOK_OR,       /* || */
+    TOK_END,
+    TOK_ERROR     /* unterminated quote */
+} Token;
 
-    trim (cmdline);
-    last = strlen (cmdline) - 1;
+enum { CH_WORD = 0, CH_SPACE, CH_OP, CH_QUOTE, CH_EXPAND, CH_END };
 
-    if ('&' == cmdline[last]) {
-        cmdline[last] = '\0';
-        ret = 1;
-    }
+static const unsigned char ch_class[256] = {
+    ['\0'] = CH_END,
+    [' ']  = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE,
+    ['\v'] = CH_SPACE, ['\f'] = CH_SPACE, ['\r'] = CH_SPACE,
+    ['|']  = CH_OP, ['<'] = CH_OP, ['>'] = CH_OP, ['&'] = CH_OP, [';'] = CH_OP,
+    ['\''] = CH_QUOTE, ['\"'] = CH_QUOTE,
+    ['*']  = CH_EXPAND, ['?'] = CH_EXPAND, ['['] = CH_EXPAND, ['{'] = CH_EXPAND,
+    ['$']  = CH_EXPAND,
+};
 
-    return ret;
-}
+#define CLASS(c) (ch_class[(unsigned char)(c)])
 
+/* Inside double quotes a backslash only escapes these, elsewhere it is
+ * taken as it is; outside quotes it escapes any character. */
+#define DQ_ESCAPES  "$\"\\`"
 
-static int is_empty (char* cmdline)
-{
-    trim (cmdline);
-
-    if (!cmdline || !strlen(cmdline))
-        return 1;
 
-    return 0;
-}
+typedef struct {
+    char* p;         /* next unread character */
+    char* tok;       /* where the last token started */
+    char* held;      /* where the last word's '\0' overwrote its delimiter */
+    char  held_ch;   /* ...and the delimiter that was there */
+    int   expand;    /* the last word has a glob, brace or $ to expand */
+    Arena* arena;    /* for the words that are not kept in the line */
+} Lexer;
 
 
-static int is_op (char c)
+static char lex_peek (Lexer* L)
 {
-    int i;
-
-    for (i=0; ops[i]; i++)
-        if (c == ops[i])
-            return 1;
-
-    return 0;
+    return L->p == L->held ? L->held_ch : *L->p;
 }
 
 
-static int has_trailing (char needle, char* haystack)
+/* Returns the next token.  Words are unquoted in place and NUL terminated,
+ * *word points at them.  Since unquoting only ever shrinks a word, the
+ * terminator can only clobber the delimiter right after the word; that
+ * character is remembered and handed out by lex_peek() instead. */
+static Token lex (Lexer* L, char** word)
 {
-    trim (haystack);
-
-    if (haystack[0] == needle ||
-        haystack[strlen(haystack)-1] == needle) {
-        return 1;
+    char *p, *out, *e, c, q;
+
+    while (CLASS(c = lex_peek (L)) == CH_SPACE)
+        L->p++;
+    L->tok = L->p;
+
+    switch (c) {
+    case '\0': return TOK_END;
+    case '|':  L->p++; return lex_peek (L) == '|' ? (L->p++, TOK_OR) : TOK_PIPE;
+    case '<':
+    case '>':
+        if (L->p[1] != '(') {
+            L->p++;
+            return c == '<' ? TOK_IN : TOK_OUT;
+        }
+        /* <(...) or >(...) is a word of its own, expanded to a /dev/fd path.  It is
+         * copied out of the line: a word right before it may have clobbered the '<' */
+        if (!(e = (char*) parse_subst_end (L->p)))
+            return TOK_ERROR;
+        *word = arena_strndup (L->arena, L->p, e - L->p);
+        **word = c;
+        L->expand = 1;
+        L->p = e;
+        return TOK_WORD;
+    case '&':  L->p++; return lex_peek (L) == '&' ? (L->p++, TOK_AND) : TOK_AMP;
+    case ';':  L->p++; return TOK_SEMI;
     }
 
-    return 0;
-}
-
-
-static unsigned int count_char (char needle, char* haystack)
-{
-    unsigned int c = 0;
-
-    while (*haystack)
-        if (*haystack++ == needle)
-            c++;
-
-    return c;
-}
+    p = out = *word = L->p;
+    L->expand = 0;
 
+    for (;;) {
+        if (*p == '\\' && p[1]) {     /* \c is c, whatever c is */
+            p++;
+            *out++ = *p++;
+            continue;
+        }
 
-static unsigned int count_args (char* unit)
-{
-    unsigned int n = 0;
-
-    for (; *unit; unit++) {
-        if (isspace((unsigned char)(*unit))) {
-            while (isspace((unsigned char)(*++unit)));
-            if (*unit == '\"') {
-                do {
-                    unit++;
-                } while (*unit != '\"');
-                n++;
-            } else if (*unit == '\'') {
-                do {
-                    unit++;
-                } while (*unit != '\'');
-                n++;
-            } else if (!isspace((unsigned char)(*unit))) {
-                n++;
+        switch (CLASS(*p)) {
+        case CH_EXPAND:
+            L->expand = 1;
+            if (*p == '$' && p[1] == '(') {     /* $(...) is part of the word, whatever is in it */
+                if (p[2] == '(' || !(e = (char*) parse_subst_end (p)))
+                    return TOK_ERROR;           /* $((...)) would be arithmetic, which there is none of */
+                while (p < e)
+                    *out++ = *p++;
+                continue;
+            }
+            /* fall through */
+
+        case CH_WORD:
+            *out++ = *p++;
+            continue;
+
+        case CH_QUOTE:
+            for (q = *p++; *p != q; *out++ = *p++) {
+                if (!*p)
+                    return TOK_ERROR;
+                if (q == '"' && *p == '\\' && p[1] && strchr (DQ_ESCAPES, p[1])) {
+                    p++;                        /* the character after it is copied as it is */
+                    continue;
+                }
+                if (*p != '$' || q != '"')
+                    continue;
+                L->expand = 1;
+                if (p[1] == '(') {
+                    if (p[2] == '(' || !(e = (char*) parse_subst_end (p)))
+                        return TOK_ERROR;
+                    while (p < e - 1)
+                        *out++ = *p++;
+                }
             }
+            p++;
+            continue;
         }
+        break;   /* space, operator or end of line */
     }
 
-    return n;
+    if (out == p) {
+        L->held = p;
+        L->held_ch = *p;
+    }
+    *out = '\0';
+    L->p = p;
+
+    return TOK_WORD;
 }
 
 
-static int valid_syntax (Parse* P, Unit* U, int i)
+/* Called right after a '|': reads a placement "[cpu=N,nice=N]" into
+ * cpu and nice.  Returns 1 if there was one, 0 if the next character
+ * starts something else (a '[' command stays a word), -1 if malformed. */
+static int lex_placement (Lexer* L, int* cpu, int* nice)
 {
-    if (!U)
-        return 0;
-
-    if (U->input_fn && ((i != 0) || is_empty(U->input_fn)))
-        return 0;
-
-    if (U->output_fn && ((i != P->ntasks-1) || is_empty(U->output_fn)))
-        return 0;
+    char *p = L->p, *end;
+    long v;
 
-    if (!U->cmd || !*U->cmd)
+    if (lex_peek (L) != '[' || (strncmp (p + 1, "cpu=", 4) && strncmp (p + 1, "nice=", 5)))
         return 0;
 
-
-    return 1;
-}
-
-
-static char* parse_unary (char op, char* unit)
-{
-    char *start, *end, *arg;
-
-    for (start=NULL; *unit; unit++)
-        if (*unit == op) {
-           start = ++unit;
-           break;
+    for (p++;;) {
+        if (!strncmp (p, "cpu=", 4)) {
+            v = strtol (p += 4, &end, 10);
+            if (end == p || v < 0 || v >= CPU_SETSIZE)
+                return -1;
+            *cpu = v;
+        } else if (!strncmp (p, "nice=", 5)) {
+            v = strtol (p += 5, &end, 10);
+            if (end == p || v < -20 || v > 19)
+                return -1;
+            *nice = v;
+        } else {
+            return -1;
         }
 
-    if (!start)
-        return NULL;
-
-    for (end=start; *end; end++)
-        if (is_op(*end))
-           break;
-
-    arg = strndup (start, end - start);
-    arg[end - start] = '\0';
-    trim (arg);
-
-    start--;
-    memset (start, ' ', end - start);
-
-    return arg;
-}
-
-
-static char* argtok (char* str, char** state)
-{
-    char* ret;
-    char seek_ch;
-
-    if (!str)
-        str = *state;
-
-    if (!*str)
-        return NULL;
-
-    trim(str);
-
-    seek_ch = *str == '\"' ? '\"' :
-              *str == '\'' ? '\'' :
-              ' ';
-
-    ret = seek_ch == ' ' ? str : ++str;
-
-    str = strchr (str, seek_ch);
-
-    if (str)
-        *str = '\0';
-
-    *state = str ? ++str : (ret + strlen(ret));
-
-    return ret;
-}
-
-
-static void parse_command (Unit* U, char* unit)
-{
-    unsigned int argc, n;
-    char *str, *token, *state;
-
-    trim (unit);
-    argc = count_args (unit)+1; /* +1 for command */
-
-    U->argv = malloc ((argc+1) * sizeof(*U->argv));
-    U->argv[argc] = NULL;
-
-    for (n=0, str=unit; ; n++, str=NULL) {
-        token = argtok (str, &state);
-        if (!token)
+        p = end;
+        if (*p == ']')
             break;
-
-        U->argv[n] = strdup (token);
+        if (*p++ != ',')
+            return -1;
     }
 
-    U->cmd = U->argv[0];
-}
-
-
-static Unit* parse_unit (char* unit)
-{
-    Unit* U;
-
-    int infiles = count_char ('<', unit);
-    int outfiles = count_char ('>', unit);
-
-    if (infiles > 1 || outfiles > 1)
-        return NULL;
-
-    if (count_char ('\'', unit) % 2)
-        return NULL;
-
-    if (count_char ('\"', unit) % 2)
-        return NULL;
-
-    U = malloc (sizeof(*U));
-    U->cmd = NULL;
-    U->argv = NULL;
-
-    if (infiles)
-        U->input_fn = parse_unary ('<', unit);
-    else
-        U->input_fn = NULL;
-
-    if (outfiles)
-        U->output_fn = parse_unary ('>', unit);
-    else
-        U->output_fn = NULL;
-
-    parse_command (U, unit);
-
-    return U;
+    L->p = p + 1;
+    return 1;
 }
 
 
-static void unit_destroy (Unit** U)
+/* Returns where the command substitution $(...) at p ends (past its ')'),
+ * or NULL if it is not closed.  Quotes and parentheses nest inside it.
+ * Works as well for a process substitution <(...) or >(...). */
+const char* parse_subst_end (const char* p)
 {
-    int i;
-
-    if (!*U)
-        return;
-
-    if ((*U)->input_fn)
-        free ((*U)->input_fn);
-
-    if ((*U)->output_fn)
-        free ((*U)->output_fn);
-
-    if ((*U)->argv) {
-        for (i=0; (*U)->argv[i]; i++)
-            free ((*U)->argv[i]);
-        free ((*U)->argv);
+    int depth = 0;
+    char q;
+
+    for (p++; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '\'' || *p == '"') {
+            for (q = *p++; *p && *p != q; p++)
+                if (q == '"' && *p == '\\' && p[1])
+                    p++;
+            if (!*p)
+                return NULL;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
     }
-
-    free (*U);
-    *U = NULL;
+    return NULL;
 }
 
 
-static void parse_add_unit (Parse* P, Unit* U, int i)
+/* Returns the word typed as raw..end as a pattern: unquoted, with the
+ * pattern characters (and '"') that were quoted, a $ in single quotes and
+ * a backslash that escapes nothing (in quotes) escaped by a backslash; a
+ * character the backslash does escape keeps it.  A $ in double quotes is marked
+ * by a '"' before it, as its value is not to be split into words.  A
+ * ${name} or $(...) is copied as it is.  The first character says whether
+ * the word had quotes ('"') or not (' ').  A <(...) or >(...) that starts
+ * the word is copied as it is too, and a quoted '<' or '>' is escaped so
+ * that one typed in quotes stays a plain word. */
+static char* word_pattern (Arena* A, const char* raw, const char* end)
 {
-    if (!valid_syntax (P, U, i)) {
-        P->invalid_syntax = 1;
-        goto out;
-    }
+    char *pat = arena_alloc (A, 2 * (end - raw) + 2), *out = pat;
+    const char* sub;
+    char q = 0;
 
-    P->tasks[i].cmd = U->cmd;
+    *out++ = memchr (raw, '\'', end - raw) || memchr (raw, '"', end - raw) ? '"' : ' ';
 
-    if (U->argv) {
-        P->tasks[i].argv = U->argv;
-        U->argv = NULL;
+    if ((*raw == '<' || *raw == '>') && raw[1] == '(' && (sub = parse_subst_end (raw))) {
+        while (raw < sub)
+            *out++ = *raw++;
     }
 
-    if (U->input_fn && (i == 0)) {
-        P->infile = U->input_fn;
-        U->input_fn = NULL;
-    }
-
-    if (U->output_fn && (i == P->ntasks-1)) {
-        P->outfile = U->output_fn;
-        U->output_fn = NULL;
+    for (; raw < end; raw++) {
+        if (*raw == '\\' && raw + 1 < end && (!q || (q == '"' && strchr (DQ_ESCAPES, raw[1])))) {
+            *out++ = *raw++;
+            *out++ = *raw;
+            continue;
+        }
+        if (q ? *raw == q : CLASS(*raw) == CH_QUOTE) {
+            q = q ? 0 : *raw;
+            continue;
+        }
+        if (*raw == '$' && q != '\'') {
+            if (q)
+                *out++ = '"';
+            sub = raw[1] == '(' ? parse_subst_end (raw) : raw[1] == '{' ? memchr (raw, '}', end - raw) : NULL;
+            if (sub && raw[1] == '{')
+                sub++;
+            while (sub && raw < sub - 1)
+                *out++ = *raw++;
+        } else if (*raw == '\\' || (q && strchr ("*?[]{},\"<>", *raw)) || (q == '\'' && *raw == '$')) {
+            *out++ = '\\';
+        }
+        *out++ = *raw;
     }
+    *out = '\0';
 
-out:
-    unit_destroy (&U);
+    return pat;
 }
 
 
-static Parse* parse_new ()
+static Parse* parse_new (Arena* A)
 {
-    Parse* P = malloc (sizeof(*P));
+    Parse* P = arena_alloc (A, sizeof(*P));
 
+    P->arena = A;
     P->tasks = NULL;
     P->ntasks = 0;
     P->infile = NULL;
     P->outfile = NULL;
     P->background = 0;
     P->invalid_syntax = 0;
+    P->text = NULL;
+    P->then = SEQ_ALWAYS;
+    P->next = NULL;
 
     return P;
 }
 
 
-static void parse_init (Parse* P, char* cmdline)
+void parse_destroy (Parse** P)
 {
-    P->background = is_background (cmdline);
-
-    if (count_char ('&', cmdline)) {
-        P->invalid_syntax = 1;
+    if (!*P)
         return;
-    }
 
-    if (has_trailing ('|', cmdline)) {
-        P->invalid_syntax = 1;
-        return;
-    }
+    arena_free ((*P)->arena);   /* P itself (and the rest of the list) lives in the arena too */
+    *P = NULL;
+}
 
-    P->ntasks = count_char ('|', cmdline) + 1;
-    P->tasks = malloc (P->ntasks * sizeof (*P->tasks));
-    memset (P->tasks, 0, P->ntasks * sizeof (*P->tasks));
+
+/* The words and tasks of a line go into arrays that start at these sizes
+ * and double as the line turns out to need, so a long line costs what it
+ * holds rather than what a line of its length could hold at most. */
+#define SLOTS_START  16
+#define TASKS_START  4
+
+/* The line is copied twice (once to unquote in place, once for the
+ * pipelines' texts, each padded to the arena alignment); the rest is sized
+ * for a short line, a longer one takes a few more chunks. */
+static size_t arena_hint (size_t len)
+{
+    return 64 + 2 * (len + 1) + SLOTS_START * sizeof(char*)
+           + TASKS_START * (sizeof(Task) + sizeof(Parse) + 16);
 }
 
 
-void parse_destroy (Parse** P)
+/* Doubles the slot array (and the pattern array, if there is one yet),
+ * moving the argv and patterns of the ntasks tasks read so far along. */
+static void grow_slots (Arena* A, char*** slots, char*** patterns, size_t* cap, Task* tasks, size_t ntasks)
 {
-    int i, j;
+    char **s = arena_alloc (A, 2 * *cap * sizeof(*s)), **p = NULL;
+    size_t i;
 
-    if (!*P)
-        return;
+    memcpy (s, *slots, *cap * sizeof(*s));
+    if (*patterns) {
+        p = memcpy (arena_alloc (A, 2 * *cap * sizeof(*p)), *patterns, *cap * sizeof(*p));
+        memset (p + *cap, 0, *cap * sizeof(*p));
+    }
+    for (i = 0; i < ntasks; i++) {
+        tasks[i].argv = s + (tasks[i].argv - *slots);
+        if (tasks[i].patterns)
+            tasks[i].patterns = p + (tasks[i].patterns - *patterns);
+    }
 
-    if ((*P)->infile)
-        free ((*P)->infile);
+    *slots = s;
+    *patterns = p;
+    *cap *= 2;
+}
 
-    if ((*P)->outfile)
-        free ((*P)->outfile);
 
-    if ((*P)->tasks) {
-        for (i=0; i<(*P)->ntasks; i++) {
-            if ((*P)->tasks[i].argv) {
-                for (j=0; (*P)->tasks[i].argv[j]; j++)
-                    free ((*P)->tasks[i].argv[j]);
+/* Doubles the task array, moving the tasks of every pipeline from head on. */
+static void grow_tasks (Arena* A, Task** tasks, size_t* cap, Parse* head)
+{
+    Task* t = arena_alloc (A, 2 * *cap * sizeof(*t));
 
-                free ((*P)->tasks[i].argv);
-            }
-        }
-        free ((*P)->tasks);
-    }
+    memcpy (t, *tasks, *cap * sizeof(*t));
+    for (; head; head = head->next)
+        head->tasks = t + (head->tasks - *tasks);
 
-    free (*P);
-    *P = NULL;
+    *tasks = t;
+    *cap *= 2;
 }
 
 
 Parse* parse_cmdline (char* cmdline)
 {
-    char *str, *token, *state;
-    int i;
-    Unit* U;
-    Parse* P;
+    char *line, *word, *start = NULL, *end = NULL;
+    char **slots, **patterns = NULL;
+    Task* tasks;
+    size_t len, nslots = 0, stage = 0, ntasks = 0;
+    size_t slot_cap = SLOTS_START, task_cap = TASKS_START;
+    Token tok, redirect = TOK_END;
+    int cpu = -1, nice = NICE_UNSET;   /* placement of the stage being read */
+    int expands = 0;                   /* ...and whether any of its words has a pattern */
+    Arena* A;
+    Parse *head, *P, *prev = NULL;
+    Lexer L;
+
+    len = strlen (cmdline);
+    A = arena_new (arena_hint (len));
+    line = arena_strndup (A, cmdline, len);
+
+    head = P = parse_new (A);
+    tasks = arena_alloc (A, task_cap * sizeof(*tasks));
+    slots = arena_alloc (A, slot_cap * sizeof(*slots));
+    P->tasks = tasks;
+
+    L.p = line;
+    L.held = NULL;
+    L.held_ch = '\0';
+    L.arena = A;
+
+    for (;;) {
+        tok = lex (&L, &word);
+
+        if (redirect != TOK_END && tok != TOK_WORD)
+            goto invalid;   /* < or > without a filename */
+
+        if (tok != TOK_END && tok != TOK_SEMI && tok != TOK_AND && tok != TOK_OR) {
+            if (!start)         /* the pipeline's text runs from here... */
+                start = L.tok;
+            end = L.p;          /* ...to its last token */
+        }
 
-    if (is_empty (cmdline))
-        return NULL;
+        switch (tok) {
+        case TOK_WORD:
+            if (redirect == TOK_IN) {
+                if (P->infile || P->ntasks)     /* only the first command reads a file */
+                    goto invalid;
+                P->infile = word;
+            } else if (redirect == TOK_OUT) {
+                if (P->outfile)
+                    goto invalid;
+                P->outfile = word;
+            } else {
+                if (nslots == slot_cap)
+                    grow_slots (A, &slots, &patterns, &slot_cap, tasks, ntasks);
+                if (L.expand) {
+                    if (!patterns)  /* only once a word has one */
+                        patterns = memset (arena_alloc (A, slot_cap * sizeof(*patterns)),
+                                           0, slot_cap * sizeof(*patterns));
+                    patterns[nslots] = word_pattern (A, cmdline + (L.tok - line), cmdline + (L.p - line));
+                    expands = 1;
+                }
+                slots[nslots++] = word;
+            }
+            redirect = TOK_END;
+            continue;
+
+        case TOK_IN:
+        case TOK_OUT:
+            redirect = tok;
+            continue;
+
+        case TOK_AMP:
+            P->background = 1;
+            /* fall through */
+
+        case TOK_PIPE:
+        case TOK_SEMI:
+        case TOK_AND:
+        case TOK_OR:
+        case TOK_END:
+            if (nslots == stage) {
+                if (tok == TOK_END && !P->ntasks && !P->infile && !P->outfile) {
+                    if (P == head) {
+                        parse_destroy (&head);      /* blank line */
+                        return NULL;
+                    }
+                    if (prev->then == SEQ_ALWAYS) { /* a trailing ; or & */
+                        prev->next = NULL;
+                        return head;
+                    }
+                }
+                goto invalid;               /* empty command */
+            }
 
-    P = parse_new ();
-    parse_init (P, cmdline);
+            if (tok == TOK_PIPE && P->outfile)  /* only the last command writes a file */
+                goto invalid;
+
+            if (nslots == slot_cap)
+                grow_slots (A, &slots, &patterns, &slot_cap, tasks, ntasks);
+            if (ntasks == task_cap)
+                grow_tasks (A, &tasks, &task_cap, head);
+            P->tasks[P->ntasks].cmd = slots[stage];
+            P->tasks[P->ntasks].argv = &slots[stage];
+            P->tasks[P->ntasks].cpu = cpu;
+            P->tasks[P->ntasks].nice = nice;
+            P->tasks[P->ntasks].patterns = expands ? &patterns[stage] : NULL;
+            P->tasks[P->ntasks].path = NULL;
+            P->tasks[P->ntasks].assigns = NULL;
+            P->ntasks++;
+            ntasks++;
+            slots[nslots++] = NULL;
+            stage = nslots;
+
+            cpu = -1;
+            nice = NICE_UNSET;
+            expands = 0;
+            if (tok == TOK_PIPE) {
+                if (lex_placement (&L, &cpu, &nice) < 0)
+                    goto invalid;
+                continue;
+            }
 
-    for (i=0, str=cmdline; !P->invalid_syntax; i++, str=NULL) {
-        token = strtok_r (str, "|", &state);
-        if (!token)
-            break;
+            /* the pipeline is complete, the line copy is unquoted so take its text from cmdline */
+            P->text = arena_strndup (A, cmdline + (start - line), end - start);
+            start = NULL;
+            if (tok == TOK_END)
+                return head;
 
-        U = parse_unit (token);
+            P->then = tok == TOK_AND ? SEQ_AND : tok == TOK_OR ? SEQ_OR : SEQ_ALWAYS;
+            prev = P;
+            P = P->next = parse_new (A);
+            P->tasks = &tasks[ntasks];
+            continue;
 
-        parse_add_unit (P, U, i);
+        case TOK_ERROR:
+            goto invalid;
+        }
     }
 
-    return P;
+invalid:
+    head->invalid_syntax = 1;
+    return head;
 }
 
 
 void parse_debug (Parse* P)
 {
+    static const char* then[] = { ";", "&&", "||" };
     int i, j;
 
     fprintf (stderr, "==[ DEBUG: PARSE ]==================================\n");
-    fprintf (stderr, "Run in Background? %s\n", P->background ? "Yes" : "No");
 
-    if (P->infile)
-        fprintf (stderr, "infile: %s\n", P->infile);
+    for (; P; P = P->next) {
+        fprintf (stderr, "Pipeline: [%s]\n", P->text ? P->text : "");
+        fprintf (stderr, "Run in Background? %s\n", P->background ? "Yes" : "No");
 
-    if (P->outfile)
-        fprintf (stderr, "outfile: %s\n", P->outfile);
+        if (P->infile)
+            fprintf (stderr, "infile: %s\n", P->infile);
 
-    fprintf (stderr, "ntasks: %i\n", P->ntasks);
+        if (P->outfile)
+            fprintf (stderr, "outfile: %s\n", P->outfile);
 
-    for (i=0; i<P->ntasks; i++) {
-        fprintf (stderr, "Task %i\n", i);
-        fprintf (stderr, "  - cmd: [%s]\n", P->tasks[i].cmd);
+        fprintf (stderr, "ntasks: %i\n", P->ntasks);
+
+        for (i=0; i<P->ntasks; i++) {
+            fprintf (stderr, "Task %i\n", i);
+            fprintf (stderr, "  - cmd: [%s]\n", P->tasks[i].cmd);
+
+            if (P->tasks[i].cpu >= 0)
+                fprintf (stderr, "  - cpu: %i\n", P->tasks[i].cpu);
+            if (P->tasks[i].nice != NICE_UNSET)
+                fprintf (stderr, "  - nice: %i\n", P->tasks[i].nice);
+
+            if (P->tasks[i].argv)
+                for (j=0; P->tasks[i].argv[j]; j++)
+                    fprintf (stderr, "    + arg[%i]: [%s]\n", j, P->tasks[i].argv[j]);
+        }
 
-        if (P->tasks[i].argv)
-            for (j=0; P->tasks[i].argv[j]; j++)
-                fprintf (stderr, "    + arg[%i]: [%s]\n", j, P->tasks[i].argv[j]);
+        if (P->next)
+            fprintf (stderr, "then: %s\n", then[P->then]);
     }
 
     fprintf (stderr, "==================================[ DEBUG: PARSE ]==\n");
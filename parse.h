@@ -3,12 +3,30 @@
 
 #include <limits.h>
 
+#define NICE_UNSET INT_MIN
+
 typedef struct {
     char* cmd;
     char** argv;   /* NULL terminated array of strings */
+
+    int cpu;       /* |[cpu=N]: CPU to pin the stage to, -1 for none */
+    int nice;      /* |[nice=N]: nice value of the stage, NICE_UNSET for none */
+
+    char** patterns;  /* per argv word: the word as a pattern if it has an unquoted
+                         * ? [ or {, or a $ outside single quotes, else NULL;
+                         NULL if no word has (see word_pattern in parse.c) */
+    const char* path; /* the command, resolved ahead (by a script), or NULL */
+    char** assigns;   /* the name=value words before the command, split off
+                         argv by expand_task, or NULL */
 } Task;
 
-typedef struct {
+typedef enum {
+    SEQ_ALWAYS,          /* ; or &, or nothing follows */
+    SEQ_AND,             /* &&: the next pipeline runs if this one succeeded */
+    SEQ_OR,              /* ||: the next pipeline runs if this one failed */
+} Sequence;
+
+typedef struct Parse {
     Task* tasks;         /* ordered list of tasks to pipe */
     int   ntasks;        /* # of tasks in the parse */
 
@@ -16,12 +34,19 @@ typedef struct {
     char* outfile;       /* filename of 'outfile' */
 
     int background;      /* run process in background? */
-    int invalid_syntax;  /* parse failed */
+    int invalid_syntax;  /* parse failed (set on the first pipeline of the line) */
+
+    char* text;          /* the pipeline as typed, for the job name */
+    Sequence then;       /* how next is run */
+    struct Parse* next;  /* the next pipeline on the line, or NULL */
+
+    struct Arena* arena; /* owns the Parse and everything it points to */
 } Parse;
 
 
 Parse* parse_cmdline (char* cmdline);
 void parse_destroy (Parse** P);
 void parse_debug (Parse* P);
+const char* parse_subst_end (const char* p);
 
 #endif /* _parse_h_ */
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+typedef struct
+{
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} PerfEvent;
+
+static const PerfEvent events[] = {
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+#define NEVENTS (sizeof(events) / sizeof(events[0]))
+
+enum
+{
+    EV_TASK_CLOCK,
+    EV_PAGE_FAULTS,
+    EV_CSW,
+    EV_CYCLES,
+    EV_INSTRUCTIONS,
+};
+
+struct PerfStat
+{
+    int nstages;
+    int attached;          // stages with counters so far
+    int (*fds)[NEVENTS];   // fds[stage][event], -1 if the event is not available
+    int user_only;         // perf_event_paranoid only lets us count user space
+    int no_event[NEVENTS]; // the kernel refused the event, do not ask again
+};
+
+static int open_event(PerfStat *ps, int ev, pid_t pid)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[ev].type;
+    attr.config = events[ev].config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1; // start counting once the stage is the command, not us
+    attr.inherit = 1;        // and include whatever it forks
+    attr.exclude_hv = 1;
+    attr.exclude_kernel = ps->user_only;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && errno == EACCES && !ps->user_only)
+    { // kernel profiling is not allowed, count user space only from now on
+        ps->user_only = 1;
+        return open_event(ps, ev, pid);
+    }
+    return fd;
+}
+
+PerfStat *perf_new(int nstages)
+{
+    PerfStat *ps = calloc(1, sizeof(*ps));
+
+    ps->nstages = nstages;
+    ps->fds = malloc(nstages * sizeof(*ps->fds));
+    return ps;
+}
+
+/* Opens the counters on pid, a stage that has not exec'd yet.
+ * Returns the number of events that could be opened. */
+int perf_attach(PerfStat *ps, pid_t pid)
+{
+    unsigned int ev;
+    int *fds, n = 0;
+
+    if (ps->attached == ps->nstages)
+        return 0;
+
+    fds = ps->fds[ps->attached++];
+    for (ev = 0; ev < NEVENTS; ev++)
+    {
+        fds[ev] = ps->no_event[ev] ? -1 : open_event(ps, ev, pid);
+        if (fds[ev] < 0)
+            ps->no_event[ev] = 1; // ENOENT (no PMU) or not permitted: software events only
+        else
+            n++;
+    }
+    return n;
+}
+
+// value of one counter, scaled up if it had to share the PMU with others
+static int read_event(int fd, uint64_t *value)
+{
+    uint64_t v[3]; // value, time enabled, time running
+
+    if (fd < 0 || read(fd, v, sizeof(v)) != sizeof(v))
+        return 0;
+
+    if (v[2] && v[2] < v[1])
+        v[0] = (uint64_t)((double)v[0] * v[1] / v[2]);
+    *value = v[0];
+    return 1;
+}
+
+// prints the counters summed over every stage, in the spirit of perf stat
+void perf_print(PerfStat *ps, FILE *out, const char *name, double wall)
+{
+    uint64_t total[NEVENTS] = {0}, v;
+    int have[NEVENTS] = {0};
+    unsigned int ev;
+    int i;
+
+    for (i = 0; i < ps->attached; i++)
+    {
+        for (ev = 0; ev < NEVENTS; ev++)
+        {
+            if (read_event(ps->fds[i][ev], &v))
+            {
+                total[ev] += v;
+                have[ev] = 1;
+            }
+        }
+    }
+
+    fprintf(out, "\n Performance counter stats for '%s' (%d stage%s):\n\n",
+            name, ps->attached, ps->attached == 1 ? "" : "s");
+
+    for (ev = 0; ev < NEVENTS; ev++)
+    {
+        if (!have[ev])
+            continue;
+
+        if (ev == EV_TASK_CLOCK)
+            fprintf(out, "%18.2f msec %s", total[ev] / 1e6, events[ev].name);
+        else
+            fprintf(out, "%18llu      %s", (unsigned long long)total[ev], events[ev].name);
+
+        if (ev == EV_TASK_CLOCK && wall > 0)
+            fprintf(out, "%*s # %8.3f CPUs utilized", 18 - (int)strlen(events[ev].name), "",
+                    total[ev] / 1e9 / wall);
+        else if (ev == EV_INSTRUCTIONS && have[EV_CYCLES] && total[EV_CYCLES])
+            fprintf(out, "%*s # %8.2f insn per cycle", 18 - (int)strlen(events[ev].name), "",
+                    (double)total[ev] / total[EV_CYCLES]);
+        fprintf(out, "\n");
+    }
+
+    if (!have[EV_CYCLES])
+        fprintf(out, "%18s      %s\n", "", "(hardware counters not available, software events only)");
+    else if (ps->user_only)
+        fprintf(out, "%18s      %s\n", "", "(user space only, see perf_event_paranoid)");
+
+    fprintf(out, "\n%18.9f seconds time elapsed\n\n", wall);
+}
+
+void perf_free(PerfStat *ps)
+{
+    unsigned int ev;
+    int i;
+
+    for (i = 0; i < ps->attached; i++)
+    {
+        for (ev = 0; ev < NEVENTS; ev++)
+        {
+            if (ps->fds[i][ev] >= 0)
+                close(ps->fds[i][ev]);
+        }
+    }
+    free(ps->fds);
+    free(ps);
+}
@@ -0,0 +1,24 @@
+#ifndef _perf_h_
+#define _perf_h_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Performance counters for a job (the perfstat keyword).
+ *
+ * Counters are opened with perf_event_open() on every stage while it is
+ * held before exec (see spawn_cmd_held), with inherit set so that the
+ * stage's own children are counted too, and enable_on_exec so that the
+ * shell's side of the launch is not.  Hardware events (cycles,
+ * instructions, cache and branch misses) are used when the kernel allows
+ * them; the software events (task-clock, page-faults, context-switches)
+ * always are. */
+
+typedef struct PerfStat PerfStat;
+
+PerfStat* perf_new (int nstages);
+int perf_attach (PerfStat* ps, pid_t pid);
+void perf_print (PerfStat* ps, FILE* out, const char* name, double wall);
+void perf_free (PerfStat* ps);
+
+#endif /* _perf_h_ */
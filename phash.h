@@ -0,0 +1,17 @@
+#ifndef _phash_h_
+#define _phash_h_
+
+/* Seeded string hash shared by the builtin table and tools/mkbuiltins,
+ * which searches for a seed that maps every builtin to its own slot. */
+static inline unsigned int phash (const char* s, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ seed;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+#endif /* _phash_h_ */
@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "pipestat.h"
+#include "pssh.h"
+#include "stats.h"
+
+#define RELAY_CHUNK (1 << 20) // most a single splice moves, the pipe holds less anyway
+
+// relays run in their own threads while jobs -l reads the counters
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+
+typedef struct
+{
+    int in;               // read end of the pipe the writer stage fills
+    int out;              // write end of the pipe the reader stage drains
+    int started;          // a relay thread runs (or ran) for this link
+    pthread_t thread;
+    uint64_t bytes;       // moved so far
+    uint64_t wait_writer; // ns spent with nothing to read
+    uint64_t wait_reader; // ns spent with no room to write
+    uint64_t waiting;     // when the wait in progress started, 0 if none
+    uint64_t *wait_side;  // ...and which of the two it adds to
+    uint64_t start;
+    uint64_t end;         // 0 while the relay runs
+    int stop;             // readable once the relay is to finish
+} Link;
+
+struct PipeStat
+{
+    int nstages;
+    char **stages; // command name of each stage
+    Link *links;   // links[i] is the pipe from stage i to stage i + 1
+    int stop[2];   // closing stop[1] tells every relay to finish (pipestat_stop)
+};
+
+/* Blocks until fd is ready for events (or has an error), adding the time to
+ * *side.  Returns 0, or -1 if the relays were told to stop meanwhile. */
+static int wait_for(Link *l, int fd, short events, uint64_t *side, int stop)
+{
+    struct pollfd pfd[2] = {{.fd = fd, .events = events}, {.fd = stop, .events = POLLIN}};
+    uint64_t start = stats_now();
+
+    __atomic_store_n(&l->wait_side, side, __ATOMIC_RELAXED);
+    __atomic_store_n(&l->waiting, start, __ATOMIC_RELEASE);
+    while (poll(pfd, 2, -1) < 0 && errno == EINTR)
+        ;
+    __atomic_store_n(&l->waiting, 0, __ATOMIC_RELEASE);
+    ADD(*side, stats_now() - start);
+    return pfd[1].revents ? -1 : 0;
+}
+
+/* Moves everything from l->in to l->out until the writers are gone (EOF)
+ * or the readers are (EPIPE).  Closing both ends then passes that on: the
+ * reader stage sees EOF, the writer stage gets SIGPIPE, as with one pipe.
+ * Told to stop, it moves what it can without waiting and ends: every stage
+ * is gone by then, and only a process they left behind (sh -c 'cmd &') can
+ * still hold an end, which is no reason to keep the relay running. */
+static void *relay(void *arg)
+{
+    Link *l = arg;
+    struct pollfd in = {.fd = l->in, .events = POLLIN};
+    ssize_t n;
+    int stopped = 0;
+
+    for (;;)
+    {
+        n = splice(l->in, NULL, l->out, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            ADD(l->bytes, n);
+            continue;
+        }
+        if (n == 0)
+            break; // every writer closed its end
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN || stopped)
+            break; // EPIPE: every reader closed its end
+
+        // the input is empty or the output is full, see which one to wait for
+        if (poll(&in, 1, 0) == 0)
+            stopped = wait_for(l, l->in, POLLIN, &l->wait_writer, l->stop) < 0;
+        else
+            stopped = wait_for(l, l->out, POLLOUT, &l->wait_reader, l->stop) < 0;
+    }
+
+    close(l->in);
+    close(l->out);
+    __atomic_store_n(&l->end, stats_now(), __ATOMIC_RELEASE);
+    return NULL;
+}
+
+PipeStat *pipestat_new(int nstages, char **stages)
+{
+    PipeStat *ps = calloc(1, sizeof(*ps));
+    int i;
+
+    ps->nstages = nstages;
+    ps->stages = malloc(nstages * sizeof(*ps->stages));
+    ps->links = calloc(nstages - 1, sizeof(*ps->links));
+    if (pipe2(ps->stop, O_CLOEXEC) < 0)
+        ps->stop[0] = ps->stop[1] = -1; // the relays then only end with their stages' ends
+    for (i = 0; i < nstages; i++)
+    {
+        ps->stages[i] = strdup(stages[i]);
+    }
+    return ps;
+}
+
+/* Creates the pipes between stage link and the next one and starts their
+ * relay.  Like pipe(), fills fds with the end the next stage reads
+ * (fds[0]) and the end this stage writes (fds[1]).  Returns -1 on error. */
+int pipestat_link(PipeStat *ps, int link, int fds[2])
+{
+    Link *l = &ps->links[link];
+    int writer[2], reader[2];
+
+    if (pipe2(writer, O_CLOEXEC) < 0)
+        return -1;
+    if (pipe2(reader, O_CLOEXEC) < 0)
+    {
+        close(writer[0]);
+        close(writer[1]);
+        return -1;
+    }
+    if (pipe_size)
+    { // set pipesize applies to both halves
+        fcntl(writer[1], F_SETPIPE_SZ, pipe_size);
+        fcntl(reader[1], F_SETPIPE_SZ, pipe_size);
+    }
+
+    l->in = writer[0];
+    l->out = reader[1];
+    l->stop = ps->stop[0];
+    l->start = stats_now();
+    if (pthread_create(&l->thread, NULL, relay, l))
+    {
+        close(writer[0]);
+        close(writer[1]);
+        close(reader[0]);
+        close(reader[1]);
+        errno = EAGAIN;
+        return -1;
+    }
+    l->started = 1;
+
+    fds[0] = reader[0];
+    fds[1] = writer[1];
+    return 0;
+}
+
+/* Ends every relay, to be called once the stages are all gone (or were
+ * never started): each one moves what is already in its pipe, closes its
+ * ends and returns, so the join below never waits on another process. */
+void pipestat_stop(PipeStat *ps)
+{
+    int i;
+
+    if (ps->stop[1] >= 0)
+        close(ps->stop[1]);
+    ps->stop[1] = -1;
+    for (i = 0; i < ps->nstages - 1; i++)
+    {
+        if (ps->links[i].started)
+            pthread_join(ps->links[i].thread, NULL);
+        ps->links[i].started = 0;
+    }
+}
+
+// share of the link's lifetime spent waiting
+static double ratio(uint64_t waited, uint64_t elapsed)
+{
+    return elapsed ? (double)waited / elapsed : 0;
+}
+
+static void print_bytes(FILE *out, double bytes, const char *suffix)
+{
+    static const char units[] = "BKMGT";
+    int u = 0;
+
+    while (bytes >= 1024 && units[u + 1])
+    {
+        bytes /= 1024;
+        u++;
+    }
+    fprintf(out, u ? "%7.1f%c%s" : "%7.0f%c%s", bytes, units[u], suffix);
+}
+
+/* One line per pipe with what went through it, the rate and how much of
+ * the time it waited for each side, so far if the job still runs; then
+ * the stage the pipes mostly waited for, if there is one. */
+void pipestat_print(PipeStat *ps, FILE *out, const char *indent)
+{
+    double elapsed[ps->nstages], wait_writer[ps->nstages], wait_reader[ps->nstages];
+    double best = 0, score;
+    uint64_t now = stats_now(), end, waiting, waited[2];
+    int i, slowest = -1;
+
+    for (i = 0; i < ps->nstages - 1; i++)
+    {
+        Link *l = &ps->links[i];
+
+        end = __atomic_load_n(&l->end, __ATOMIC_ACQUIRE);
+        elapsed[i] = l->start ? (end ? end : now) - l->start : 0;
+        waited[0] = LOAD(l->wait_writer);
+        waited[1] = LOAD(l->wait_reader);
+        if (!end && (waiting = __atomic_load_n(&l->waiting, __ATOMIC_ACQUIRE)) && waiting < now)
+        { // a running job: count the wait in progress too
+            waited[LOAD(l->wait_side) == &l->wait_reader] += now - waiting;
+        }
+        wait_writer[i] = ratio(waited[0], elapsed[i]);
+        wait_reader[i] = ratio(waited[1], elapsed[i]);
+
+        fprintf(out, "%s%-10s -> %-10s ", indent, ps->stages[i], ps->stages[i + 1]);
+        print_bytes(out, LOAD(l->bytes), "");
+        print_bytes(out, elapsed[i] ? LOAD(l->bytes) / (elapsed[i] / 1e9) : 0, "/s");
+        fprintf(out, "  waiting for writer %3.0f%% reader %3.0f%%\n",
+                100 * wait_writer[i], 100 * wait_reader[i]);
+    }
+
+    // a stage is the bottleneck when the pipe before it waits for it to read
+    // and the pipe after it waits for it to write
+    for (i = 0; i < ps->nstages; i++)
+    {
+        int n = 0;
+
+        score = 0;
+        if (i > 0 && elapsed[i - 1])
+            score += wait_reader[i - 1], n++;
+        if (i < ps->nstages - 1 && elapsed[i])
+            score += wait_writer[i], n++;
+        if (n && score / n > best)
+        {
+            best = score / n;
+            slowest = i;
+        }
+    }
+    if (best >= 0.5)
+        fprintf(out, "%sbottleneck: %s (waited for %.0f%% of the time)\n", indent, ps->stages[slowest], 100 * best);
+}
+
+void pipestat_free(PipeStat *ps)
+{
+    int i;
+
+    if (!ps)
+        return;
+
+    pipestat_stop(ps);
+    if (ps->stop[0] >= 0)
+        close(ps->stop[0]);
+    for (i = 0; i < ps->nstages; i++)
+    {
+        free(ps->stages[i]);
+    }
+    free(ps->stages);
+    free(ps->links);
+    free(ps);
+}
@@ -0,0 +1,25 @@
+#ifndef _pipestat_h_
+#define _pipestat_h_
+
+#include <stdio.h>
+
+/* Throughput of the pipes of a pipeline (the pipestat keyword).
+ *
+ * Instead of one pipe between two stages there are two, and a relay
+ * thread in the shell splice()s from the first into the second, so the
+ * data never passes through user space.  Each relay counts the bytes it
+ * moved and how long it waited for the writer (the stage before it had
+ * nothing to give) and for the reader (the stage after it had not read
+ * what it was given).  A stage that both of its pipes wait for is the
+ * bottleneck.  pipestat_stop() ends the relays once the stages are gone,
+ * even if a process they started in the background still holds a pipe. */
+
+typedef struct PipeStat PipeStat;
+
+PipeStat* pipestat_new (int nstages, char** stages);
+int pipestat_link (PipeStat* ps, int link, int fds[2]);
+void pipestat_stop (PipeStat* ps);
+void pipestat_print (PipeStat* ps, FILE* out, const char* indent);
+void pipestat_free (PipeStat* ps);
+
+#endif /* _pipestat_h_ */
@@ -6,54 +6,54 @@
 #include <errno.h>
 #include "builtin.h"
 #include "parse.h"
+#include "hash.h"
+#include "spawn.h"
+#include "jobs.h"
+#include "pssh.h"
+#include "perf.h"
+#include "stats.h"
+#include "pipestat.h"
+#include "daemon.h"
+#include "forksrv.h"
+#include "expand.h"
+#include "script.h"
+#include "vars.h"
+#include "arena.h"
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/signalfd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
 
 /*******************************************
  * Set to 1 to view the command line parse *
  *******************************************/
 #define DEBUG_PARSE 0
 #define MAX_BUF 1024
-#define MAX_JOBS 100
 
-typedef enum
-{
-    STOPPED,
-    TERM,
-    BG,
-    FG,
-} JobStatus;
-
-typedef struct
-{
-    char name[MAX_BUF];
-    int job_id;
-    pid_t *pids;
-    unsigned int npids;
-    pid_t pgid;
-    JobStatus status;
-} Job;
-
-Job *jobs[MAX_JOBS]; // array to store the jobs structures
-int job_num = 0;     // keep track of total jobs number
 int our_tty;         // store the terminal
+int interactive = 0; // reading commands from a terminal (not -c, a script or a pipe)
+int last_status = 0; // exit status of the last foreground job
+pid_t shell_pid;     // $$, taken before any copy of the shell is forked
+static int builtin_status = 0; // exit status of the last builtin run as a pipeline stage
+static int captures = 0; // $(...) run so far, for the status of a line that only sets variables
+static PerfStat *perf_job = NULL; // counters of the perfstat job being launched
+static const Task *expanding = NULL; // the task execute_tasks is expanding, owner of its <(...) and >(...)
+int report_usage = 0;
+char *stats_log = NULL;
+int pipe_size = 0;
+int spread_stages = 0;
+void (*job_hook)(Job *job, int done) = NULL;
+void (*error_hook)(const char *msg) = NULL;
 
 // Job API functions
-int remove_child(int chld_pid);
-int check_job_status(int pgid);
-void delete_job(Job *job);
 void change_job_status(int pgid, int status);
-Job *create_job(int npids, int pgid, int *pids, int is_bg, char *name, int job_id);
-int check_free_job();
 void print_new_bg_job(Job *job);
+static void substs_inherit(const Task *task, int on);
 
-// Builtin commands functions
-int get_job_pgid(char *job_id);
-int check_pid(int pid);
-void kill_builtin(char **argv);
-void fg(char **argv);
-void bg(char **argv);
-void print_job(Job *job);
 
 void print_banner()
 {
@@ -68,75 +68,244 @@ void print_banner()
 // Sets fg pg
 void set_fg_pgrp(pid_t pgrp)
 {
-    void (*sav)(int sig);
+    if (!interactive)
+        return; // no terminal to hand over
 
     if (pgrp == 0)
         pgrp = getpgrp();
 
-    sav = signal(SIGTTOU, SIG_IGN);
+    // SIGTTOU is blocked (it is read from sig_fd), so this works from the background too
+    uint64_t start = stats_now();
     tcsetpgrp(our_tty, pgrp);
-    signal(SIGTTOU, sav);
+    stats_record(STAT_TCSETPGRP, start);
 }
 
-void handler(int sig)
+//==========================================================EVENT LOOP================================================================
+
+/* Signals are never handled asynchronously: they stay blocked and are read
+ * from sig_fd by the main loop, so the job table is only ever touched from
+ * normal program context. */
+static int sig_fd = -1;
+static uint64_t sig_ready; // when sig_fd was last found readable, for the reap latency
+
+// job notices collected while reaping, printed between prompts
+static char *notices = NULL;
+static size_t notices_len = 0;
+static size_t notices_cap = 0;
+
+static void notify(const char *fmt, ...)
 {
-    pid_t chld;
-    int status;
+    va_list ap;
+    int n;
 
-    switch (sig)
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    if (notices_len + n + 1 > notices_cap)
     {
+        notices_cap = (notices_len + n + 1) * 2;
+        notices = realloc(notices, notices_cap);
+    }
 
-    case SIGTTOU:
-        // printf("Parent: SIGTTOU RECIEVED % d\n", getpgrp());
-        while (tcgetpgrp(STDOUT_FILENO) != getpgrp())
-        { // pause until parent has the foreground back
-            pause();
-        }
-        break;
+    va_start(ap, fmt);
+    vsnprintf(notices + notices_len, n + 1, fmt, ap);
+    va_end(ap);
+    notices_len += n;
+}
+
+void flush_notices()
+{
+    if (!notices_len)
+        return;
 
-    case SIGCHLD:
+    fwrite(notices, 1, notices_len, stdout);
+    fflush(stdout);
+    notices_len = 0;
+}
 
-        while ((chld = waitpid(-1, &status, WNOHANG | WCONTINUED | WUNTRACED)) > 0)
-        { // wait on children
+// an error with a command line, for out unless error_hook takes it
+void shell_error(FILE *out, const char *fmt, ...)
+{
+    va_list ap;
+    char *msg;
 
-            if (WIFCONTINUED(status))
-            {
-                change_job_status(getpgid(chld), 2);
-            }
-            else if (WIFSTOPPED(status))
-            {
-                change_job_status(getpgid(chld), 0);
-                set_fg_pgrp(0);
-            }
-            else
-            {
-                /* waited on terminated child */
+    va_start(ap, fmt);
+    if (!error_hook)
+        vfprintf(out, fmt, ap);
+    else if (vasprintf(&msg, fmt, ap) >= 0)
+    {
+        error_hook(msg);
+        free(msg);
+    }
+    va_end(ap);
+}
+
+static void setup_signals()
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (interactive)
+    { // the shell itself must never be stopped by the terminal
+        sigaddset(&mask, SIGTSTP);
+        sigaddset(&mask, SIGTTOU);
+        sigaddset(&mask, SIGTTIN);
+    }
+
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN); // builtin output is written from the shell, a closed reader must not kill it
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1)
+    {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// "[1] sleep 1: real 1.002s user 0.000s ..." once a job is done
+static void notify_usage(Job *job)
+{
+    struct rusage total;
+    char *line;
+    size_t len;
+    FILE *f = open_memstream(&line, &len);
+
+    sum_usage(job->usage, job->npids, &total);
+    fprintf(f, "[%d] %s: ", job->job_id, job->name);
+    print_usage(f, &total, job_wall_time(job));
+    fclose(f);
+
+    notify("%s\n", line);
+    free(line);
+}
+
+// Reaps every child that has changed state, in one batch
+static void reap_children()
+{
+    struct rusage ru;
+    pid_t chld;
+    int status;
+
+    while ((chld = wait4(-1, &status, WNOHANG | WCONTINUED | WUNTRACED, &ru)) > 0)
+    { // wait on children
+
+        if (WIFCONTINUED(status))
+        {
+            Job *job = find_job_by_pid(chld);
+            if (job && job->status == STOPPED)
+                change_job_status(job->pgid, BG);
+        }
+        else if (WIFSTOPPED(status))
+        {
+            Job *job = find_job_by_pid(chld);
+            if (job && job->status == FG)
+                last_status = 128 + WSTOPSIG(status); // like bash, so && after ^Z is skipped
+            if (job && job->status != STOPPED)
+                change_job_status(job->pgid, STOPPED);
+        }
+        else
+        {
+            /* waited on terminated child */
 
-                int pgid = remove_child(chld); // removes child and returns the group id of the job
-                if (pgid == -1)
+            Job *job = remove_child(chld, status, &ru); // removes child and returns its job
+            stats_count(STAT_REAPED);
+            if (!job)
+                continue; // its job is still being launched, create_job picks it up
+
+            if (!job->nlive)
+            { // every child of the job has terminated
+                if (job->on_done)
                 {
-                    printf("Error when removing a child from a job structure. \n");
+                    job->on_done(job, job->data);
                 }
-                if (!check_job_status(pgid))
+                else if (job->status == FG)
                 {
-                    set_fg_pgrp(0);
-                    // add condition to check for bg
-                    int i = 0;
-                    while (jobs[i]->pgid != pgid)
-                    {
-                        ++i;
-                    }
-                    // if (jobs[i]->name[strlen(jobs[i]->name - 1)] == '&')
-                    printf("\n[%i] + done	%s\n", jobs[i]->job_id, jobs[i]->name);
-                    // fflush(stdout);
+                    last_status = job->exit_status;
                 }
+                else
+                {
+                    notify("\n[%i] + done	%s\n", job->job_id, job->name);
+                }
+                if (report_usage && !job->on_done)
+                    notify_usage(job);
+                if (job_hook)
+                    job_hook(job, 1);
+                delete_job(job);
+                stats_record(STAT_REAP, sig_ready);
             }
         }
-        break;
+    }
+}
+
+// Drains sig_fd, SIGCHLDs coalesce so one reaping pass covers them all
+static void handle_signals()
+{
+    struct signalfd_siginfo si[32];
+    ssize_t n;
+    int i, chld = 0;
+
+    sig_ready = stats_now();
+    while ((n = read(sig_fd, si, sizeof(si))) > 0)
+    {
+        for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++)
+        {
+            if (si[i].ssi_signo == SIGCHLD)
+                chld = 1;
+            // SIGTSTP, SIGTTOU and SIGTTIN are meant for the foreground job, not us
+        }
+    }
+
+    if (chld)
+        reap_children();
+}
+
+/* Waits until one of fds (which may be empty) or sig_fd is ready, or for at
+ * most timeout ms (-1: no limit), and reaps children on the way, for builtins
+ * that run or wait for children of their own (parallel, wait). */
+void poll_events(struct pollfd *fds, int nfds, int timeout)
+{
+    struct pollfd pfd[nfds + 1];
+    int i;
+
+    for (i = 0; i < nfds; i++)
+    {
+        pfd[i] = fds[i];
+    }
+    pfd[nfds].fd = sig_fd;
+    pfd[nfds].events = POLLIN;
+
+    if (poll(pfd, nfds + 1, timeout) <= 0)
+    { // timed out or EINTR: report nothing, the caller polls again
+        for (i = 0; i <= nfds; i++)
+        {
+            pfd[i].revents = 0;
+        }
+    }
 
-    default:
-        break;
+    for (i = 0; i < nfds; i++)
+    {
+        fds[i].revents = pfd[i].revents;
     }
+    if (pfd[nfds].revents & POLLIN)
+        handle_signals();
+}
+
+/* Blocks until the foreground job led by pgid has finished or stopped,
+ * then takes the terminal back. */
+void wait_fg_job(pid_t pgid)
+{
+    struct pollfd pfd = {.fd = sig_fd, .events = POLLIN};
+    Job *job;
+
+    while ((job = find_job(pgid)) && job->status == FG)
+    {
+        if (poll(&pfd, 1, -1) > 0)
+            handle_signals();
+    }
+
+    set_fg_pgrp(0);
 }
 
 /* returns a string for building the prompt
@@ -158,75 +327,89 @@ static char *build_prompt(char *cwd) // Modified to get the pwd, adds "$ " and r
     }
 }
 
-/* return true if command is found, either:
- *   - a valid fully qualified path was supplied to an existing file
- *   - the executable file was found in the system's PATH
- * false is returned otherwise */
-char *store_path;
-static int command_found(const char *cmd)
+/* returns the path to execute for cmd, either:
+ *   - cmd itself, if it is a path (contains a '/') to an existing executable
+ *   - the location of cmd found in the system's PATH (cached by the hash table)
+ * NULL is returned otherwise */
+const char *command_found(const char *cmd)
 {
-    char *dir;
-    char *tmp;
-    char *PATH;
-    char *state;
-    char probe[PATH_MAX];
+    // access()  checks  whether  the  calling process can access the file pathname.
+    if (strchr(cmd, '/'))
+        return access(cmd, X_OK) == 0 ? cmd : NULL;
 
-    int ret = 0;
+    uint64_t start = stats_now();
+    const char *path = hash_lookup(cmd);
 
-    // access()  checks  whether  the  calling process can access the file pathname.
-    if (access(cmd, X_OK) == 0)
-        return 1;
+    stats_record(STAT_LOOKUP, start);
+    return path;
+}
+
+/*Takes a command, its resolved path (or its builtin), argv, in and out file descriptors.
+Uses the path and the arguments to start the command with posix_spawn.
+The in and out file descriptors are set accordingly to accomodate any files/pipes/stdout/stdin etc...
+Nothing runs in the child between fork and exec: process group, fds and signal dispositions
+are all set up by spawn_cmd, and only the parent hands over the terminal.
+Builtin stages run inside the shell and write straight to pip_write (stdin is ignored).
+Under perfstat the child is held before exec until its counters are attached.
+Returns the pid of the child, or 0 if it could not be started or was a builtin.*/
+static pid_t launch(const char *path, char **options, int pip_read, int pip_write, pid_t pgid)
+{
+    pid_t pid;
+    int release_fd;
 
-    // getenv() searches the environment list to find the environment variable name, and returns a pointer to the corresponding value string.
-    PATH = strdup(getenv("PATH"));
+    if (!perf_job)
+        return spawn_cmd(path, options, pip_read, pip_write, pgid);
 
-    for (tmp = PATH;; tmp = NULL)
+    pid = spawn_cmd_held(path, options, pip_read, pip_write, pgid, &release_fd);
+    if (pid > 0)
     {
-        // strtok() breaks a string into a sequence of zero or more nonempty tokens
-        dir = strtok_r(tmp, ":", &state);
-        if (!dir)
-            break;
-
-        strncpy(probe, dir, PATH_MAX - 1);
-        strncat(probe, "/", PATH_MAX - 1);
-        strncat(probe, cmd, PATH_MAX - 1);
-        store_path = probe; // store the path of the executable (used in which command)
-        // F_OK tests for the existence of the file.  R_OK, W_OK, and X_OK test whether the file exists and grants read, write, and execute permissions, respectively.
-        if (access(probe, X_OK) == 0)
-        {
-            ret = 1;
-            break;
-        }
+        perf_attach(perf_job, pid);
+        close(release_fd); // let it exec
     }
-    free(PATH);
-    return ret;
+    return pid;
 }
 
-/*Takes a command, argv, in and out file descriptors.
-Uses the command and the arguments to execute the command.
-The in and out file descriptors are set accordingly to accomodate any files/pipes/stdout/stdin etc...
-Supports the bultin commands which and exit.*/
-int exec_cmd(char *cmd, char **options, int pip_read, int pip_write, int num, pid_t *pid_0, int bg)
+int exec_cmd(const Task *task, const char *path, const Builtin *builtin, int pip_read, int pip_write, pid_t *pid_0, int bg)
 {
     pid_t pid;
 
-    pid = vfork();
-    if (pid < 0)
-    {
-        printf("failed to fork\n");
-        exit(EXIT_FAILURE);
+    if (task->assigns)
+        vars_push(task->assigns); // x=1 cmd: in its environment only
+
+    if (builtin)
+    { // no process: the reader of pip_write sees EOF once the output is written
+        builtin_status = builtin_run(builtin, task->argv, pip_read, pip_write);
+        if (task->assigns)
+            vars_pop();
+        return 0;
     }
 
-    // Add forked children into their process groups
-    if (num == 0)
-    {                         // this is the first forked child
-        *pid_0 = pid;         // save its pid as a PGID
-        setpgid(pid, *pid_0); // place first child in its own group
+    // first child leads a new process group, the rest join the group of the first child
+    uint64_t start = stats_now();
+    substs_inherit(task, 1);
+    pid = launch(path, task->argv, pip_read, pip_write, *pid_0);
+    if (pid < 0 && errno == EPERM && *pid_0)
+    { // every earlier stage exited (and was reaped) while a builtin stage ran: start a new group
+        *pid_0 = 0;
+        pid = launch(path, task->argv, pip_read, pip_write, 0);
     }
-    else
+    substs_inherit(task, 0);
+    if (task->assigns)
+        vars_pop();
+
+    if (pid < 0)
     {
-        setpgid(pid, *pid_0); // place new child in the group of the first child
+        shell_error(stdout, "pssh: failed to exec %s: %s\n", task->cmd, strerror(errno));
+        return 0;
+    }
+    stats_record(STAT_SPAWN, start);
+    stats_count(STAT_SPAWNED);
+
+    if (!*pid_0)
+    {                 // this is the first child
+        *pid_0 = pid; // save its pid as a PGID
     }
+
     if (bg)
     {
         set_fg_pgrp(0);
@@ -236,67 +419,318 @@ int exec_cmd(char *cmd, char **options, int pip_read, int pip_write, int num, pi
         set_fg_pgrp(*pid_0); // set foregorund process group
     }
 
-    if (pid == 0)
-    { // Child Process - executes command
+    return pid; // return the pid of the created child process
+}
 
-        if (pip_read != STDIN_FILENO)
+/* Applies the placement of stage n of a pipeline to its process: the CPU
+ * and nice value given with |[cpu=N,nice=N], or with affinity=spread the
+ * n-th CPU the shell may run on.  This happens right after the spawn (there
+ * is no spawn attribute for either), so the first few instructions of the
+ * command may still run elsewhere; both are inherited across exec. */
+static void place_stage(pid_t pid, const Task *task, int n, int nstages)
+{
+    cpu_set_t allowed, set;
+    int cpu = task->cpu, i;
+
+    if (pid <= 0)
+        return;
+
+    if (cpu < 0 && spread_stages && nstages > 1 && !sched_getaffinity(0, sizeof(allowed), &allowed))
+    { // lone commands are left alone, stage n gets the (n mod count)-th CPU of the shell's own mask
+        n %= CPU_COUNT(&allowed);
+        for (i = 0; i < CPU_SETSIZE; i++)
         {
-            if (dup2(pip_read, STDIN_FILENO) == -1)
-            {
-                printf("failed to dup!\n");
-                exit(EXIT_FAILURE);
-            }
+            if (CPU_ISSET(i, &allowed) && n-- == 0)
+                break;
         }
-        if (pip_write != STDOUT_FILENO)
+        cpu = i;
+    }
+
+    if (cpu >= 0)
+    {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(pid, sizeof(set), &set) < 0 && errno != ESRCH && task->cpu >= 0)
+            shell_error(stderr, "pssh: %s: cannot run on cpu %d: %s\n", task->cmd, cpu, strerror(errno));
+    }
+
+    if (task->nice != NICE_UNSET && setpriority(PRIO_PROCESS, pid, task->nice) < 0 && errno != ESRCH)
+        shell_error(stderr, "pssh: %s: cannot set nice %d: %s\n", task->cmd, task->nice, strerror(errno));
+}
+
+/* Writes the report of `time`: a line per stage for pipelines, then the totals
+ * in the format bash uses.  Builtin stages run in the shell and show as 0. */
+static void print_time(FILE *out, char **stages, const struct rusage *ru, int n, double wall)
+{
+    struct rusage total;
+    int i;
+
+    if (n > 1)
+    {
+        for (i = 0; i < n; i++)
         {
-            if (dup2(pip_write, STDOUT_FILENO) == -1)
+            fprintf(out, "%2d %-12s ", i + 1, stages[i]);
+            print_usage(out, &ru[i], -1);
+            fprintf(out, "\n");
+        }
+    }
+
+    sum_usage(ru, n, &total);
+    fprintf(out, "\nreal\t%dm%.3fs\n", (int)(wall / 60), wall - 60 * (int)(wall / 60));
+    fprintf(out, "user\t%ldm%ld.%03lds\n", (long)total.ru_utime.tv_sec / 60,
+            (long)total.ru_utime.tv_sec % 60, (long)total.ru_utime.tv_usec / 1000);
+    fprintf(out, "sys\t%ldm%ld.%03lds\n", (long)total.ru_stime.tv_sec / 60,
+            (long)total.ru_stime.tv_sec % 60, (long)total.ru_stime.tv_usec / 1000);
+    fprintf(out, "maxrss\t%ldk\n", total.ru_maxrss);
+    fprintf(out, "csw\t%ld/%ld\n", total.ru_nvcsw, total.ru_nivcsw);
+}
+
+// what to report once a job run under time, perfstat and/or pipestat is done
+typedef struct
+{
+    char **stages;  // time: command name of each stage
+    PerfStat *perf; // perfstat: the counters of each stage
+    PipeStat *pipes; // pipestat: the relays between the stages
+} Report;
+
+// completion hook of a job run under time, perfstat and/or pipestat
+static void report_job(Job *job, void *data)
+{
+    Report *r = data;
+    char *report;
+    size_t len;
+    FILE *f = open_memstream(&report, &len);
+    unsigned int i;
+
+    if (r->perf)
+    {
+        perf_print(r->perf, f, job->name, job_wall_time(job));
+        perf_free(r->perf);
+    }
+    if (r->pipes)
+    { // every stage is gone: the relays only have what is left in their pipes to move
+        pipestat_stop(r->pipes);
+        pipestat_print(r->pipes, f, "");
+        pipestat_free(r->pipes);
+        job->pipes = NULL;
+    }
+    if (r->stages)
+        print_time(f, r->stages, job->usage, job->npids, job_wall_time(job));
+    fclose(f);
+
+    if (job->status == FG)
+    {
+        last_status = job->exit_status;
+        fputs(report, stderr);
+    }
+    else
+    {
+        notify("\n[%i] + done	%s\n%s", job->job_id, job->name, report);
+    }
+
+    for (i = 0; r->stages && i < job->npids; i++)
+    {
+        free(r->stages[i]);
+    }
+    free(r->stages);
+    free(r);
+    free(report);
+}
+
+//===================================================PROCESS SUBSTITUTION=============================================================
+
+/* <(cmd) and >(cmd) are pipes: the word is replaced by /dev/fd/N for the
+ * shell's end of one, and cmd runs with the other end as its stdout (or
+ * stdin) alongside the command, started just before it.  Its stages join
+ * the process group of the job and are listed first among its pids, so the
+ * job waits for them too and still takes its status from its last stage. */
+typedef struct
+{
+    char *text;
+    int output;         // >(...): cmd reads what the command writes to the path
+    int fd;             // the shell's end, /dev/fd/fd in the argv of owner
+    int far;            // cmd's end
+    const Task *owner;  // the only stage that inherits fd
+    Parse *P;           // cmd, parsed and resolved ahead of the launch
+    const char **paths; // resolved executable of each of its stages
+} ProcSubst;
+
+static ProcSubst *substs = NULL;
+static int nsubsts = 0;
+
+// expand_proc: opens the pipe of a <(...) or >(...) of the task being expanded
+static const char *proc_subst(const char *text, int output)
+{
+    static char path[32];
+    ProcSubst *ps;
+    int fd[2];
+
+    if (!expanding || pipe2(fd, O_CLOEXEC) == -1)
+        return NULL; // not the words of a command being launched (a for list): left as typed
+
+    substs = realloc(substs, (nsubsts + 1) * sizeof(*substs));
+    ps = &substs[nsubsts++];
+    ps->text = strdup(text);
+    ps->output = output;
+    ps->fd = output ? fd[1] : fd[0];
+    ps->far = output ? fd[0] : fd[1];
+    ps->owner = expanding;
+    ps->P = NULL;
+    ps->paths = NULL;
+
+    snprintf(path, sizeof(path), "/dev/fd/%d", ps->fd);
+    return path;
+}
+
+// a file to redirect from or to that is a <(...) or >(...) is the path of its pipe, opened by the shell
+static char *subst_file(char *file, const Task *task, Parse *P)
+{
+    const char *path;
+    size_t len;
+
+    if (!file || (*file != '<' && *file != '>') || parse_subst_end(file) != file + (len = strlen(file)))
+        return file;
+
+    file[len - 1] = '\0';
+    expanding = task;
+    path = proc_subst(file + 2, *file == '>');
+    expanding = NULL;
+    file[len - 1] = ')';
+    return path ? arena_strndup(P->arena, path, strlen(path)) : file;
+}
+
+// lets task inherit the ends of its substitutions across exec (on), or not again
+static void substs_inherit(const Task *task, int on)
+{
+    int i;
+
+    for (i = 0; i < nsubsts; i++)
+    {
+        if (substs[i].owner == task && substs[i].fd >= 0)
+            fcntl(substs[i].fd, F_SETFD, on ? 0 : FD_CLOEXEC);
+    }
+}
+
+// closes the shell's ends once the command has them (the reader of a >(...) only sees EOF then)
+static void substs_close(void)
+{
+    int i;
+
+    for (i = 0; i < nsubsts; i++)
+    {
+        if (substs[i].fd >= 0)
+            close(substs[i].fd);
+        if (substs[i].far >= 0)
+            close(substs[i].far);
+        free(substs[i].text);
+        free(substs[i].paths);
+        parse_destroy(&substs[i].P);
+    }
+    nsubsts = 0;
+}
+
+/* Parses, expands and resolves the command of every substitution before any
+ * is started.  Returns their number of stages, or -1 (and says why) if one
+ * cannot run: each must be a single pipeline of external commands, as a
+ * builtin would run inside the shell and block on a pipe nobody reads yet. */
+static int substs_prepare(void)
+{
+    int i, t, n = 0;
+    Parse *S;
+
+    for (i = 0; i < nsubsts; i++)
+    {
+        S = substs[i].P = parse_cmdline(substs[i].text);
+        if (!S || S->invalid_syntax || S->next || S->background)
+        {
+            shell_error(stdout, "pssh: invalid process substitution: %s\n", substs[i].text);
+            return -1;
+        }
+
+        substs[i].paths = malloc(S->ntasks * sizeof(*substs[i].paths));
+        for (t = 0; t < S->ntasks; t++)
+        {
+            expanding = &S->tasks[t]; // one of its own is added to substs, and prepared after it
+            expand_task(&S->tasks[t], S->arena);
+            expanding = NULL;
+            if (!S->tasks[t].argv[0] || builtin_lookup(S->tasks[t].cmd) || script_is_function(S->tasks[t].cmd))
             {
-                printf("failed to dup!\n");
-                exit(EXIT_FAILURE);
+                shell_error(stdout, "pssh: %s: cannot be run in a process substitution\n", S->tasks[t].argv[0] ? S->tasks[t].cmd : substs[i].text);
+                return -1;
+            }
+            substs[i].paths[t] = S->tasks[t].path ? S->tasks[t].path : command_found(S->tasks[t].cmd);
+            if (!substs[i].paths[t])
+            {
+                shell_error(stdout, "pssh: command not found: %s\n", S->tasks[t].cmd);
+                return -1;
             }
         }
+        n += S->ntasks;
+    }
+    return n;
+}
 
-        if (strcmp(cmd, "which") == 0)
-        { // bultin command which
-            if (!(access(options[1], F_OK)) || command_found(options[1]))
-            { // check if input file exists
+/* Starts every substitution, the first stage started leading the job's
+ * process group.  Their pids go to pids, and with time their names to
+ * stages.  Their ends of the pipes are closed once they have them.
+ * Returns -1 if a pipe could not be made: the stages from there on are
+ * not started (their pids are 0), and the job is to be abandoned. */
+static int substs_launch(pid_t *pid_0, int bg, pid_t *pids, char **stages)
+{
+    int i, t, n = 0, in, out, fd_pip[2], failed = 0;
+    ProcSubst *ps;
+    Parse *S;
 
-                char *path = realpath(options[1], NULL);
+    for (i = 0; i < nsubsts; i++)
+    {
+        ps = &substs[i];
+        S = ps->P;
+        in = ps->output ? ps->far : STDIN_FILENO;
+        if (S->infile && !failed)
+            in = open(S->infile, O_RDONLY | O_CLOEXEC);
 
-                if (path == NULL)
-                { // if NULL then look for the latest path returned by command_found
-                    path = store_path;
-                }
-                execlp("echo", "echo", path, NULL);
+        for (t = 0; t < S->ntasks; t++)
+        {
+            fd_pip[0] = fd_pip[1] = -1;
+            if (failed)
+            {
+                out = -1; // only keeps its place among the pids
             }
-            else
+            else if (t < S->ntasks - 1)
             {
-                if (is_builtin(options[1]))
-                { // check if builtin
-                    char *print_out = options[1];
-                    strcat(print_out, ": shell built-in command");
-                    execlp("echo", "echo", print_out, NULL);
-                }
-                else
+                if (pipe2(fd_pip, O_CLOEXEC) == -1)
                 {
-                    execlp("echo", "echo", "File not found!", NULL);
+                    shell_error(stderr, "pssh: cannot create a pipe: %s\n", strerror(errno));
+                    failed = 1;
                 }
+                out = fd_pip[1];
             }
+            else if (S->outfile)
+            {
+                out = open(S->outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            }
+            else
+            {
+                out = ps->output ? STDOUT_FILENO : ps->far;
+            }
+
+            pids[n] = failed ? 0 : exec_cmd(&S->tasks[t], ps->paths[t], NULL, in, out, pid_0, bg);
+            place_stage(pids[n], &S->tasks[t], t, S->ntasks);
+            if (stages)
+                stages[n] = strdup(S->tasks[t].cmd);
+            n++;
+
+            if (in >= 0 && in != STDIN_FILENO && in != ps->far)
+                close(in);
+            if (out >= 0 && out != STDOUT_FILENO && out != ps->far)
+                close(out);
+            in = fd_pip[0];
         }
-        else
-        {
-            execvp(cmd, options);
-            printf("Child: failed to exec!\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-    else
-    {
-        // printf("Parent  PID: %d\n", getpid());
-        // printf("Parent PGRP: %d\n", getpgrp());
-    }
 
-    return pid; // return the pid of the created child process
+        close(ps->far);
+        ps->far = -1;
+    }
+    return failed ? -1 : 0;
 }
 
 /* Called upon receiving a successful parse.
@@ -306,49 +740,186 @@ int exec_cmd(char *cmd, char **options, int pip_read, int pip_write, int num, pi
 
 void execute_tasks(Parse *P, char *cmdline)
 {
-    unsigned int t = 0;
+    int t = 0;
     pid_t pid_0 = 0; // store the pid of the first child
     pid_t child_pid = 0;
-    int *pids = malloc(sizeof(int) * P->ntasks); //[P->ntasks]; //store the child pids
-
-    if (command_found(P->tasks[0].cmd) || is_builtin(P->tasks[0].cmd))
-    { // checks if first command is supported
-
-        if (!strcmp(P->tasks[0].cmd, "exit"))
-        { // implement builtin exit command to exit the program
-            printf("Exiting pssh...\n");
-            exit(EXIT_SUCCESS);
+    pid_t *pids; // store the child pids, owned by the job once it is created
+    const char *paths[P->ntasks];     // resolved executable of each task
+    const Builtin *builtins[P->ntasks]; // or the builtin it names
+    struct timespec t0, t1;
+    struct rusage self0, self1;
+    PipeStat *pipes = NULL; // pipestat: relays between the stages
+    int timed = 0, perfstat = 0, pipestat = 0;
+    int nprocs = 0; // stages of the <(...) and >(...) of the line, first among the job's pids
+    int abandoned = 0; // a pipe could not be made: what was started is killed
+    pid_t *job_pids;
+    char **stages = NULL; // time: the name of each of them
+
+    int captured = captures;
+
+    for (t = 0; t < P->ntasks; t++)
+    { // variables, $(...), <(...), braces and globs, before anything looks at the words
+        expanding = &P->tasks[t];
+        expand_task(&P->tasks[t], P->arena);
+        expanding = NULL;
+        if (!P->tasks[t].argv[0])
+        { // its words all came to nothing, or it only sets variables
+            for (char **a = P->tasks[t].assigns; a && *a && P->ntasks == 1; a++)
+            {
+                var_set(*a, var_assignment(*a), *a + var_assignment(*a) + 1, 0);
+            }
+            if (captures == captured)
+                last_status = 0; // else that of the last $(...), as x=$(cmd) tells if cmd failed
+            substs_close();
+            return;
         }
-        if (!strcmp(P->tasks[0].cmd, "jobs"))
-        { // jobs command
-            for (int i = 0; i < job_num; i++)
+    }
+    P->infile = subst_file(P->infile, &P->tasks[0], P);
+    P->outfile = subst_file(P->outfile, &P->tasks[P->ntasks - 1], P);
+
+    while (P->tasks[0].argv[1])
+    { // time, perfstat and pipestat <pipeline> are keywords, not commands
+        if (!strcmp(P->tasks[0].cmd, "time"))
+            timed = 1;
+        else if (!strcmp(P->tasks[0].cmd, "perfstat"))
+            perfstat = 1;
+        else if (!strcmp(P->tasks[0].cmd, "pipestat"))
+            pipestat = 1;
+        else
+            break;
+
+        P->tasks[0].argv++;
+        P->tasks[0].cmd = P->tasks[0].argv[0];
+        P->tasks[0].path = NULL;
+    }
+    if (timed)
+        getrusage(RUSAGE_SELF, &self0); // for builtins, which run in the shell
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t launch_start = stats_now();
+
+    for (t = 0; t < P->ntasks; t++)
+    { // resolve every command once: functions, one builtin lookup, then the PATH cache (unless a script did)
+        if (script_is_function(P->tasks[t].cmd))
+        {
+            if (P->ntasks > 1 || P->infile || P->outfile || P->background || timed || perfstat || pipestat)
             {
-                print_job(jobs[i]);
+                shell_error(stdout, "pssh: %s: a function cannot be piped, redirected or run in the background\n", P->tasks[t].cmd);
+                last_status = 2;
+                substs_close();
+                return;
             }
-            return; // no need to fork
+            if (nsubsts)
+            {
+                shell_error(stdout, "pssh: %s: a function cannot be given a process substitution\n", P->tasks[t].cmd);
+                last_status = 2;
+                substs_close();
+                return;
+            }
+            if (P->tasks[0].assigns)
+                vars_push(P->tasks[0].assigns);
+            last_status = script_call(P->tasks[0].argv);
+            if (P->tasks[0].assigns)
+                vars_pop();
+            return;
+        }
+
+        paths[t] = NULL;
+        builtins[t] = builtin_lookup(P->tasks[t].cmd);
+
+        if (!builtins[t])
+        {
+            paths[t] = P->tasks[t].path ? P->tasks[t].path : command_found(P->tasks[t].cmd);
+            if (!paths[t])
+                break;
         }
-        if (!strcmp(P->tasks[0].cmd, "kill"))
-        { // jobs command
-            kill_builtin(P->tasks[0].argv);
-            return; // no need to fork
+        else if (P->ntasks > 1 && !(builtins[t]->flags & BUILTIN_PIPE))
+        {
+            shell_error(stdout, "pssh: %s: cannot be used in a pipeline\n", P->tasks[t].cmd);
+            last_status = 2;
+            substs_close();
+            return;
+        }
+    }
+
+    if (t == P->ntasks)
+    { // checks if every command is supported
+
+        if (P->ntasks == 1 && builtins[0] && !P->infile && !P->outfile && !timed && !perfstat && !nsubsts)
+        { // a lone builtin runs inside the shell, no need to fork
+            if (P->tasks[0].assigns)
+                vars_push(P->tasks[0].assigns);
+            last_status = builtin_run(builtins[0], P->tasks[0].argv, STDIN_FILENO, STDOUT_FILENO);
+            if (P->tasks[0].assigns)
+                vars_pop();
+            return;
         }
 
-        if (!strcmp(P->tasks[0].cmd, "fg"))
-        { // jobs command
-            fg(P->tasks[0].argv);
-            // printf("[%i] + continued	%s\n\n", jobnum, jobs[jobnum].name);
-            return; // no need to fork
+        int fd_in = STDIN_FILENO, fd_out = STDOUT_FILENO;
+
+        if (nsubsts && (nprocs = substs_prepare()) < 0)
+        {
+            last_status = 2;
+            substs_close();
+            return;
+        }
+        if (nsubsts && perfstat && forksrv_running())
+        { // the fork server only passes on stdin and stdout
+            shell_error(stderr, "perfstat: process substitution does not work with the fork server (-S)\n");
+            last_status = 2;
+            substs_close();
+            return;
         }
 
-        if (!strcmp(P->tasks[0].cmd, "bg"))
-        { // jobs command
-            bg(P->tasks[0].argv);
-            return; // no need to fork
+        // < reads an existing file, > writes one anew
+        if ((P->infile && (fd_in = open(P->infile, O_RDONLY | O_CLOEXEC)) < 0) ||
+            (P->outfile && (fd_out = open(P->outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0))
+        {
+            shell_error(stdout, "pssh: %s: %s\n", fd_in < 0 ? P->infile : P->outfile, strerror(errno));
+            if (fd_in > STDIN_FILENO)
+                close(fd_in);
+            last_status = 1;
+            substs_close();
+            return;
         }
 
-        int fd;
+        // children are only reaped by the event loop, so the group leader cannot be
+        // reaped before the other stages have joined its process group
+        launch_begin(); // stages reaped before create_job are kept for it from here
+        job_pids = malloc(sizeof(*job_pids) * (nprocs + P->ntasks));
+        pids = job_pids + nprocs;
+        if (timed)
+            stages = malloc((nprocs + P->ntasks) * sizeof(*stages));
+        fflush(stdout); // children write straight to the fd, keep our output ordered before theirs
+        // substitutions start first, so they are running by the time the command opens their paths
+        if (nsubsts && substs_launch(&pid_0, P->background, job_pids, stages) < 0)
+            abandoned = 1;
+        if (perfstat)
+            perf_job = perf_new(P->ntasks);
+        if (pipestat && P->ntasks == 1)
+            fprintf(stderr, "pipestat: a single command has no pipes to measure\n");
+        else if (pipestat)
+        {
+            char *stages[P->ntasks];
 
-        if (P->ntasks > 1)
+            for (t = 0; t < P->ntasks; t++)
+            {
+                stages[t] = P->tasks[t].cmd;
+            }
+            pipes = pipestat_new(P->ntasks, stages);
+        }
+
+        if (abandoned)
+        { // none of the command itself was started
+            for (t = 0; t < P->ntasks; t++)
+            {
+                pids[t] = 0;
+            }
+            if (P->infile)
+                close(fd_in);
+            if (P->outfile)
+                close(fd_out);
+        }
+        else if (P->ntasks > 1)
         { // executes for piped commands
 
             int i;
@@ -358,487 +929,502 @@ void execute_tasks(Parse *P, char *cmdline)
             for (i = 0; i < P->ntasks - 1; i++)
             { // goes through all piped commands except the last one
 
-                if (pipe(fd_pip) == -1)
-                {
-                    fprintf(stderr, "failed to create pipe\n");
-                    exit(EXIT_FAILURE);
+                uint64_t start = stats_now();
+                if ((pipes ? pipestat_link(pipes, i, fd_pip) : pipe2(fd_pip, O_CLOEXEC)) == -1)
+                { // out of descriptors: this pipeline is abandoned, not the shell
+                    shell_error(stderr, "pssh: cannot create a pipe: %s\n", strerror(errno));
+                    abandoned = 1;
+                    break;
                 }
+                if (pipe_size && !pipes)
+                    fcntl(fd_pip[1], F_SETPIPE_SZ, pipe_size); // checked by set, best effort here
+                stats_record(STAT_PIPE, start);
 
                 // store all the pipe file descriptors
                 store_fd[i * 2] = fd_pip[0];
                 store_fd[i * 2 + 1] = fd_pip[1];
 
                 if (i == 0)
-                {
+                { // reads the input file, if there is one
+                    child_pid = exec_cmd(&P->tasks[i], paths[i], builtins[i], fd_in, store_fd[i * 2 + 1], &pid_0, P->background); // in, out
                     if (P->infile)
-                    { // if there is a an input file
-                        fd = open(P->infile, O_RDWR | O_CREAT, 0777);
-                        child_pid = exec_cmd(P->tasks[i].cmd, P->tasks[i].argv, fd, store_fd[i * 2 + 1], i, &pid_0, P->background);
-                        close(fd);
-                    }
-                    else
-                    {
-                        child_pid = exec_cmd(P->tasks[i].cmd, P->tasks[i].argv, STDIN_FILENO, store_fd[i * 2 + 1], i, &pid_0, P->background); // in, out
-                    }
+                        close(fd_in);
                 }
                 else
                 {                                     // this is any piped command that is not the first or last one
                     close(store_fd[(i - 1) * 2 + 1]); // close my write then read
-                    child_pid = exec_cmd(P->tasks[i].cmd, P->tasks[i].argv, store_fd[(i - 1) * 2], store_fd[i * 2 + 1], i, &pid_0, P->background);
+                    child_pid = exec_cmd(&P->tasks[i], paths[i], builtins[i], store_fd[(i - 1) * 2], store_fd[i * 2 + 1], &pid_0, P->background);
                     close(store_fd[(i - 1) * 2]); // close my read
                 }
 
                 pids[i] = child_pid;
+                place_stage(child_pid, &P->tasks[i], i, P->ntasks);
             }
 
-            // Now run the last command of the piped commands
-            close(store_fd[(i - 1) * 2 + 1]);
-            if (P->outfile)
-            {
-
-                fd = open(P->outfile, O_RDWR | O_CREAT, 0777);
-                child_pid = exec_cmd(P->tasks[i].cmd, P->tasks[i].argv, store_fd[(i - 1) * 2], fd, i, &pid_0, P->background);
-                close(fd);
-                close(store_fd[(i - 1) * 2]);
+            if (abandoned)
+            { // the ends still open, and no stage from the i-th on
+                if (i == 0 && P->infile)
+                    close(fd_in);
+                if (i > 0)
+                {
+                    close(store_fd[(i - 1) * 2 + 1]);
+                    close(store_fd[(i - 1) * 2]);
+                }
+                if (P->outfile)
+                    close(fd_out);
+                for (; i < P->ntasks; i++)
+                {
+                    pids[i] = 0;
+                }
             }
             else
-            {
-
-                child_pid = exec_cmd(P->tasks[i].cmd, P->tasks[i].argv, store_fd[(i - 1) * 2], STDOUT_FILENO, i, &pid_0, P->background); // in, out
+            { // Now run the last command of the piped commands
+                close(store_fd[(i - 1) * 2 + 1]);
+                child_pid = exec_cmd(&P->tasks[i], paths[i], builtins[i], store_fd[(i - 1) * 2], fd_out, &pid_0, P->background); // in, out
+                if (P->outfile)
+                    close(fd_out);
                 close(store_fd[(i - 1) * 2]);
-            }
 
-            pids[P->ntasks - 1] = child_pid;
+                pids[P->ntasks - 1] = child_pid;
+                place_stage(child_pid, &P->tasks[i], i, P->ntasks);
+            }
         }
         else
         { // executes single commands
 
-            // if there is a an input/output file open it to fd
-            if (P->infile && P->outfile)
-            {
-
-                int fd_in, fd_out;
-                fd_in = open(P->infile, O_RDWR | O_CREAT, 0777);
-                fd_out = open(P->outfile, O_RDWR | O_CREAT, 0777);
-                child_pid = exec_cmd(P->tasks[0].cmd, P->tasks[0].argv, fd_in, fd_out, 0, &pid_0, P->background);
+            // with the input/output file, if there is one
+            child_pid = exec_cmd(&P->tasks[0], paths[0], builtins[0], fd_in, fd_out, &pid_0, P->background);
+            if (P->infile)
                 close(fd_in);
+            if (P->outfile)
                 close(fd_out);
+
+            pids[0] = child_pid;
+            place_stage(child_pid, &P->tasks[0], 0, 1);
+        }
+
+        stats_record(STAT_LAUNCH, launch_start);
+        substs_close(); // every stage has its ends by now
+        if (abandoned && pid_0)
+            kill(-pid_0, SIGKILL); // reaped as the job's stages, like any other
+
+        if (!pid_0)
+        { // nothing was started: only builtins, or every command failed to exec
+            launch_end();
+            free(job_pids);
+            for (t = 0; stages && t < nprocs; t++)
+            {
+                free(stages[t]);
             }
-            else if (P->infile)
+            free(stages);
+            last_status = abandoned ? 1 : builtins[P->ntasks - 1] ? builtin_status : 127;
+
+            if (perf_job)
             {
+                fprintf(stderr, "perfstat: no process was started, builtins run inside the shell\n");
+                perf_free(perf_job);
+                perf_job = NULL;
+            }
 
-                fd = open(P->infile, O_RDWR | O_CREAT, 0777);
-                child_pid = exec_cmd(P->tasks[0].cmd, P->tasks[0].argv, fd, STDOUT_FILENO, 0, &pid_0, P->background);
-                close(fd);
+            if (pipes)
+            { // builtins only, their output is written by now
+                pipestat_stop(pipes);
+                if (!abandoned)
+                    pipestat_print(pipes, stderr, "");
+                pipestat_free(pipes);
             }
-            else if (P->outfile)
-            {
 
-                fd = open(P->outfile, O_RDWR | O_CREAT, 0777);
-                child_pid = exec_cmd(P->tasks[0].cmd, P->tasks[0].argv, STDIN_FILENO, fd, 0, &pid_0, P->background);
-                close(fd);
+            if (timed)
+            { // the builtins' usage is the shell's own
+                char *stages[P->ntasks];
+                struct rusage ru[P->ntasks];
+
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                getrusage(RUSAGE_SELF, &self1);
+                memset(ru, 0, sizeof(ru));
+                timersub(&self1.ru_utime, &self0.ru_utime, &ru[0].ru_utime);
+                timersub(&self1.ru_stime, &self0.ru_stime, &ru[0].ru_stime);
+                ru[0].ru_maxrss = self1.ru_maxrss;
+                for (t = 0; t < P->ntasks; t++)
+                {
+                    stages[t] = P->tasks[t].cmd;
+                }
+                print_time(stderr, stages, ru, P->ntasks,
+                           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
             }
-            else
+            return;
+        }
+
+        // Create a job struct and store it in the job table
+        Job *job = create_job(nprocs + P->ntasks, pid_0, job_pids, P->background, cmdline);
+        launch_end();
+        job->start = t0;
+        if (job_hook)
+            job_hook(job, 0);
+        if (abandoned)
+            job->exit_status = 1; // its last stage never ran
+        else if (builtins[P->ntasks - 1])
+            job->exit_status = builtin_status; // the last stage already finished inside the shell
+
+        if (timed || perfstat || pipes)
+        {
+            Report *r = calloc(1, sizeof(*r));
+
+            if (timed)
             {
-                child_pid = exec_cmd(P->tasks[0].cmd, P->tasks[0].argv, STDIN_FILENO, STDOUT_FILENO, 0, &pid_0, P->background);
+                r->stages = stages;
+                for (t = 0; t < P->ntasks; t++)
+                {
+                    r->stages[nprocs + t] = strdup(P->tasks[t].cmd);
+                }
             }
+            r->perf = perf_job;
+            perf_job = NULL;
+            r->pipes = pipes;
+            job->pipes = pipes;
 
-            pids[0] = child_pid;
+            job->on_done = report_job;
+            job->data = r;
         }
 
-        // Create a job struct and store it in the array
-        int indx = check_free_job();
-        jobs[indx] = create_job(P->ntasks, pid_0, pids, P->background, cmdline, indx);
+        if (!job->nlive)
+        { // every stage finished while a builtin stage was running
+            last_status = P->background ? 0 : job->exit_status;
+            if (job->on_done)
+                job->on_done(job, job->data);
+            if (job_hook)
+                job_hook(job, 1);
+            delete_job(job);
+            return;
+        }
 
-        // Initialize sig handler
-        signal(SIGTTOU, handler);
-        signal(SIGCHLD, handler);
+        if (P->background)
+        {
+            print_new_bg_job(job);
+            last_status = 0;
+        }
+        else
+        { // block until the foreground job is done (or stopped)
+            wait_fg_job(pid_0);
+        }
     }
     else
     { // command is invalid
-        printf("pssh: command not found: %s\n", P->tasks[t].cmd);
+        shell_error(stdout, "pssh: command not found: %s\n", P->tasks[t].cmd);
+        last_status = 127;
+        substs_close();
     }
 }
 
-int main(int argc, char **argv)
+/* Parses and runs one command line, returns the exit status it produced.
+ * The pipelines of the line run in order; after && the next one only runs
+ * if the last one succeeded and after || only if it failed, so a skipped
+ * pipeline passes the status on to the operator after it. */
+static int run_line(char *cmdline)
 {
-    char *cmdline;
-    Parse *P;
+    Parse *P, *p;
 
-    print_banner();
+    if (script_wants(cmdline))
+        return script_run(cmdline); // compiled as a whole, with its loops and functions
 
-    if (isatty(STDOUT_FILENO))
-    { // Store terminal
-        our_tty = dup(STDERR_FILENO);
-    }
+    uint64_t start = stats_now();
+    P = parse_cmdline(cmdline); // works on its own copy, each pipeline keeps its text for the job name
+    stats_record(STAT_PARSE, start);
+    if (!P)
+        return last_status;
 
-    while (1)
+    if (P->invalid_syntax)
     {
-        char *buf = (char *)malloc(MAX_BUF * sizeof(char)); // takes the current working directory
-        char *store_cmd = (char *)malloc(MAX_BUF * sizeof(char));
+        printf("pssh: invalid syntax \n");
+        last_status = 2;
+        goto next;
+    }
 
-        cmdline = readline(build_prompt(buf));
-        strncpy(store_cmd, cmdline, MAX_BUF);
-        free(buf);
+#if DEBUG_PARSE
+    parse_debug(P);
+#endif
 
-        if (!cmdline) /* EOF (ex: ctrl-d) */
-            exit(EXIT_SUCCESS);
+    for (p = P; p; p = p->next)
+    {
+        execute_tasks(p, p->text);
 
-        P = parse_cmdline(cmdline);
-        if (!P)
-            goto next;
+        if (interactive && last_status == 128 + SIGINT)
+            break; // ^C killed the foreground job, and with it the rest of the line
 
-        if (P->invalid_syntax)
+        while (p->next && ((p->then == SEQ_AND && last_status) || (p->then == SEQ_OR && !last_status)))
         {
-            printf("pssh: invalid syntax \n");
-            goto next;
+            p = p->next;
         }
-
-#if DEBUG_PARSE
-        parse_debug(P);
-#endif
-
-        execute_tasks(P, store_cmd);
-
-    next:
-        parse_destroy(&P);
-        free(cmdline);
-        free(store_cmd);
     }
+
+next:
+    parse_destroy(&P);
+    return last_status;
 }
 
-//========================================================BUILT IN FUNCTIONS==========================================================
+//==================================================COMMAND SUBSTITUTION==============================================================
 
-// checks if a signal can be sent to the pid
-int check_pid(int pid)
-{
-    errno = 0;
-    // will only return 0 if pid exists and you would be able to send it a signal.
-    // If pid isn't running as you (and you aren't root), it fails with -EPERM. (errno != 0)
-    kill(pid, 0);
-    if (errno != 0)
-    { // custom print statement for the three cases
-        printf("pssh: invalid pid: %d \n", pid);
-        return 0;
-    }
-    return 1;
-}
+#define CAPTURE_CHUNK (64 * 1024)
 
-// returns the pgid of the supplied job number
-int get_job_pgid(char *job_id)
+/* expand_cmd: runs text in a copy of the shell whose output goes into a pipe,
+ * and returns that output.  It is read into one buffer, doubled as needed,
+ * with reads as large as the room left in it; $? is the status of text. */
+static char *capture(const char *text)
 {
+    size_t len = 0, cap = CAPTURE_CHUNK;
+    int fd[2], status;
+    char *buf;
+    ssize_t n;
+    pid_t pid;
 
-    int i;
-    char *job_id_chopped = job_id + 1; // removes % from char
-
-    int job_indx = atoi(job_id_chopped);
+    if (pipe2(fd, O_CLOEXEC) == -1)
+        return NULL;
+    fcntl(fd[1], F_SETPIPE_SZ, 1024 * 1024); // fewer wakeups for a large output, best effort
 
-    for (i = 0; i < job_num; i++)
+    fflush(stdout); // or the copy writes it again
+    pid = fork();
+    if (pid == 0)
+    { // its jobs still get the terminal, and hand it back to the shell's group, which it is in
+        dup2(fd[1], STDOUT_FILENO);
+        job_hook = NULL;
+        error_hook = NULL;
+        substs_close(); // those of the line being expanded are the shell's to start
+        run_line(strdup(text));
+        fflush(NULL);
+        _exit(last_status);
+    }
+    close(fd[1]);
+    if (pid < 0)
     {
-        if (jobs[i]->job_id == job_indx && jobs[i]->status != 1)
-        {
-            return jobs[i]->pgid;
-        }
+        close(fd[0]);
+        return NULL;
     }
 
-    printf("pssh: invalid job number: %d\n", job_indx);
-    return 0; // error
+    buf = malloc(cap);
+    while ((n = read(fd[0], buf + len, cap - len - 1)) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        len += n;
+        if (cap - len - 1 < CAPTURE_CHUNK / 2)
+            buf = realloc(buf, cap *= 2);
+    }
+    buf[len] = '\0';
+    close(fd[0]);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    captures++;
+    return buf;
 }
 
-// Kill command function
-void kill_builtin(char **argv)
+/* Runs a line read from a script, a -c string or the terminal.  While a
+ * loop, a group or a function body is still open the line is only kept,
+ * and run with the next ones once it is closed; 1 is returned while so.
+ * A NULL line is the end of the input: what is kept runs as it is. */
+static int feed_line(char *line)
 {
-    int status;
-    int argc = 0;
-    while (argv[argc] != NULL)
+    static char *pending = NULL;
+    char *text;
+
+    if (!pending)
     {
-        argc++;
+        if (!line || !script_incomplete(line))
+        {
+            if (line)
+                run_line(line);
+            return 0;
+        }
+        pending = strdup(line);
+        return 1;
     }
 
-    if (argc == 1)
+    if (line)
     {
-        printf("Usage: kill [-s <signal>] <pid> | %%<job> ... \n");
-        printf("\n");
+        text = malloc(strlen(pending) + strlen(line) + 2);
+        sprintf(text, "%s\n%s", pending, line);
+        free(pending);
+        pending = text;
+        if (script_incomplete(pending))
+            return 1;
     }
-    else if (argc == 2)
-    { // ./signal 1289 format
 
-        pid_t pid;
+    text = pending;
+    pending = NULL;
+    run_line(text); // an unclosed one is reported as invalid syntax
+    free(text);
+    return 0;
+}
 
-        // this does not work
-        if (argv[1][0] == '%')
-        { // Job id was supplied
-            status = get_job_pgid(argv[1]);
-            if (!status)
-            {
-                return;
-            }
-            // printf("builtin kill before status: %d\n", status); // remove
-            pid = status - 2 * status; // make it negative to kill all in pgid
-        }
-        else
-        {
-            pid = atoi(argv[1]);
-        }
+/* Batch mode: runs every line of a script or a pipe without readline,
+ * prompts or terminal handoff.  Returns the status of the last job. */
+static int run_batch(FILE *in)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
 
-        if (!pid)
-        {
-            printf("pssh: invalid pid number: %d \n", pid);
-            return;
-        }
-        if (!check_pid(pid))
-            return; // pid cannot be sent a signal
+    while ((len = getline(&line, &cap, in)) != -1)
+    {
+        if (len && line[len - 1] == '\n')
+            line[len - 1] = '\0';
 
-        // this works for pids but not jobs (pgids)
-        // printf("builtin kill negative group pid: %d\n", pid); // remove
-        status = kill(pid, SIGTERM);
-        // printf("builtin kill status after kill: %d\n", status); // remove
-        if (status == -1)
-        {
-            printf("Sending signal to process %d was unsuccessful! \n", pid);
-            return;
-        }
-    }
-    else if (argc >= 4 && !strcmp(argv[1], "-s"))
-    { // -->kill [-s <signal>] <pid> | %%<job>
-        pid_t pid;
+        if (line[strspn(line, " \t")] == '#')
+            continue; // comment or #! line
 
-        int i = 3;
-        while (argv[i] != NULL)
-        {
-            if (argv[i][0] == '%')
-            { // Job id was supplied
-                status = get_job_pgid(argv[3]);
-                if (!status)
-                {
-                    return;
-                }
-                pid = status - 2 * status;
-            }
-            else
-            {
-                pid = atoi(argv[3]);
-            }
+        feed_line(line);
+        flush_notices();
+    }
+    feed_line(NULL);
 
-            int signal = atoi(argv[2]);
+    free(line);
+    return last_status;
+}
 
-            if (!pid)
-            {
-                printf("pssh: invalid pid number: %d \n", pid);
-                return;
-            }
-            if (!check_pid(pid))
-            {
-                return;
-            }
+// Runs the lines of a -c string
+static int run_string(char *str)
+{
+    char *line;
 
-            status = kill(pid, signal);
-            if (status == -1)
-            {
-                printf("Sending signal %d to process %d was unsuccessful! \n", signal, pid);
-                return;
-            }
-            ++i;
-        }
-    }
-    else
+    while ((line = strsep(&str, "\n")) != NULL)
     {
-        printf("Invalid arguments. \n");
-        printf("Usage: kill [-s <signal>] <pid> | %%<job> ... \n");
+        feed_line(line);
+        flush_notices();
     }
+    feed_line(NULL);
+    return last_status;
 }
 
-// bring background job to FG
-void fg(char **argv)
+// appends the latency stats to the statslog file as one line of JSON
+static void write_stats_log()
 {
-    int status;
-    int argc = 0;
-    pid_t pgid;
-
-    while (argv[argc] != NULL)
-    {
-        argc++;
-    }
+    FILE *log;
 
-    if (argc == 1)
-    {
-        printf("Usage: fg %%<job number> \n");
-        printf("\n");
+    if (!stats_log || !(log = fopen(stats_log, "a")))
         return;
-    }
-    else
-    {
-        if (argv[1][0] == '%')
-        { // Job id was supplied
-            status = get_job_pgid(argv[1]);
-            if (!status)
-            {
-                return;
-            }
-            pgid = status;
-        }
-        else
-        {
-            printf("Usage: fg %%<job number> \n");
-            printf("\n");
-            return;
-        }
-        set_fg_pgrp(pgid);
-        // set_fg_pgrp(0);
-        // add condition to check for bg
-        int i = 0;
-        while (jobs[i]->pgid != pgid)
-        {
-            ++i;
-        }
-        // if (jobs[i]->name[strlen(jobs[i]->name - 1)] == '&')
-        printf("\n[%i] + continued	%s\n", jobs[i]->job_id, jobs[i]->name);
-        // fflush(stdout);
-    }
+
+    stats_print_json(log);
+    fclose(log);
 }
 
-// continue a bg job
-void bg(char **argv)
+// readline callback: hand the line to the main loop and stop reading until it has run
+static char *input_line;
+static int input_ready = 0;
+
+static void line_handler(char *line)
 {
-    int status;
-    int argc = 0;
-    pid_t pgid;
+    input_line = line;
+    input_ready = 1;
+    rl_callback_handler_remove();
+}
 
-    while (argv[argc] != NULL)
-    {
-        argc++;
+int main(int argc, char **argv)
+{
+    char prompt[MAX_BUF + 2];
+    struct pollfd pfd[2];
+    int more = 0; // a loop or a function is still open: prompt for the rest
+
+    shell_pid = getpid();
+    if (argc > 1 && !strcmp(argv[1], "-S"))
+    { // pssh -S ...: fork the server now, while the shell is small
+        if (forksrv_start() == -1)
+            fprintf(stderr, "pssh: cannot start the fork server: %s\n", strerror(errno));
+        argv[1] = argv[0];
+        argc--;
+        argv++;
     }
 
-    if (argc == 1)
-    {
-        printf("Usage: fg %%<job number> \n");
-        printf("\n");
-        return;
+    interactive = (argc == 1 && isatty(STDIN_FILENO));
+    expand_var = script_var;
+    expand_cmd = capture;
+    expand_proc = proc_subst;
+    setup_signals();
+    atexit(write_stats_log);
+
+    if (argc > 2 && !strcmp(argv[1], "-d"))
+    { // pssh -d socket
+        return daemon_run(argv[2]);
     }
-    else
-    {
-        if (argv[1][0] == '%')
-        { // Job id was supplied
-            status = get_job_pgid(argv[1]);
-            if (!status)
-            {
-                return;
-            }
-            pgid = status;
-        }
-        else
+    else if (argc > 2 && !strcmp(argv[1], "-c"))
+    { // pssh -c 'cmd'
+        return run_string(argv[2]);
+    }
+    else if (argc > 1)
+    { // pssh script.pssh
+        FILE *script = fopen(argv[1], "r");
+        if (!script)
         {
-            printf("Usage: fg %%<job number> \n");
-            printf("\n");
-            return;
+            fprintf(stderr, "pssh: %s: %s\n", argv[1], strerror(errno));
+            return 127;
         }
-        printf("pgid for bg %d\n", pgid);
-        kill(pgid, SIGCONT);
-        // int i = 0;
-        // while (jobs[i]->pgid != pgid)
-        // {
-        //     ++i;
-        // }
-        // printf("\n[%i] + continued	%s\n", jobs[i]->job_id, jobs[i]->name);
+        return run_batch(script);
+    }
+    else if (!interactive)
+    { // commands piped in
+        return run_batch(stdin);
     }
-}
-
-//==========================================================JOB CONTROLL FUNCTIONS====================================================
 
-// add a new job to the job array - return a pointer to the structure
-Job *create_job(int npids, int pgid, int *pids, int is_bg, char *name, int job_id)
-{
-    Job *job = (Job *)malloc(sizeof(Job));
-    strncpy(job->name, name, MAX_BUF);
-    job->npids = npids;
-    job->pgid = pgid;
-    job->job_id = job_id + 1;
-    job->pids = pids;
+    print_banner();
 
-    if (is_bg)
-    {
-        job->status = BG;
-        print_new_bg_job(job);
+    if (isatty(STDOUT_FILENO))
+    { // Store terminal
+        our_tty = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
     }
     else
     {
-        job->status = FG;
+        our_tty = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
     }
-    return job;
-}
 
-// return the lowest free index in the jobs array
-int check_free_job()
-{
-    int i;
+    pfd[0].fd = STDIN_FILENO;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sig_fd;
+    pfd[1].events = POLLIN;
+
+    rl_callback_handler_install(build_prompt(prompt), line_handler);
 
-    for (i = 0; i < job_num; i++)
+    while (1)
     {
-        if (jobs[i]->status == 1)
-        {
-            free(jobs[i]);
-            return i;
-        }
-    }
-    job_num++;
-    return job_num - 1;
-}
+        if (poll(pfd, 2, -1) < 0)
+            continue; // EINTR
 
-// Sets a terminated child pid to 0 in a job structure and return pgid of job
-int remove_child(int chld_pid)
-{
-    int i, n;
+        if (pfd[1].revents & POLLIN)
+            handle_signals(); // notices wait for the next prompt
 
-    // printf("Removing child pid %d \n", chld_pid);
-    for (i = 0; i < job_num; i++)
-    { // go through all the jobs
+        uint64_t start = stats_now();
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+            rl_callback_read_char();
 
-        for (n = 0; n < jobs[i]->npids; n++)
-        { // go through child pids of that job
-            if (jobs[i]->pids[n] == chld_pid)
-            {
-                jobs[i]->pids[n] = 0; // set matched pid to 0;
-                return jobs[i]->pgid;
-            }
+        if (!input_ready)
+            continue;
+        stats_record(STAT_READLINE, start);
+
+        input_ready = 0;
+        if (!input_line) /* EOF (ex: ctrl-d) */
+        {
+            feed_line(NULL);
+            exit(EXIT_SUCCESS);
         }
+
+        more = feed_line(input_line);
+        free(input_line);
+
+        flush_notices();
+        rl_callback_handler_install(more ? "> " : build_prompt(prompt), line_handler);
     }
-    return -1;
 }
 
-/*Checks if all children in a job have terminated
-If yes = return 0
-If no = return 1*/
-int check_job_status(int pgid)
-{
-    int i, n;
+//========================================================BUILT IN FUNCTIONS==========================================================
 
-    for (i = 0; i < job_num; i++)
-    { // go through all the jobs
+//==========================================================JOB CONTROLL FUNCTIONS====================================================
 
-        if (jobs[i]->pgid == pgid)
-        { // found the job
-            for (n = 0; n < jobs[i]->npids; n++)
-            { // go through child pids of that job
-
-                if (jobs[i]->pids[n])
-                {
-                    return 1;
-                }
-                else if (n == jobs[i]->npids - 1)
-                {
-                    delete_job(jobs[i]);
-                    return 0;
-                }
-            }
-        }
-    }
-    return -1;
-}
 
 // Prints [job num] pid pid ....
 void print_new_bg_job(Job *job)
 {
-    int i;
+    unsigned int i;
     printf("\n");
     printf("[%d] ", job->job_id);
     for (i = 0; i < job->npids; i++)
@@ -849,54 +1435,22 @@ void print_new_bg_job(Job *job)
     printf("\n");
 }
 
-// Prints job info for "jobs" command
-void print_job(Job *job)
-{
-
-    if (job->status == 1)
-    { // do not print terminated jobs
-        return;
-    }
-    char *job_status;
-    if (job->status == 0)
-    {
-        job_status = "stopped";
-    }
-    else if (job->status == 2 || job->status == 3)
-    {
-        job_status = "running";
-    }
-    // printf("\n");
-    printf("[%d] + %s    %s \n", job->job_id, job_status, job->name);
-    // printf("\n");
-}
-
 // Changes the status of the job (STOPPED/BG)
 void change_job_status(int pgid, int status)
 {
-    int i;
-    for (i = 0; i < job_num; i++)
-    {
-        if (jobs[i]->pgid == pgid)
-        {
+    Job *job = find_job(pgid);
 
-            jobs[i]->status = status;
-            set_fg_pgrp(0);
+    if (job)
+    {
+        job->status = status;
 
-            if (status == 2)
-            {
-                printf("\n[%d] + %s    %s \n", jobs[i]->job_id, "continued", jobs[i]->name);
-            }
-            else if (status == 0)
-            {
-                printf("\n[%d] + %s    %s\n", jobs[i]->job_id, "suspended", jobs[i]->name);
-            }
+        if (status == BG)
+        {
+            notify("\n[%d] + %s    %s \n", job->job_id, "continued", job->name);
+        }
+        else if (status == STOPPED)
+        {
+            notify("\n[%d] + %s    %s\n", job->job_id, "suspended", job->name);
         }
     }
 }
-
-void delete_job(Job *job)
-{
-    // printf("\n[%d] + done %s \n", job->job_id, job->name);
-    job->status = TERM;
-}
\ No newline at end of file
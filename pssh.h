@@ -0,0 +1,32 @@
+#ifndef _pssh_h_
+#define _pssh_h_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+struct pollfd;
+struct Job;
+struct Parse;
+
+/* Shell state and helpers shared with the builtins */
+
+extern int interactive;   /* reading commands from a terminal */
+extern int last_status;   /* exit status of the last foreground job */
+extern pid_t shell_pid;    /* $$: the shell's pid, also in the copy that runs a $(...) */
+extern int report_usage;  /* set rusage=on: print the resource usage of every finished job */
+extern char* stats_log;   /* set statslog=path: file the stats are appended to on exit */
+extern int pipe_size;     /* set pipesize=N: F_SETPIPE_SZ of inter-stage pipes, 0 for the default */
+extern int spread_stages; /* set affinity=spread: stage i runs on the i-th allowed CPU */
+extern void (*job_hook) (struct Job* job, int done);  /* pssh -d: told of every job as it is
+                                                        created and once it is done */
+extern void (*error_hook) (const char* msg);  /* pssh -d: takes what shell_error would print */
+
+void set_fg_pgrp (pid_t pgrp);
+void wait_fg_job (pid_t pgid);
+void poll_events (struct pollfd* fds, int nfds, int timeout);
+const char* command_found (const char* cmd);
+void execute_tasks (struct Parse* P, char* cmdline);
+void flush_notices (void);
+void shell_error (FILE* out, const char* fmt, ...);
+
+#endif /* _pssh_h_ */
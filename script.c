@@ -0,0 +1,896 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "script.h"
+#include "parse.h"
+#include "arena.h"
+#include "expand.h"
+#include "hash.h"
+#include "stats.h"
+#include "vars.h"
+#include "pssh.h"
+
+#define MAX_CALL_DEPTH 256
+
+typedef enum
+{
+    N_PIPE,
+    N_FOR,
+    N_WHILE,
+    N_UNTIL,
+    N_GROUP,
+    N_FUNC,
+    N_BREAK,
+    N_CONTINUE,
+    N_RETURN
+} NodeType;
+
+typedef struct Node
+{
+    NodeType type;
+    Sequence then;      // how the node after it runs
+    struct Node *next;  // the next node of the list
+    Parse *P;           // N_PIPE: the pipeline; N_FOR: the words, as the argv of a task
+    const char **paths; // N_PIPE: the command of each task, resolved...
+    unsigned int gen;   // ...against this generation of the PATH cache
+    char *name;         // N_FOR: the variable; N_FUNC: the function
+    struct Node *cond;  // N_WHILE, N_UNTIL
+    struct Node *body;  // N_FOR, N_WHILE, N_UNTIL, N_GROUP, N_FUNC
+    int n;              // N_BREAK, N_CONTINUE: levels; N_RETURN: status, -1 for $?
+} Node;
+
+// a compiled line; its nodes live as long as a run or a function needs them
+typedef struct
+{
+    Arena *A;       // the nodes and texts
+    Parse **parses; // the pipelines, each in its own arena
+    int nparses;
+    int refs;
+} Script;
+
+typedef struct Function
+{
+    char *name;
+    Node *body;
+    Script *script;
+    struct Function *next;
+} Function;
+
+typedef struct
+{ // a function call
+    char **argv; // $0 $1 ...
+    int argc;
+} Frame;
+
+static Function *functions = NULL;
+static Script *running = NULL; // the script whose nodes are running
+static Frame *frame = NULL;
+static int depth = 0; // function calls in progress
+static int loops = 0; // loops running in the current function (or outside of any)
+
+// unwinding in progress: levels of loops to leave (or of which to continue the last), return, ^C
+static int breaking = 0, continuing = 0, returning = 0, interrupted = 0;
+
+//========================================================= COMPILER ===========================================================
+
+typedef struct
+{
+    const char *p; // next unread character
+    int error;
+    Script *S;
+} Scanner;
+
+#define IS_DELIM(c) ((c) == '\0' || strchr(" \t\r\n;&|<>()", (c)))
+#define IS_NAME(c) ((c) == '_' || ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || ((c) >= '0' && (c) <= '9'))
+
+static Node *parse_list(Scanner *sc, const char *stop);
+
+static void skip_blanks(Scanner *sc)
+{
+    while (*sc->p == ' ' || *sc->p == '\t' || *sc->p == '\r')
+    {
+        sc->p++;
+    }
+}
+
+// skips what may come between two commands: blanks, newlines, ';' and comments
+static void skip_separators(Scanner *sc)
+{
+    for (;;)
+    {
+        skip_blanks(sc);
+        if (*sc->p == '\n' || *sc->p == ';')
+            sc->p++;
+        else if (*sc->p == '#')
+            sc->p += strcspn(sc->p, "\n");
+        else
+            return;
+    }
+}
+
+// is the reserved word w next?
+static int next_is(Scanner *sc, const char *w)
+{
+    size_t n = strlen(w);
+
+    skip_blanks(sc);
+    return !strncmp(sc->p, w, n) && IS_DELIM(sc->p[n]);
+}
+
+static int take(Scanner *sc, const char *w)
+{
+    if (!next_is(sc, w))
+        return 0;
+    sc->p += strlen(w);
+    return 1;
+}
+
+// reads a variable or function name, NULL if there is none
+static char *take_name(Scanner *sc, int function)
+{
+    const char *start;
+
+    skip_blanks(sc);
+    for (start = sc->p; IS_NAME(*sc->p) || (function && sc->p > start && (*sc->p == '.' || *sc->p == '-')); sc->p++)
+        ;
+    if (sc->p == start || (*start >= '0' && *start <= '9'))
+        return NULL;
+    return arena_strndup(sc->S->A, start, sc->p - start);
+}
+
+// is "name()" next?  Reads it if so
+static char *take_funcdef(Scanner *sc)
+{
+    const char *start = sc->p;
+    char *name = take_name(sc, 1);
+
+    skip_blanks(sc);
+    if (name && *sc->p == '(')
+    {
+        sc->p++;
+        skip_blanks(sc);
+        if (*sc->p == ')')
+        {
+            sc->p++;
+            return name;
+        }
+    }
+    sc->p = start;
+    return NULL;
+}
+
+/* Returns where the pipeline at p ends: at the ; newline && or || after
+ * it, or just past the & that sends it to the background.  *next is set
+ * to where reading goes on. */
+static const char *pipeline_end(const char *p, const char **next)
+{
+    char q;
+
+    for (;;)
+    {
+        switch (*p)
+        {
+        case '\\':
+            p += p[1] ? 2 : 1; // an escaped ; | & is part of a word
+            continue;
+
+        case '\'':
+        case '"':
+            for (q = *p++; *p && *p != q; p++)
+            {
+                if (q == '"' && *p == '\\' && p[1])
+                    p++;
+            }
+            if (*p)
+                p++;
+            continue; // unterminated, parse_cmdline says so
+
+        case '$':
+        case '<':
+        case '>':
+            if (p[1] == '(' && parse_subst_end(p))
+                p = parse_subst_end(p); // its ; | & are its own, as are those of <(...) and >(...)
+            else
+                p++;
+            continue;
+
+        case '&':
+            if (p[1] != '&')
+            {
+                *next = p + 1;
+                return p + 1;
+            }
+            /* fall through */
+        case '\0':
+        case '\n':
+        case ';':
+            *next = p;
+            return p;
+
+        case '|':
+            if (p[1] == '|')
+            {
+                *next = p;
+                return p;
+            }
+            /* fall through */
+        default:
+            p++;
+        }
+    }
+}
+
+static Node *node(Scanner *sc, NodeType type)
+{
+    Node *n = arena_alloc(sc->S->A, sizeof(*n));
+
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->gen = hash_generation() - 1; // not resolved yet
+    return n;
+}
+
+// parses text as one pipeline, which the script then owns
+static Parse *compile_pipeline(Scanner *sc, const char *text, size_t len)
+{
+    char *line = arena_strndup(sc->S->A, text, len);
+    Script *S = sc->S;
+    Parse *P = parse_cmdline(line);
+
+    if (!P)
+        return NULL;
+
+    S->parses = realloc(S->parses, (S->nparses + 1) * sizeof(*S->parses));
+    S->parses[S->nparses++] = P;
+    if (P->invalid_syntax || P->next)
+        sc->error = 1;
+    return P;
+}
+
+static Node *parse_pipe(Scanner *sc)
+{
+    const char *start = sc->p, *end = pipeline_end(sc->p, &sc->p);
+    Node *n = node(sc, N_PIPE);
+
+    if ((n->P = compile_pipeline(sc, start, end - start)))
+        n->paths = arena_alloc(sc->S->A, n->P->ntasks * sizeof(*n->paths));
+    return n;
+}
+
+static Node *parse_for(Scanner *sc)
+{
+    const char *end, *start;
+    Node *n = node(sc, N_FOR);
+
+    if (!(n->name = take_name(sc, 0)))
+    {
+        sc->error = 1;
+        return n;
+    }
+
+    // the words are the arguments of an "in" command, so none is taken for an assignment
+    skip_blanks(sc);
+    start = sc->p;
+    if (take(sc, "in"))
+    {
+        end = pipeline_end(start, &sc->p);
+        n->P = compile_pipeline(sc, start, end - start);
+        if (n->P && (n->P->ntasks != 1 || n->P->background || n->P->infile || n->P->outfile))
+            sc->error = 1; // just words
+    }
+    else
+    { // no words: the arguments
+        n->P = compile_pipeline(sc, "in \"$@\"", 7);
+    }
+
+    skip_separators(sc);
+    if (!take(sc, "do"))
+    {
+        sc->error = 1;
+        return n;
+    }
+    n->body = parse_list(sc, "done");
+    if (!take(sc, "done"))
+        sc->error = 1;
+    return n;
+}
+
+static Node *parse_while(Scanner *sc, NodeType type)
+{
+    Node *n = node(sc, type);
+
+    n->cond = parse_list(sc, "do");
+    if (!n->cond || !take(sc, "do"))
+    {
+        sc->error = 1;
+        return n;
+    }
+    n->body = parse_list(sc, "done");
+    if (!take(sc, "done"))
+        sc->error = 1;
+    return n;
+}
+
+// the { list; } of a function, or of a group
+static Node *parse_group(Scanner *sc, Node *n)
+{
+    skip_separators(sc);
+    if (!take(sc, "{"))
+    {
+        sc->error = 1;
+        return n;
+    }
+    n->body = parse_list(sc, "}");
+    if (!take(sc, "}"))
+        sc->error = 1;
+    return n;
+}
+
+// break [n], continue [n], return [n]
+static Node *parse_jump(Scanner *sc, NodeType type)
+{
+    Node *n = node(sc, type);
+    char *end;
+
+    skip_blanks(sc);
+    n->n = type == N_RETURN ? -1 : 1;
+    if (*sc->p >= '0' && *sc->p <= '9')
+    {
+        n->n = strtol(sc->p, &end, 10);
+        sc->p = end;
+        if (type != N_RETURN && n->n < 1)
+            sc->error = 1;
+    }
+    return n;
+}
+
+static Node *parse_command(Scanner *sc)
+{
+    Node *n;
+    char *name;
+
+    if (take(sc, "for"))
+        return parse_for(sc);
+    if (take(sc, "while"))
+        return parse_while(sc, N_WHILE);
+    if (take(sc, "until"))
+        return parse_while(sc, N_UNTIL);
+    if (next_is(sc, "{"))
+        return parse_group(sc, node(sc, N_GROUP));
+    if (take(sc, "break"))
+        return parse_jump(sc, N_BREAK);
+    if (take(sc, "continue"))
+        return parse_jump(sc, N_CONTINUE);
+    if (take(sc, "return"))
+        return parse_jump(sc, N_RETURN);
+
+    if (take(sc, "function"))
+    {
+        n = node(sc, N_FUNC);
+        if (!(n->name = take_funcdef(sc)) && !(n->name = take_name(sc, 1)))
+            sc->error = 1;
+        return parse_group(sc, n);
+    }
+    if ((name = take_funcdef(sc)))
+    {
+        n = node(sc, N_FUNC);
+        n->name = name;
+        return parse_group(sc, n);
+    }
+
+    if (next_is(sc, "do") || next_is(sc, "done") || next_is(sc, "}") || next_is(sc, "in"))
+    {
+        sc->error = 1;
+        return NULL;
+    }
+    return parse_pipe(sc);
+}
+
+/* Reads commands up to the reserved word stop (left unread), or up to the
+ * end of the text if stop is NULL. */
+static Node *parse_list(Scanner *sc, const char *stop)
+{
+    Node *head = NULL, **tail = &head, *n = NULL;
+
+    while (!sc->error)
+    {
+        skip_separators(sc);
+        if (!*sc->p || (stop && next_is(sc, stop)))
+        {
+            if ((stop && !*sc->p) || (n && n->then != SEQ_ALWAYS))
+                sc->error = 1; // no closing word, or nothing after && or ||
+            break;
+        }
+
+        if (!(n = parse_command(sc)))
+            break;
+        *tail = n;
+        tail = &n->next;
+
+        skip_blanks(sc);
+        if (!strncmp(sc->p, "&&", 2) || !strncmp(sc->p, "||", 2))
+        {
+            n->then = *sc->p == '&' ? SEQ_AND : SEQ_OR;
+            sc->p += 2;
+        }
+        else if (*sc->p && *sc->p != ';' && *sc->p != '\n' && !(stop && next_is(sc, stop)) && n->type != N_PIPE)
+        {
+            sc->error = 1; // a compound command cannot be piped, redirected or backgrounded
+        }
+    }
+    return head;
+}
+
+static void script_release(Script *S)
+{
+    int i;
+
+    if (--S->refs)
+        return;
+
+    for (i = 0; i < S->nparses; i++)
+    {
+        parse_destroy(&S->parses[i]);
+    }
+    free(S->parses);
+    arena_free(S->A);
+    free(S);
+}
+
+//======================================================== INTERPRETER =========================================================
+
+static void run_list(Node *n);
+
+// resolves the command of every task whose name is known ahead
+static void resolve(Node *n, unsigned int gen)
+{
+    Task *T;
+    int t;
+
+    for (t = 0; t < n->P->ntasks; t++)
+    {
+        T = &n->P->tasks[t];
+        if ((T->patterns && T->patterns[0]) || var_assignment(T->cmd) || script_is_function(T->cmd))
+            n->paths[t] = NULL; // known once expanded
+        else
+            n->paths[t] = command_found(T->cmd);
+    }
+    n->gen = gen;
+}
+
+static void run_pipe(Node *n)
+{
+    unsigned int gen = hash_generation();
+    Arena *A;
+    Parse *P;
+    int t;
+
+    if (!n->P)
+        return;
+    if (n->gen != gen)
+        resolve(n, gen);
+
+    // execute_tasks may change the tasks and allocates in the arena: give it a copy
+    A = arena_new(sizeof(*P) + n->P->ntasks * sizeof(Task) + 256);
+    P = arena_alloc(A, sizeof(*P));
+    *P = *n->P;
+    P->arena = A;
+    P->tasks = arena_alloc(A, P->ntasks * sizeof(Task));
+    for (t = 0; t < P->ntasks; t++)
+    {
+        P->tasks[t] = n->P->tasks[t];
+        P->tasks[t].path = n->paths[t];
+    }
+
+    execute_tasks(P, P->text);
+    arena_free(A);
+
+    if (interactive && last_status == 128 + SIGINT)
+        interrupted = 1; // ^C killed the foreground job, and with it every loop around it
+}
+
+// after a loop body: 1 if the loop is over
+static int loop_ends(void)
+{
+    if (interrupted || returning)
+        return 1;
+    if (breaking)
+    {
+        breaking--;
+        return 1;
+    }
+    if (continuing)
+        return --continuing > 0;
+    return 0;
+}
+
+static void run_for(Node *n)
+{
+    Arena *A = arena_new(256);
+    Task T = n->P->tasks[0];
+    size_t len = strlen(n->name);
+    char **w;
+
+    expand_task(&T, A);
+    last_status = 0;
+
+    loops++;
+    for (w = T.argv + 1; *w; w++)
+    { // past "in"
+        var_set(n->name, len, *w, 0);
+        run_list(n->body);
+        if (loop_ends())
+            break;
+    }
+    loops--;
+    arena_free(A);
+}
+
+static void run_while(Node *n)
+{
+    int status = 0;
+
+    loops++;
+    for (;;)
+    {
+        run_list(n->cond);
+        if (interrupted || returning || breaking || continuing)
+        { // break or continue in the condition acts on this loop too
+            if (loop_ends())
+                break;
+            continue;
+        }
+        if (!last_status != (n->type == N_WHILE))
+            break;
+
+        run_list(n->body);
+        status = last_status;
+        if (loop_ends())
+            break;
+    }
+    loops--;
+    last_status = status;
+}
+
+static void define(Node *n, Script *S)
+{
+    Function *f;
+
+    for (f = functions; f && strcmp(f->name, n->name); f = f->next)
+        ;
+    if (!f)
+    {
+        f = calloc(1, sizeof(*f));
+        f->name = strdup(n->name);
+        f->next = functions;
+        functions = f;
+    }
+    else
+    {
+        script_release(f->script);
+    }
+
+    f->body = n->body;
+    f->script = S;
+    S->refs++;
+}
+
+static void run_node(Node *n)
+{
+    switch (n->type)
+    {
+    case N_PIPE:
+        run_pipe(n);
+        break;
+    case N_FOR:
+        run_for(n);
+        break;
+    case N_WHILE:
+    case N_UNTIL:
+        run_while(n);
+        break;
+    case N_GROUP:
+        run_list(n->body);
+        break;
+    case N_FUNC:
+        define(n, running);
+        last_status = 0;
+        break;
+
+    case N_BREAK:
+    case N_CONTINUE:
+        if (!loops)
+        {
+            shell_error(stderr, "pssh: %s: only meaningful in a loop\n", n->type == N_BREAK ? "break" : "continue");
+            last_status = 1;
+        }
+        else
+        {
+            *(n->type == N_BREAK ? &breaking : &continuing) = n->n < loops ? n->n : loops;
+            last_status = 0;
+        }
+        break;
+
+    case N_RETURN:
+        if (!frame)
+        {
+            shell_error(stderr, "pssh: return: only meaningful in a function\n");
+            last_status = 1;
+        }
+        else
+        {
+            returning = 1;
+            if (n->n >= 0)
+                last_status = n->n & 0xff;
+        }
+        break;
+    }
+}
+
+static void run_list(Node *n)
+{
+    for (; n; n = n->next)
+    {
+        run_node(n);
+        if (breaking || continuing || returning || interrupted)
+            return;
+
+        while (n->next && ((n->then == SEQ_AND && last_status) || (n->then == SEQ_OR && !last_status)))
+        {
+            n = n->next;
+        }
+    }
+}
+
+//=========================================================== API ==============================================================
+
+/* Does the line use a loop, a function or one of the other commands of a
+ * script?  Only then does it need script_run rather than the plain path. */
+int script_wants(const char *line)
+{
+    Scanner sc = {line, 0, NULL};
+
+    for (;;)
+    {
+        skip_separators(&sc);
+        if (!*sc.p)
+            return 0;
+
+        if (next_is(&sc, "for") || next_is(&sc, "while") || next_is(&sc, "until") || next_is(&sc, "{") ||
+            next_is(&sc, "function") || next_is(&sc, "break") || next_is(&sc, "continue") ||
+            next_is(&sc, "return") || next_is(&sc, "do") || next_is(&sc, "done") || next_is(&sc, "}"))
+            return 1;
+        {
+            const char *start = sc.p;
+            char *name;
+            Script tmp = {arena_new(64), NULL, 0, 1};
+
+            sc.S = &tmp;
+            name = take_funcdef(&sc);
+            arena_free(tmp.A);
+            sc.S = NULL;
+            if (name)
+                return 1;
+            sc.p = start;
+        }
+
+        pipeline_end(sc.p, &sc.p);
+        if (*sc.p == '&' || *sc.p == '|')
+            sc.p += 2; // && or ||
+    }
+}
+
+/* Is a loop, a group or a function body of text still open, so that the
+ * caller should read another line and try again with both? */
+int script_incomplete(const char *text)
+{
+    Scanner sc = {text, 0, NULL};
+    int open = 0, body = 0; // constructs open, and a function still without its {
+
+    for (;;)
+    {
+        skip_separators(&sc);
+        if (!*sc.p)
+            return open > 0 || body;
+
+        if (take(&sc, "for"))
+        {
+            open++;
+            pipeline_end(sc.p, &sc.p); // the variable and the words
+        }
+        else if (take(&sc, "while") || take(&sc, "until") || take(&sc, "{"))
+        {
+            open++;
+            body = 0;
+            continue; // a command follows right away
+        }
+        else if (take(&sc, "do"))
+        {
+            continue;
+        }
+        else if (take(&sc, "done") || take(&sc, "}"))
+        {
+            open--;
+        }
+        else if (take(&sc, "function"))
+        {
+            body = 1;
+            sc.p += strcspn(sc.p, "{;\n");
+        }
+        else
+        {
+            const char *p = sc.p + strspn(sc.p, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-");
+
+            p += strspn(p, " \t");
+            if (p > sc.p && *p == '(' && p[1 + strspn(p + 1, " \t")] == ')')
+            { // name()
+                body = 1;
+                sc.p = p + 2 + strspn(p + 1, " \t");
+                continue;
+            }
+            pipeline_end(sc.p, &sc.p);
+        }
+
+        skip_blanks(&sc);
+        if (!strncmp(sc.p, "&&", 2) || !strncmp(sc.p, "||", 2))
+            sc.p += 2;
+    }
+}
+
+// compiles text and runs it, returns the status of the last command run
+int script_run(const char *text)
+{
+    Script *S = calloc(1, sizeof(*S)), *outer = running;
+    Scanner sc = {text, 0, S};
+    uint64_t start = stats_now();
+    Node *list;
+
+    S->A = arena_new(2 * strlen(text) + 1024);
+    S->refs = 1;
+    list = parse_list(&sc, NULL);
+    stats_record(STAT_PARSE, start);
+
+    if (sc.error)
+    {
+        shell_error(stdout, "pssh: invalid syntax \n");
+        last_status = 2;
+    }
+    else
+    {
+        running = S;
+        run_list(list);
+        running = outer;
+        breaking = continuing = interrupted = 0;
+    }
+
+    script_release(S);
+    return last_status;
+}
+
+// does text compile to nothing but function definitions?
+int script_defines_only(const char *text)
+{
+    Script *S = calloc(1, sizeof(*S));
+    Scanner sc = {text, 0, S};
+    Node *n, *list;
+    int only;
+
+    S->A = arena_new(2 * strlen(text) + 1024);
+    S->refs = 1;
+    list = parse_list(&sc, NULL);
+
+    for (only = !sc.error && list, n = list; only && n; n = n->next)
+    {
+        only = n->type == N_FUNC;
+    }
+
+    script_release(S);
+    return only;
+}
+
+int script_is_function(const char *name)
+{
+    Function *f;
+
+    for (f = functions; f; f = f->next)
+    {
+        if (!strcmp(f->name, name))
+            return 1;
+    }
+    return 0;
+}
+
+// runs the function argv[0] with the arguments in argv, returns its status
+int script_call(char **argv)
+{
+    Frame fr = {argv, 0}, *caller = frame;
+    Script *outer = running, *S;
+    Function *f;
+    int caller_loops = loops;
+
+    for (f = functions; f && strcmp(f->name, argv[0]); f = f->next)
+        ;
+    if (!f)
+        return 127;
+    if (depth == MAX_CALL_DEPTH)
+    {
+        shell_error(stderr, "pssh: %s: functions nested too deeply\n", argv[0]);
+        interrupted = 1;
+        return 1;
+    }
+
+    while (argv[fr.argc])
+    {
+        fr.argc++;
+    }
+
+    S = f->script;
+    S->refs++; // it may redefine itself while it runs
+    running = S;
+    frame = &fr;
+    loops = 0;
+    depth++;
+
+    last_status = 0;
+    run_list(f->body);
+    returning = 0;
+
+    depth--;
+    loops = caller_loops;
+    frame = caller;
+    running = outer;
+    script_release(S);
+    return last_status;
+}
+
+// expand_var: $? $$ and the arguments of the function running, or else the shell's variables
+const char *script_var(const char *name, size_t len)
+{
+    static char num[32];
+    static char *joined = NULL;
+    size_t i, n;
+
+    if (len == 1)
+    {
+        switch (*name)
+        {
+        case '?':
+            snprintf(num, sizeof(num), "%d", last_status);
+            return num;
+        case '$':
+            snprintf(num, sizeof(num), "%d", (int)shell_pid); // the shell's, in a $(...) too
+            return num;
+        case '#':
+            snprintf(num, sizeof(num), "%d", frame ? frame->argc - 1 : 0);
+            return num;
+        case '@':
+        case '*':
+            free(joined);
+            joined = NULL;
+            for (i = 1, n = 0; frame && (int)i < frame->argc; i++)
+            {
+                joined = realloc(joined, n + strlen(frame->argv[i]) + 2);
+                n += sprintf(joined + n, i > 1 ? " %s" : "%s", frame->argv[i]);
+            }
+            return joined ? joined : "";
+        }
+    }
+
+    if (strspn(name, "0123456789") >= len)
+    { // exactly len digits: $12 is $1 and a 2, ${12} the twelfth
+        for (i = 0, n = 0; n < len; n++)
+        {
+            i = i * 10 + (name[n] - '0');
+            if (i > INT_MAX)
+                return NULL;
+        }
+        if (i == 0)
+            return frame ? frame->argv[0] : "pssh";
+        return frame && (int)i < frame->argc ? frame->argv[i] : NULL;
+    }
+
+    return var_get(name, len);
+}
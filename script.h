@@ -0,0 +1,34 @@
+#ifndef _script_h_
+#define _script_h_
+
+#include <stddef.h>
+
+/* Loops and functions.
+ *
+ *     for name [in word...]; do list; done
+ *     while list; do list; done          (or until)
+ *     name() { list; }                   (or function name { list; })
+ *     { list; }   break [n]   continue [n]   return [n]
+ *
+ * where a list is pipelines and these commands, separated by ; & && ||
+ * or newlines.  A line that uses any of them is compiled once into a
+ * tree: each pipeline is parsed by parse_cmdline() up front, with its
+ * commands resolved ahead (again only when the PATH cache is flushed),
+ * and a run only copies its argv and expands the words that have
+ * patterns.  The loop variable is a shell variable like any other; the
+ * arguments of a function ($1..., $#, $@) are seen by expansion through
+ * script_var().
+ *
+ * A function runs in the shell, as a lone foreground command; it cannot
+ * be piped, redirected or sent to the background. */
+
+int script_wants (const char* line);
+int script_incomplete (const char* text);
+int script_run (const char* text);
+int script_defines_only (const char* text);
+
+int script_is_function (const char* name);
+int script_call (char** argv);
+const char* script_var (const char* name, size_t len);
+
+#endif /* _script_h_ */
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+
+#include "spawn.h"
+#include "forksrv.h"
+#include "vars.h"
+
+static posix_spawnattr_t attr_new_pgrp; // child leads a new process group
+static posix_spawnattr_t attr_join_pgrp; // child joins an existing group (pgid set per call)
+static int attr_ready = 0;
+
+// signals whose disposition the shell changes and children must not inherit
+static const int child_default_sigs[] = {
+    SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE, 0};
+
+static void init_attr(posix_spawnattr_t *attr)
+{
+    sigset_t def, mask;
+    int i;
+
+    sigemptyset(&def);
+    for (i = 0; child_default_sigs[i]; i++)
+    {
+        sigaddset(&def, child_default_sigs[i]);
+    }
+    sigemptyset(&mask);
+
+    posix_spawnattr_init(attr);
+    posix_spawnattr_setflags(attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigdefault(attr, &def);
+    posix_spawnattr_setsigmask(attr, &mask);
+    posix_spawnattr_setpgroup(attr, 0);
+}
+
+/* execve(), and for a file without a #! line /bin/sh with path and the
+ * arguments.  For the child of a fork: only async-signal-safe calls, the
+ * argv for sh is on the stack.  Returns only if both failed. */
+void spawn_exec(const char *path, char **argv, char **envp)
+{
+    int argc = 0;
+
+    execve(path, argv, envp);
+    if (errno != ENOEXEC)
+        return;
+
+    while (argv[argc])
+        argc++;
+    {
+        char *sh[argc + 2];
+
+        sh[0] = "sh";
+        sh[1] = (char *)path;
+        memcpy(sh + 2, argv + 1, argc * sizeof(*sh)); // argv[1..] and its NULL
+        execve("/bin/sh", sh, envp);
+    }
+    errno = ENOEXEC; // the script's error, not the shell's
+}
+
+/* Starts path with argv in process group pgid (0 = new group) reading from fd_in
+ * and writing to fd_out.  Returns the pid of the child, or -1 if it could not be
+ * started (errno is set).  All other descriptors the shell wants to keep from the
+ * child must be opened close-on-exec. */
+pid_t spawn_cmd(const char *path, char **argv, int fd_in, int fd_out, pid_t pgid)
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t *attr;
+    pid_t pid;
+    int err;
+
+    if (!attr_ready)
+    {
+        init_attr(&attr_new_pgrp);
+        init_attr(&attr_join_pgrp);
+        attr_ready = 1;
+    }
+
+    if (pgid)
+    {
+        attr = &attr_join_pgrp;
+        posix_spawnattr_setpgroup(attr, pgid);
+    }
+    else
+    {
+        attr = &attr_new_pgrp;
+    }
+
+    posix_spawn_file_actions_init(&fa);
+    if (fd_in != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&fa, fd_in, STDIN_FILENO);
+    if (fd_out != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&fa, fd_out, STDOUT_FILENO);
+
+    err = posix_spawn(&pid, path, &fa, attr, argv, var_environ());
+    if (err == ENOEXEC)
+    { // no #! line: a script for sh
+        char **sh;
+        int argc = 0;
+
+        while (argv[argc])
+            argc++;
+        sh = malloc((argc + 2) * sizeof(*sh));
+        sh[0] = "sh";
+        sh[1] = (char *)path;
+        memcpy(sh + 2, argv + 1, argc * sizeof(*sh));
+        err = posix_spawn(&pid, "/bin/sh", &fa, attr, sh, var_environ());
+        free(sh);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/* Like spawn_cmd, but the child is held between fork and exec until the caller
+ * closes *release_fd, so that it can be set up from the outside first (perf
+ * counters with enable_on_exec).  This needs a real fork, and so is only used
+ * when asked for, and done by the fork server if there is one (a fork of the
+ * shell costs more as it grows).  The child only makes async-signal-safe calls. */
+pid_t spawn_cmd_held(const char *path, char **argv, int fd_in, int fd_out, pid_t pgid, int *release_fd)
+{
+    char **envp = var_environ(); // before the fork: nothing to build in the child
+    sigset_t mask;
+    pid_t pid;
+    int go[2], i;
+    char c;
+
+    if (forksrv_running())
+    {
+        pid = forksrv_spawn(path, argv, fd_in, fd_out, pgid, release_fd);
+        if (pid >= 0 || (errno != E2BIG && errno != EPIPE))
+            return pid;
+    }
+
+    if (pgid && kill(-pgid, 0) < 0 && errno == ESRCH)
+    { // same failure as spawn_cmd when the group to join is gone
+        errno = EPERM;
+        return -1;
+    }
+
+    if (pipe2(go, O_CLOEXEC) == -1)
+        return -1;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        close(go[0]);
+        close(go[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        setpgid(0, pgid);
+        for (i = 0; child_default_sigs[i]; i++)
+        {
+            signal(child_default_sigs[i], SIG_DFL);
+        }
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+
+        if (fd_in != STDIN_FILENO)
+            dup2(fd_in, STDIN_FILENO);
+        if (fd_out != STDOUT_FILENO)
+            dup2(fd_out, STDOUT_FILENO);
+
+        close(go[1]);
+        while (read(go[0], &c, 1) < 0 && errno == EINTR)
+            ; // EOF: released
+
+        spawn_exec(path, argv, envp);
+        write(STDERR_FILENO, "pssh: failed to exec ", 21);
+        write(STDERR_FILENO, path, strlen(path));
+        write(STDERR_FILENO, "\n", 1);
+        _exit(127);
+    }
+
+    setpgid(pid, pgid ? pgid : pid); // also from here, so the group exists once we return
+    close(go[0]);
+    *release_fd = go[1];
+    return pid;
+}
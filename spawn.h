@@ -0,0 +1,22 @@
+#ifndef _spawn_h_
+#define _spawn_h_
+
+#include <sys/types.h>
+
+/* Process launch engine.
+ *
+ * Children are started with posix_spawn() so that no shell code ever
+ * runs in the child between fork and exec.  The child is placed in
+ * process group pgid (0 = a new group led by the child), its stdin and
+ * stdout are taken from fd_in/fd_out, and every signal the shell
+ * handles or blocks is reset to its default disposition.  The child's
+ * environment is the shell's exported variables (see var_environ).
+ *
+ * A file that is executable but has no #! line (exec fails with ENOEXEC)
+ * is run by /bin/sh instead, as execvp() and sh do. */
+
+pid_t spawn_cmd (const char* path, char** argv, int fd_in, int fd_out, pid_t pgid);
+pid_t spawn_cmd_held (const char* path, char** argv, int fd_in, int fd_out, pid_t pgid, int* release_fd);
+void spawn_exec (const char* path, char** argv, char** envp);
+
+#endif /* _spawn_h_ */
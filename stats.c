@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define NBUCKETS 65 // bucket i holds samples in [2^(i-1), 2^i) ns, bucket 0 the zeros
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t hist[NBUCKETS];
+} Histogram;
+
+static const char *phase_names[NSTATS] = {
+    "readline", "parse", "lookup", "pipe", "spawn", "tcsetpgrp", "launch", "reap"};
+
+static const char *counter_names[NCOUNTERS] = {"spawned", "reaped"};
+
+static Histogram phases[NSTATS];
+static uint64_t counters[NCOUNTERS];
+
+// records the time elapsed since start_ns (from stats_now) as one sample of phase
+void stats_record(StatPhase phase, uint64_t start_ns)
+{
+    Histogram *h = &phases[phase];
+    uint64_t ns = stats_now() - start_ns;
+
+    if (!h->count || ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->count++;
+    h->sum += ns;
+    h->hist[ns ? 64 - __builtin_clzll(ns) : 0]++;
+}
+
+void stats_count(StatCounter counter)
+{
+    counters[counter]++;
+}
+
+uint64_t stats_counter(StatCounter counter)
+{
+    return counters[counter];
+}
+
+void stats_reset()
+{
+    memset(phases, 0, sizeof(phases));
+    memset(counters, 0, sizeof(counters));
+}
+
+// largest sample bucket i can hold
+static uint64_t bucket_top(int i)
+{
+    return i == 64 ? UINT64_MAX : (1ull << i) - 1;
+}
+
+// upper bound of the bucket holding the p-th percentile sample
+static uint64_t percentile(Histogram *h, double p)
+{
+    uint64_t rank = (uint64_t)(h->count * p), seen = 0;
+    int i;
+
+    for (i = 0; i < NBUCKETS; i++)
+    {
+        seen += h->hist[i];
+        if (seen > rank)
+            return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+    }
+    return h->max;
+}
+
+// 1234567 -> "1.23ms"
+static const char *fmt_ns(char *buf, uint64_t ns)
+{
+    if (ns < 1000)
+        sprintf(buf, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        sprintf(buf, "%.2fus", ns / 1e3);
+    else if (ns < 1000000000)
+        sprintf(buf, "%.2fms", ns / 1e6);
+    else
+        sprintf(buf, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+void stats_print(FILE *out)
+{
+    char b[5][32];
+    Histogram *h;
+    int i;
+
+    fprintf(out, "%-10s %8s %10s %10s %10s %10s %10s\n", "phase", "count", "mean", "min", "p50<=", "p99<=", "max");
+    for (i = 0; i < NSTATS; i++)
+    {
+        h = &phases[i];
+        if (!h->count)
+        {
+            fprintf(out, "%-10s %8d\n", phase_names[i], 0);
+            continue;
+        }
+        fprintf(out, "%-10s %8llu %10s %10s %10s %10s %10s\n", phase_names[i], (unsigned long long)h->count,
+                fmt_ns(b[0], h->sum / h->count), fmt_ns(b[1], h->min), fmt_ns(b[2], percentile(h, 0.5)),
+                fmt_ns(b[3], percentile(h, 0.99)), fmt_ns(b[4], h->max));
+    }
+
+    for (i = 0; i < NCOUNTERS; i++)
+    {
+        fprintf(out, "%-10s %8llu\n", counter_names[i], (unsigned long long)counters[i]);
+    }
+}
+
+// one JSON object on one line, histograms as [[upper bound ns, count], ...] of the non-empty buckets
+void stats_print_json(FILE *out)
+{
+    Histogram *h;
+    int i, j, first;
+
+    fprintf(out, "{");
+    for (i = 0; i < NSTATS; i++)
+    {
+        h = &phases[i];
+        fprintf(out, "\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"min_ns\":%llu,\"max_ns\":%llu,"
+                     "\"p50_ns\":%llu,\"p99_ns\":%llu,\"hist\":[",
+                phase_names[i], (unsigned long long)h->count, (unsigned long long)h->sum,
+                (unsigned long long)h->min, (unsigned long long)h->max,
+                (unsigned long long)(h->count ? percentile(h, 0.5) : 0),
+                (unsigned long long)(h->count ? percentile(h, 0.99) : 0));
+
+        for (j = 0, first = 1; j < NBUCKETS; j++)
+        {
+            if (!h->hist[j])
+                continue;
+            fprintf(out, "%s[%llu,%llu]", first ? "" : ",",
+                    (unsigned long long)bucket_top(j), (unsigned long long)h->hist[j]);
+            first = 0;
+        }
+        fprintf(out, "]},");
+    }
+
+    for (i = 0; i < NCOUNTERS; i++)
+    {
+        fprintf(out, "\"%s\":%llu%s", counter_names[i], (unsigned long long)counters[i],
+                i == NCOUNTERS - 1 ? "" : ",");
+    }
+    fprintf(out, "}\n");
+}
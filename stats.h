@@ -0,0 +1,49 @@
+#ifndef _stats_h_
+#define _stats_h_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Latency histograms of the shell's own work.
+ *
+ * Every phase keeps a count, sum, min, max and a histogram with one
+ * bucket per power of 2 nanoseconds, so recording a sample is a clock
+ * read and a few adds and they can stay on all the time. */
+
+typedef enum
+{
+    STAT_READLINE,   /* readline handing back the line once Enter is read */
+    STAT_PARSE,      /* parse_cmdline */
+    STAT_LOOKUP,     /* command_found */
+    STAT_PIPE,       /* creating one pipe between two stages */
+    STAT_SPAWN,      /* starting one stage */
+    STAT_TCSETPGRP,  /* handing the terminal to a job (or back) */
+    STAT_LAUNCH,     /* whole command line, from parsed to every stage started */
+    STAT_REAP,       /* sig_fd readable to the job of the child cleaned up */
+    NSTATS
+} StatPhase;
+
+typedef enum
+{
+    STAT_SPAWNED,    /* children started */
+    STAT_REAPED,     /* children reaped after they terminated */
+    NCOUNTERS
+} StatCounter;
+
+static inline uint64_t stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_record (StatPhase phase, uint64_t start_ns);
+void stats_count (StatCounter counter);
+uint64_t stats_counter (StatCounter counter);
+void stats_reset (void);
+void stats_print (FILE* out);
+void stats_print_json (FILE* out);
+
+#endif /* _stats_h_ */
@@ -0,0 +1,76 @@
+/* Generates builtin_hash.h: a collision free (perfect) hash table for
+ * the builtins listed in builtins.def.
+ *
+ * The smallest power of two table size that can hold every name is
+ * tried first; seeds for phash() are searched until each builtin lands
+ * in a slot of its own, growing the table if no seed works.
+ *
+ *     $ ./tools/mkbuiltins > builtin_hash.h
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "phash.h"
+
+#define MAX_SEEDS 1000000
+
+static const char *names[] = {
+#define BUILTIN(name, fn, flags) name,
+#include "builtins.def"
+#undef BUILTIN
+};
+
+#define NBUILTINS (sizeof(names) / sizeof(names[0]))
+
+// fills slot[] for the given seed, returns 0 on a collision
+static int try_seed(unsigned int seed, unsigned int size, unsigned char *slot)
+{
+    unsigned int i, h;
+
+    memset(slot, 0, size);
+    for (i = 0; i < NBUILTINS; i++)
+    {
+        h = phash(names[i], seed) & (size - 1);
+        if (slot[h])
+            return 0;
+        slot[h] = i + 1;
+    }
+    return 1;
+}
+
+int main()
+{
+    unsigned int size, seed, i;
+    unsigned char *slot;
+
+    for (size = 1; size < NBUILTINS; size *= 2)
+        ;
+
+    for (;; size *= 2)
+    {
+        slot = malloc(size);
+        for (seed = 0; seed < MAX_SEEDS; seed++)
+        {
+            if (try_seed(seed, size, slot))
+                goto found;
+        }
+        free(slot);
+    }
+
+found:
+    printf("/* Generated by tools/mkbuiltins from builtins.def -- do not edit. */\n");
+    printf("#ifndef _builtin_hash_h_\n#define _builtin_hash_h_\n\n");
+    printf("#define BUILTIN_HASH_SEED %uu\n", seed);
+    printf("#define BUILTIN_HASH_SIZE %u\n\n", size);
+    printf("/* phash(name, BUILTIN_HASH_SEED) & (BUILTIN_HASH_SIZE-1) -> 1 + index in builtins.def, 0 = empty */\n");
+    printf("static const unsigned char builtin_slot[BUILTIN_HASH_SIZE] = {");
+    for (i = 0; i < size; i++)
+    {
+        printf("%s%u", i ? ", " : "", slot[i]);
+    }
+    printf("};\n\n#endif /* _builtin_hash_h_ */\n");
+
+    free(slot);
+    return 0;
+}
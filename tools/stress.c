@@ -0,0 +1,240 @@
+/* Stress test for job control under bursts of exiting children.
+ *
+ * Runs the real shell on a pseudo terminal (so it is interactive, with
+ * job control, and needs no tty of its own), launches thousands of
+ * short background pipelines as fast as it reads them, then checks:
+ *   - every job is reported done exactly once,
+ *   - the job table ends up empty,
+ *   - every child the shell spawned was reaped (stats counters),
+ *   - the shell holds no more fds than before the burst,
+ * and prints the reap latency percentiles from the shell's stats.
+ *
+ *     $ make stress            (or ./tools/stress ./pssh [jobs])
+ **********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <pty.h>
+#include <sys/wait.h>
+
+#define TIMEOUT_S 120
+
+static int master = -1;
+static pid_t shell = 0;
+
+static char *out = NULL; // everything the shell printed
+static size_t out_len = 0;
+static size_t out_cap = 0;
+static size_t scanned = 0; // output before this was already searched
+
+static time_t deadline;
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "stress: %s\n", msg);
+    if (shell)
+        kill(shell, SIGKILL);
+    exit(EXIT_FAILURE);
+}
+
+// reads whatever the shell has printed, waiting at most ms
+static void pump(int ms)
+{
+    struct pollfd pfd = {.fd = master, .events = POLLIN};
+    ssize_t n;
+
+    if (time(NULL) > deadline)
+        die("timed out");
+
+    if (poll(&pfd, 1, ms) <= 0)
+        return;
+
+    if (out_len + 65536 + 1 > out_cap)
+    {
+        out_cap = (out_len + 65536 + 1) * 2;
+        out = realloc(out, out_cap);
+    }
+    n = read(master, out + out_len, 65536);
+    if (n <= 0)
+        die("the shell went away");
+    out_len += n;
+    out[out_len] = '\0';
+}
+
+// types line into the shell, reading its output meanwhile so neither side blocks
+static void send_line(const char *line)
+{
+    struct pollfd pfd = {.fd = master, .events = POLLOUT};
+    size_t len = strlen(line), done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        pump(0);
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        n = write(master, line + done, len - done);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            die("write to the shell failed");
+        if (n > 0)
+            done += n;
+    }
+}
+
+// waits for text in output not searched yet, returns the offset just past it
+static size_t expect(const char *text)
+{
+    char *p;
+
+    while (!(p = strstr(out ? out + scanned : "", text)))
+    {
+        pump(100);
+    }
+    scanned = p + strlen(text) - out;
+    return scanned;
+}
+
+// waits for a complete line at offset at, returns a pointer to it (valid until the next pump)
+static char *line_at(size_t at)
+{
+    char *nl;
+
+    while (!(nl = memchr(out + at, '\n', out_len - at)))
+    {
+        pump(100);
+    }
+    *nl = '\0';
+    scanned = nl + 1 - out;
+    return out + at;
+}
+
+static int count_fds(pid_t pid)
+{
+    char path[64];
+    struct dirent *d;
+    DIR *dir;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    if (!(dir = opendir(path)))
+        die("cannot read the shell's /proc fd directory");
+
+    while ((d = readdir(dir)))
+    {
+        n += d->d_name[0] != '.';
+    }
+    closedir(dir);
+    return n;
+}
+
+// number of jobs left in the table, using a pipeline whose output differs from the line typed
+static long jobs_left()
+{
+    send_line("jobs | wc -l | sed s/^/jobs=/ | tr a-z A-Z\n");
+    return atol(line_at(expect("JOBS=")));
+}
+
+static unsigned long long json_field(const char *json, const char *key)
+{
+    const char *p = strstr(json, key);
+
+    return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *pipelines[] = {
+        "true &\n",
+        "true | true &\n",
+        "sleep 0.05 | cat | cat &\n",
+        "sh -c 'exit 3' | true &\n",
+    };
+    const char *pssh = argc > 1 ? argv[1] : "./pssh";
+    int njobs = argc > 2 ? atoi(argv[2]) : 2000;
+    int fds_before, fds_after, done = 0, failed = 0, i;
+    unsigned long long spawned, reaped;
+    char *stats, *p;
+    long left;
+
+    if (njobs <= 0)
+        njobs = 2000;
+    deadline = time(NULL) + TIMEOUT_S;
+
+    shell = forkpty(&master, NULL, NULL, NULL);
+    if (shell < 0)
+        die("forkpty failed");
+    if (shell == 0)
+    {
+        execl(pssh, pssh, (char *)NULL);
+        perror(pssh);
+        _exit(127);
+    }
+
+    // the echo of the typed line never contains the translated text
+    send_line("echo READY | tr A-Z a-z\n");
+    expect("ready");
+    send_line("stats -r\n");
+    jobs_left();
+    fds_before = count_fds(shell);
+
+    for (i = 0; i < njobs; i++)
+    {
+        send_line(pipelines[i % 4]);
+    }
+
+    while ((left = jobs_left()) > 0)
+    {
+        pump(200);
+    }
+
+    // notices are printed before the next prompt, so the last ones are in by the time stats is
+    send_line("stats -j\n");
+    stats = line_at(expect("{\"readline\"") - strlen("{\"readline\""));
+
+    for (p = out; (p = memmem(p, out + out_len - p, "+ done", 6)); p++)
+    { // not strstr: line_at() has cut the output into strings
+        done++;
+    }
+
+    spawned = json_field(stats, "\"spawned\":");
+    reaped = json_field(stats, "\"reaped\":");
+    p = strstr(stats, "\"reap\":");
+    fds_after = count_fds(shell);
+
+    printf("jobs launched     %d\n", njobs);
+    printf("reported done     %d\n", done);
+    printf("jobs left         %ld\n", left);
+    printf("children          %llu spawned, %llu reaped\n", spawned, reaped);
+    printf("shell fds         %d before, %d after\n", fds_before, fds_after);
+    printf("reap latency      %llu reaps, p50 <= %lluns, p99 <= %lluns, max %lluns\n",
+           json_field(p, "\"count\":"), json_field(p, "\"p50_ns\":"),
+           json_field(p, "\"p99_ns\":"), json_field(p, "\"max_ns\":"));
+
+    if (done != njobs)
+    {
+        printf("FAIL: %d jobs were reported done, expected %d\n", done, njobs);
+        failed = 1;
+    }
+    if (spawned != reaped)
+    {
+        printf("FAIL: %llu children spawned but %llu reaped\n", spawned, reaped);
+        failed = 1;
+    }
+    if (fds_after > fds_before)
+    {
+        printf("FAIL: the shell leaked %d fds\n", fds_after - fds_before);
+        failed = 1;
+    }
+
+    send_line("exit\n");
+    waitpid(shell, NULL, 0);
+
+    printf("%s\n", failed ? "stress: FAILED" : "stress: ok");
+    return failed;
+}
@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "vars.h"
+
+#define VAR_BUCKETS 256
+
+extern char **environ;
+
+typedef struct Var
+{
+    char *entry; // "name=value", as it goes into the environment
+    size_t namelen;
+    int exported;
+    struct Var *next;
+} Var;
+
+typedef struct
+{ // what an assignment of vars_push replaced
+    char *name;
+    char *entry; // NULL if the variable was unset
+    int exported;
+} Saved;
+
+static Var *table[VAR_BUCKETS];
+static int loaded = 0;
+
+static char **envp = NULL;             // the exported entries, for the children
+static int env_stale = 1;              // an exported variable changed since envp was built
+static unsigned int env_generation = 0; // bumped every time envp is rebuilt
+
+static Saved *saved = NULL; // vars_push: the replaced variables of every push...
+static int nsaved = 0;
+static int *marks = NULL; // ...and where each push starts among them
+static int nmarks = 0;
+
+// FNV-1a
+static unsigned int hash_name(const char *s, size_t len)
+{
+    unsigned int h = 2166136261u;
+
+    while (len--)
+    {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h % VAR_BUCKETS;
+}
+
+static Var *find(const char *name, size_t len)
+{
+    Var *v;
+
+    for (v = table[hash_name(name, len)]; v; v = v->next)
+    {
+        if (v->namelen == len && !memcmp(v->entry, name, len))
+            return v;
+    }
+    return NULL;
+}
+
+static Var *store(const char *name, size_t len, const char *value, int export)
+{
+    size_t n = strlen(value);
+    char *entry = malloc(len + n + 2);
+    unsigned int h;
+    Var *v;
+
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, n + 1);
+
+    if ((v = find(name, len)))
+    {
+        free(v->entry);
+    }
+    else
+    {
+        h = hash_name(name, len);
+        v = calloc(1, sizeof(*v));
+        v->namelen = len;
+        v->next = table[h];
+        table[h] = v;
+    }
+
+    v->entry = entry;
+    v->exported |= export;
+    if (v->exported)
+        env_stale = 1;
+    return v;
+}
+
+// the variables start out as the environment the shell was given
+static void load()
+{
+    char **e, *eq;
+
+    if (loaded)
+        return;
+    loaded = 1;
+
+    for (e = environ; *e; e++)
+    {
+        if ((eq = strchr(*e, '=')))
+            store(*e, eq - *e, eq + 1, 1);
+    }
+}
+
+static int valid_name(const char *name, size_t len)
+{
+    size_t i;
+
+    if (!len || (name[0] >= '0' && name[0] <= '9'))
+        return 0;
+    for (i = 0; i < len; i++)
+    {
+        if (name[i] != '_' && !(name[i] >= 'a' && name[i] <= 'z') && !(name[i] >= 'A' && name[i] <= 'Z') &&
+            !(name[i] >= '0' && name[i] <= '9'))
+            return 0;
+    }
+    return 1;
+}
+
+// returns the value of the variable of len bytes at name, NULL if it is unset
+const char *var_get(const char *name, size_t len)
+{
+    Var *v;
+
+    load();
+    v = find(name, len);
+    return v ? v->entry + len + 1 : NULL;
+}
+
+/* Sets the variable of len bytes at name to value, and exports it if export
+ * is set (an exported variable stays so).  Returns -1 for an invalid name. */
+int var_set(const char *name, size_t len, const char *value, int export)
+{
+    if (!valid_name(name, len))
+        return -1;
+
+    load();
+    store(name, len, value, export);
+    return 0;
+}
+
+int var_unset(const char *name)
+{
+    size_t len = strlen(name);
+    Var **p, *v;
+
+    load();
+    for (p = &table[hash_name(name, len)]; (v = *p); p = &v->next)
+    {
+        if (v->namelen == len && !memcmp(v->entry, name, len))
+        {
+            *p = v->next;
+            if (v->exported)
+                env_stale = 1;
+            free(v->entry);
+            free(v);
+            break;
+        }
+    }
+    return 0;
+}
+
+// the length of the name if word is an assignment (name=value), else 0
+size_t var_assignment(const char *word)
+{
+    const char *eq = strchr(word, '=');
+
+    return eq && valid_name(word, eq - word) ? eq - word : 0;
+}
+
+// exports the assignments of a command until the matching vars_pop
+void vars_push(char **assigns)
+{
+    size_t len;
+    Var *v;
+
+    load();
+    marks = realloc(marks, (nmarks + 1) * sizeof(*marks));
+    marks[nmarks++] = nsaved;
+
+    for (; assigns && *assigns; assigns++)
+    {
+        len = var_assignment(*assigns);
+        v = find(*assigns, len);
+
+        saved = realloc(saved, (nsaved + 1) * sizeof(*saved));
+        saved[nsaved].name = strndup(*assigns, len);
+        saved[nsaved].entry = v ? strdup(v->entry) : NULL;
+        saved[nsaved].exported = v ? v->exported : 0;
+        nsaved++;
+
+        store(*assigns, len, *assigns + len + 1, 1);
+    }
+}
+
+void vars_pop()
+{
+    Saved *s;
+    Var *v;
+
+    if (!nmarks)
+        return;
+
+    nmarks--;
+    while (nsaved > marks[nmarks])
+    { // latest first, a name may be assigned twice
+        s = &saved[--nsaved];
+        if (s->entry)
+        {
+            v = store(s->name, strlen(s->name), s->entry + strlen(s->name) + 1, 0);
+            v->exported = s->exported;
+            env_stale = 1;
+        }
+        else
+        {
+            var_unset(s->name);
+        }
+        free(s->name);
+        free(s->entry);
+    }
+}
+
+// the environment of a child: every exported variable
+char **var_environ()
+{
+    size_t n = 0, i;
+    Var *v;
+
+    load();
+    if (!env_stale)
+        return envp;
+
+    for (i = 0; i < VAR_BUCKETS; i++)
+    {
+        for (v = table[i]; v; v = v->next)
+        {
+            n += v->exported;
+        }
+    }
+
+    envp = realloc(envp, (n + 1) * sizeof(*envp));
+    for (i = 0, n = 0; i < VAR_BUCKETS; i++)
+    {
+        for (v = table[i]; v; v = v->next)
+        {
+            if (v->exported)
+                envp[n++] = v->entry;
+        }
+    }
+    envp[n] = NULL;
+
+    env_stale = 0;
+    env_generation++;
+    return envp;
+}
+
+// changes whenever the vector returned by var_environ does
+unsigned int var_environ_generation()
+{
+    var_environ();
+    return env_generation;
+}
+
+static int cmp_entries(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// prints name=value for every variable (or every exported one), sorted by name
+void vars_print(FILE *out, int exported)
+{
+    char **v = NULL;
+    size_t n = 0, i;
+    Var *var;
+
+    load();
+    for (i = 0; i < VAR_BUCKETS; i++)
+    {
+        for (var = table[i]; var; var = var->next)
+        {
+            if (var->exported || !exported)
+            {
+                v = realloc(v, (n + 1) * sizeof(*v));
+                v[n++] = var->entry;
+            }
+        }
+    }
+
+    qsort(v, n, sizeof(*v), cmp_entries);
+    for (i = 0; i < n; i++)
+    {
+        fprintf(out, "%s%s\n", exported ? "export " : "", v[i]);
+    }
+    free(v);
+}
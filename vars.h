@@ -0,0 +1,32 @@
+#ifndef _vars_h_
+#define _vars_h_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Shell variables.
+ *
+ * The variables live in a hash table, which starts out as a copy of the
+ * environment the shell was started with.  An exported variable keeps
+ * its "name=value" string whole, so the environment of a child is just
+ * a vector of pointers to those strings: var_environ() rebuilds it only
+ * after an exported variable was set, exported or unset, and the same
+ * vector is otherwise handed to every spawn as it is.
+ *
+ * vars_push() exports the "name=value" words of a command (x=1 cmd) for
+ * as long as that command is being started; vars_pop() puts back what
+ * they replaced. */
+
+const char* var_get (const char* name, size_t len);
+int var_set (const char* name, size_t len, const char* value, int export);
+int var_unset (const char* name);
+size_t var_assignment (const char* word);
+
+void vars_push (char** assigns);
+void vars_pop (void);
+
+char** var_environ (void);
+unsigned int var_environ_generation (void);
+void vars_print (FILE* out, int exported);
+
+#endif /* _vars_h_ */